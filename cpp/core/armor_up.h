@@ -1,35 +1,68 @@
 #ifndef _MONSTER_AVENGERS_ARMOR_UP_
 #define _MONSTER_AVENGERS_ARMOR_UP_
 
+#include <atomic>
 #include <cstdint>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <unordered_map>
 #include <vector>
 #include <algorithm>
 
+#include "supp/arena.h"
+#include "supp/deadline.h"
+#include "supp/memory_usage.h"
+#include "supp/metrics.h"
 #include "supp/timer.h"
+#include "supp/work_stealing.h"
 #include "utils/query.h"
 #include "utils/signature.h"
+#include "utils/signature_set.h"
 #include "utils/jewels_query.h"
 #include "utils/formatter.h"
 #include "utils/output_specs.h"
 #include "or_and_tree.h"
 #include "iterator.h"
+#include "counting.h"
+#include "explore.h"
+#include "points_bound.h"
 
 namespace monster_avengers {
 
   const int FOUNDATION_NUM = 2;
 
-  class ListIterator : public TreeIterator {
+  enum ExploreMode {
+    // Runs the full search pipeline for every candidate skill.
+    EXPLORE_FULL = 0,
+    // Searches the base query once, and tests the candidate skills
+    // against its cached final forest (see ExploreSkill()). Falls
+    // back to the full pipeline for the skills that the cached
+    // jewel keys cannot answer exactly. Opt-in, as its answers can
+    // differ from those of the full pipeline, whose residual holes
+    // depend on the order of the skills.
+    EXPLORE_INCREMENTAL,
+  };
+
+  template <typename Key>
+  class ListIterator : public TreeIterator<Key> {
   public:
-    explicit ListIterator(const std::vector<TreeRoot> &&input) 
-      : forest_(input), current_(0) {}
+    // The list ends early once deadline (if any) has expired. As the
+    // rest of the chain pulls from it, the whole chain stops within
+    // a tree.
+    explicit ListIterator(std::vector<TreeRoot<Key> > &&input,
+                          const Deadline *deadline = nullptr) 
+      : forest_(std::move(input)), current_(0), deadline_(deadline) {}
     
     inline void operator++() override {
       if (current_ < forest_.size()) current_++;
+      if (nullptr != deadline_ && deadline_->Expired()) {
+        current_ = forest_.size();
+      }
     }
 
-    inline const TreeRoot &operator*() const override {
+    inline const TreeRoot<Key> &operator*() const override {
       return forest_[current_];
     }
     
@@ -40,35 +73,42 @@ namespace monster_avengers {
     inline void Reset() override {}
     
   private:
-    std::vector<TreeRoot> forest_;
+    std::vector<TreeRoot<Key> > forest_;
     size_t current_;
+    const Deadline *deadline_;
   };
 
-  class JewelFilterIterator : public TreeIterator {
+  template <typename Key>
+  class JewelFilterIterator : public TreeIterator<Key> {
   public:
-    explicit JewelFilterIterator(TreeIterator *base_iter,
+    explicit JewelFilterIterator(TreeIterator<Key> *base_iter,
                                  const DataSet &data,
-                                 const NodePool *pool,
+                                 const NodePool<Key> *pool,
                                  int effect_id,
                                  const std::vector<Effect> &effects, 
-				 const JewelFilter &jewel_filter)
+				 const JewelFilter &jewel_filter,
+                                 bool frontier = false)
       : base_iter_(base_iter), 
         pool_(pool),
-        hole_client_(data, {effects[effect_id].skill_id}, effects, jewel_filter),
-        current_(0),
-        inverse_points_(sig::InverseKey(effects.begin(),
-                                        effects.begin() + effect_id + 1)) {
+        hole_client_(data, {effects[effect_id].skill_id}, effects, 
+                     jewel_filter, frontier),
+        current_(0, pool->arena()),
+        inverse_points_(sig::InverseKey<Key>(effects.begin(),
+                                             effects.begin() + effect_id + 1)),
+        seconds_(0.0), satisfy_calls_(0) {
+      ScopedTimer timer(&seconds_);
       Proceed();
     }
 
     inline void operator++() override {
+      ScopedTimer timer(&seconds_);
       if (!base_iter_->empty()) {
         ++(*base_iter_);
         Proceed();
       }
     }
 
-    inline const TreeRoot &operator*() const override {
+    inline const TreeRoot<Key> &operator*() const override {
       return current_;
     }
 
@@ -78,37 +118,50 @@ namespace monster_avengers {
 
     inline void Reset() override {}
 
+    inline double Seconds() const override {
+      return seconds_;
+    }
+
+    inline int64_t SatisfyCalls() const override {
+      return satisfy_calls_;
+    }
+
   private:
     inline void Proceed() {
       current_.jewel_keys.clear();
       while (!base_iter_->empty()) {
-        const TreeRoot &root = **base_iter_;
+        const TreeRoot<Key> &root = **base_iter_;
         current_.id = root.id;
         current_.torso_multiplier = root.torso_multiplier;
-        const Signature &key = pool_->Or(current_.id).key;
+        const Key &key = pool_->Or(current_.id).key;
         if (root.jewel_keys.empty()) {
-          const std::unordered_set<Signature> &jewel_keys = 
+          const SortedSignatureSet<Key> &jewel_keys = 
             hole_client_.Query(key);
-          for (const Signature &jewel_key : jewel_keys) {
+          satisfy_calls_ += jewel_keys.size();
+          for (const Key &jewel_key : jewel_keys) {
             if (sig::Satisfy(key | jewel_key, inverse_points_)) {
               current_.jewel_keys.push_back(jewel_key);
             }
           }
         } else {
           int one(0), two(0), three(0), extra(0);
-          for (const Signature &existing_key : root.jewel_keys) {
+          for (const Key &existing_key : root.jewel_keys) {
             hole_client_.GetResidual(key, existing_key,
                                      &one, &two, &three, &extra);
-            Signature key0 = key | existing_key;
-            for (const Signature &jewel_key : 
+            Key key0 = key | existing_key;
+            for (const Key &jewel_key : 
                    hole_client_.Query(one, two, 
                                       three, extra,
                                       root.torso_multiplier)) {
+              satisfy_calls_++;
               if (sig::Satisfy(key0 | jewel_key, inverse_points_)) {
                 current_.jewel_keys.push_back(existing_key + jewel_key);
               }
             }
           }
+          if (hole_client_.frontier()) {
+            RemoveDominated(&current_.jewel_keys);
+          }
         }
         if (current_.jewel_keys.empty()) {
           ++(*base_iter_);
@@ -118,33 +171,53 @@ namespace monster_avengers {
       }
     }
     
-    TreeIterator *base_iter_;
-    const NodePool *pool_;
-    HoleClient hole_client_;
-    TreeRoot current_;
-    Signature inverse_points_;
+    TreeIterator<Key> *base_iter_;
+    const NodePool<Key> *pool_;
+    HoleClient<Key> hole_client_;
+    TreeRoot<Key> current_;
+    Key inverse_points_;
+    double seconds_;
+    int64_t satisfy_calls_;
   };
 
-  class SkillSplitIterator : public TreeIterator {
+  // SkillSplitIterator splits every tree by the points of its skill,
+  // keeping the split trees that can reach the required points. In
+  // witness mode, it only needs to prove that such a tree exists. It
+  // then yields the unsplit tree with the first jewel key that
+  // satisfies the query on the tree's maximum points, without
+  // creating the split nodes. This is only valid for the last
+  // splitter of a chain whose output is not expanded.
+  //
+  // Both modes yield a tree for the same input trees: a split OR has
+  // the key of its OR with the points of its split, so that the split
+  // with the maximum points, which Split() always keeps when a jewel
+  // key satisfies the query on them, is satisfied by that jewel key.
+  template <typename Key>
+  class SkillSplitIterator : public TreeIterator<Key> {
   public:
-    SkillSplitIterator(TreeIterator *base_iter, 
+    SkillSplitIterator(TreeIterator<Key> *base_iter, 
                        const DataSet &data,
-                       NodePool *pool,
+                       NodePool<Key> *pool,
                        int effect_id,
-                       const Query &query)
+                       const Query &query,
+                       bool witness = false)
       : base_iter_(base_iter), pool_(pool), 
         splitter_(data, pool, effect_id, 
                   query.effects[effect_id].skill_id),
         hole_client_(data, query.effects[effect_id].skill_id, query.effects, 
-		     query.jewel_filter),
+		     query.jewel_filter, query.jewel_frontier),
         effect_id_(effect_id),
         required_points_(query.effects[effect_id].points),
-      inverse_points_(sig::InverseKey(query.effects.begin(), 
-                                      query.effects.begin() + effect_id + 1)) {
+        witness_(witness),
+      inverse_points_(sig::InverseKey<Key>(
+          query.effects.begin(), query.effects.begin() + effect_id + 1)),
+      seconds_(0.0), satisfy_calls_(0) {
+      ScopedTimer timer(&seconds_);
       Proceed();
     }
 
     inline void operator++() override {
+      ScopedTimer timer(&seconds_);
       buffer_.pop_back();
       if (buffer_.empty()) {
         ++(*base_iter_);
@@ -152,7 +225,7 @@ namespace monster_avengers {
       }
     }
 
-    inline const TreeRoot &operator*() const override {
+    inline const TreeRoot<Key> &operator*() const override {
       return buffer_.back();
     }
 
@@ -161,47 +234,66 @@ namespace monster_avengers {
     }
 
     inline void Reset() override {}
+
+    inline double Seconds() const override {
+      return seconds_;
+    }
+
+    inline int64_t SatisfyCalls() const override {
+      return satisfy_calls_;
+    }
     
   private:
     inline void Proceed() {
       while (!base_iter_->empty()) {
-        const TreeRoot root = **base_iter_;
-        const OR &node = pool_->Or(root.id);
+        const TreeRoot<Key> &root = **base_iter_;
+        const OR<Key> &node = pool_->Or(root.id);
         int one(0), two(0), three(0), body_holes(0);
 
         int sub_max = splitter_.Max(root);
         int sub_min = 1000;
-        Signature key0 = sig::AddPoints(node.key, effect_id_, sub_max);
-        std::vector<Signature> jewel_candidates;
+        Key key0 = sig::AddPoints(node.key, effect_id_, sub_max);
+        std::vector<Key> jewel_candidates;
 
-        for (const Signature &jewel_key : root.jewel_keys) {
-          HoleClient::GetResidual(node.key, jewel_key,
-                                  &one, &two, &three, &body_holes);
-          for (const Signature &new_key : 
+        for (const Key &jewel_key : root.jewel_keys) {
+          HoleClient<Key>::GetResidual(node.key, jewel_key,
+                                       &one, &two, &three, &body_holes);
+          for (const Key &new_key : 
                  hole_client_.Query(one, two, three, 
                                     body_holes, root.torso_multiplier)) {
-            Signature key1 = jewel_key + new_key;
+            Key key1 = jewel_key + new_key;
+            satisfy_calls_++;
             if (sig::Satisfy(key0 | key1, inverse_points_)) {
               jewel_candidates.push_back(key1);
               int diff = required_points_ - sig::GetPoints(key1, effect_id_);
               if (diff < sub_min) {
                 sub_min = diff;
               }
+              if (witness_) break;
             }
           }
+          if (witness_ && !jewel_candidates.empty()) break;
+        }
+        if (witness_ && !jewel_candidates.empty()) {
+          buffer_.emplace_back(root.id, node, pool_->arena());
+          buffer_.back().jewel_keys.push_back(jewel_candidates.front());
+          break;
         }
         if (!jewel_candidates.empty()) {
           std::vector<int> new_ors = splitter_.Split(root, sub_min);
           for (int or_id : new_ors) {
-            buffer_.emplace_back(or_id, pool_->Or(or_id));
-            const OR &or_node = pool_->Or(or_id);
-            for (const Signature &jewel_key : jewel_candidates) {
+            buffer_.emplace_back(or_id, pool_->Or(or_id), pool_->arena());
+            const OR<Key> &or_node = pool_->Or(or_id);
+            satisfy_calls_ += jewel_candidates.size();
+            for (const Key &jewel_key : jewel_candidates) {
               if (sig::Satisfy(jewel_key | or_node.key, inverse_points_)) {
                 buffer_.back().jewel_keys.push_back(jewel_key);
               }
             }
           }
-          break;
+          // Never empty (see above), but an empty buffer would end
+          // the iterator, so that it moves on to the next tree then.
+          if (!buffer_.empty()) break;
         }
 
         // If there is no valid jewel signatures, we can proceed to
@@ -210,100 +302,316 @@ namespace monster_avengers {
       }
     }
       
-    TreeIterator *base_iter_;
-    NodePool *pool_;
-    SkillSplitter splitter_;
-    HoleClient hole_client_;
+    TreeIterator<Key> *base_iter_;
+    NodePool<Key> *pool_;
+    SkillSplitter<Key> splitter_;
+    HoleClient<Key> hole_client_;
     int effect_id_;
     int required_points_;
-    Signature inverse_points_;
-    std::vector<TreeRoot> buffer_;
+    bool witness_;
+    Key inverse_points_;
+    std::vector<TreeRoot<Key> > buffer_;
+    double seconds_;
+    int64_t satisfy_calls_;
   };
 
-  class DefenseFilterIterator : public ArmorSetIterator {
+  // Engine owns the data set that is shared by all the searches. It
+  // is never modified after construction, so that a single Engine
+  // can serve multiple SearchSessions from different threads
+  // without locking.
+  class Engine {
   public:
-    DefenseFilterIterator(ArmorSetIterator *base_iter,
-			  const DataSet *data,
-			  int min_defense)
-      : base_iter_(base_iter), data_(data), min_defense_(min_defense) {
-      Proceed();
-    }
+    explicit Engine(const std::string &data_folder) 
+      : data_(data_folder) {}
 
-    void operator++() override {
-      ++(*base_iter_);
-      Proceed();
-    }
-    
-    const ArmorSet &operator*() const override {
-      return **base_iter_;
+    inline const DataSet &data() const {
+      return data_;
     }
 
-    bool empty() const override {
-      return base_iter_->empty();
-    }
+    Query OptimizeQuery(const Query &query, bool verbose = true) const {
+      std::vector<double> scores;
+      std::vector<int> indices;
+      for (int i = 0; i < query.effects.size(); ++i) {
+        const Effect &effect = query.effects[i];
+        indices.push_back(i);
+        scores.push_back(data_.EffectScore(effect));
+        if (verbose) {
+          wprintf(L"(%03d) %ls: %.5lf\n", 
+                  effect.skill_id,
+                  data_.skill_system(effect.skill_id).name.c_str(),
+                  scores.back());
+        }
+      }
 
-    int BaseIndex() const override {
-      return base_iter_->BaseIndex();
+      std::sort(indices.begin(), indices.end(), 
+                [&scores](int a, int b) {
+                  return scores[a] < scores[b];
+                });
+      Query optimized = query;
+      optimized.effects.clear();
+      for (int i = 0; i < query.effects.size(); ++i) {
+        optimized.effects.push_back(query.effects[indices[i]]);
+      }
+      return optimized;
     }
-    
+
   private:
-    void Proceed() {
-      while (!base_iter_->empty()) {
-	const ArmorSet &armor_set = **base_iter_;
-	int defense = 0;
-	for (int id : armor_set.ids) defense += data_->armor(id).max_defense;
-	if (defense >= min_defense_) {
-	  break;
-	} else {
-	  ++(*base_iter_);
-	}
-      }
+    const DataSet data_;
+  };
+
+  // Memory usage of a single search.
+  struct SessionStats {
+    size_t or_nodes;
+    size_t and_nodes;
+    // Peak number of bytes taken from the arena by the search, i.e.
+    // the peak memory of this search.
+    size_t arena_peak_bytes;
+    // Bytes held by the arena after the search has been released.
+    size_t arena_reserved_bytes;
+    // Resident set size (in KB) of the process after the search has
+    // been released.
+    long rss_kb;
+    // Peak resident set size (in KB) of the process since it started,
+    // over all the searches so far, not of this one.
+    long process_peak_rss_kb;
+    // States expanded by the ranked output, and subtrees it skipped
+    // for being below the defense of the query (see
+    // RankedExpansionIterator).
+    int64_t expanded_states;
+    int64_t pruned_subtrees;
+    // Whether the search was cut short by its deadline, so that the
+    // results are partial.
+    bool truncated;
+    // Seconds from the start of the search until the first armor set
+    // reached the formatter, negative if there was none.
+    double first_result_seconds;
+    // Seconds spent building the foundation, in each jewel filter and
+    // each skill splitter (without the stages it pulls from), in the
+    // output (ranking, sampling or counting the armor sets) and in
+    // formatting them, out of the search_seconds of the whole search.
+    double foundation_seconds;
+    std::vector<double> jewel_filter_seconds;
+    std::vector<double> skill_splitter_seconds;
+    double expansion_seconds;
+    double format_seconds;
+    double search_seconds;
+    // Armor sets that reached the formatter.
+    int64_t results;
+
+    SessionStats() 
+      : or_nodes(0), and_nodes(0), 
+        arena_peak_bytes(0), arena_reserved_bytes(0),
+        rss_kb(0), process_peak_rss_kb(0),
+        expanded_states(0), pruned_subtrees(0), truncated(false),
+        first_result_seconds(-1.0), foundation_seconds(0.0),
+        jewel_filter_seconds(), skill_splitter_seconds(),
+        expansion_seconds(0.0), format_seconds(0.0), search_seconds(0.0),
+        results(0) {}
+
+    // Sets the time of the whole search. The output gets what the
+    // other stages do not account for.
+    void SetSearchSeconds(double seconds) {
+      search_seconds = seconds;
+      expansion_seconds = seconds - foundation_seconds - format_seconds;
+      for (double stage : jewel_filter_seconds) expansion_seconds -= stage;
+      for (double stage : skill_splitter_seconds) expansion_seconds -= stage;
+      if (expansion_seconds < 0.0) expansion_seconds = 0.0;
     }
 
-    ArmorSetIterator *base_iter_;
-    const DataSet *data_;
-    int min_defense_;
+    void Summarize() const {
+      Log(INFO, L"OR Nodes: %lld\n", or_nodes);
+      Log(INFO, L"AND Nodes: %lld\n", and_nodes);
+      Log(INFO, L"Arena: peak %lld KB, reserved %lld KB", 
+          arena_peak_bytes >> 10, arena_reserved_bytes >> 10);
+      Log(INFO, L"Process RSS: %ld KB, peak since start %ld KB", rss_kb,
+          process_peak_rss_kb);
+      Log(INFO, L"Ranked expansion: %lld states, %lld subtrees pruned",
+          expanded_states, pruned_subtrees);
+      if (first_result_seconds >= 0.0) {
+        Log(INFO, L"First result after %.4lf sec", first_result_seconds);
+      }
+      Log(INFO, L"Foundation: %.4lf sec", foundation_seconds);
+      for (size_t i = 0; i < jewel_filter_seconds.size(); ++i) {
+        Log(INFO, L"Jewel filter %d: %.4lf sec", static_cast<int>(i),
+            jewel_filter_seconds[i]);
+      }
+      for (size_t i = 0; i < skill_splitter_seconds.size(); ++i) {
+        Log(INFO, L"Skill splitter %d: %.4lf sec", static_cast<int>(i),
+            skill_splitter_seconds[i]);
+      }
+      Log(INFO, L"Output: %.4lf sec, formatting: %.4lf sec, "
+          L"%lld results", expansion_seconds, format_seconds, results);
+      if (truncated) {
+        Log(INFO, L"Truncated by the deadline.");
+      }
+    }
   };
 
+  // SearchSession holds all the states of a single search: its own
+  // copy of the data set (carrying the custom amulets of the query),
+  // the NodePool and the iterator chain. A SearchSession should not
+  // be shared among threads, but any number of them can run
+  // concurrently against the same Engine.
+  //
+  // The nodes, the jewel key lists and the iterators of the session
+  // are allocated from the given arena, and are released at once
+  // when the session is destructed. Sessions sharing an arena must
+  // be destructed in the reverse order of their construction.
+  //
+  // With a deadline, the foundation, the tree iterators and the
+  // output stop early once it has expired, and the session keeps the
+  // results found so far (see SessionStats::truncated). A foundation
+  // cut short before its last part has no complete trees, and is
+  // dropped.
+  template <typename Key>
+  class SearchSession {
+  public:
+    // foundation_threads <= 0 means one thread per hardware thread.
+    explicit SearchSession(const Engine &engine, Arena *arena = nullptr,
+                           int foundation_threads = 1,
+                           const Deadline *deadline = nullptr)
+      : owned_arena_(nullptr == arena ? new Arena() : nullptr),
+        arena_(nullptr == arena ? owned_arena_.get() : arena),
+        begin_(arena_->GetMark()), snapshots_(),
+        data_(engine.data()), pool_(arena_),
+        foundation_threads_(foundation_threads), deadline_(deadline),
+        iterators_(), output_iterators_(), ranked_(nullptr),
+        foundation_seconds_(0.0), jewel_filters_(0), instrumented_(false),
+        instrumented_trees_(), instrumented_output_(nullptr) {
+      arena_->ResetPeak();
+    }
 
+    ~SearchSession() {
+      output_iterators_.clear();
+      iterators_.clear();
+      arena_->Rewind(begin_);
+    }
 
+    inline const DataSet &data() const {
+      return data_;
+    }
 
-  class ArmorUp {
-  public:
-    ArmorUp(const std::string &data_folder) 
-      : data_(data_folder), pool_(),
-        iterators_(), output_iterators_() {}
+    inline NodePool<Key> *pool() {
+      return &pool_;
+    }
+
+    // The last iterator of the tree iterator chain.
+    inline TreeIterator<Key> *Trees() {
+      return iterators_.back();
+    }
+
+    // The last iterator of the output (armor set) iterator chain.
+    inline ArmorSetIterator *Output() {
+      return output_iterators_.back();
+    }
     
-    std::vector<TreeRoot> Foundation(const Query &query) {
+    // The foundation is built by foundation_threads threads (see the
+    // constructor). The armors are classified and the merges are
+    // computed in parallel, but the nodes are created afterwards in
+    // the sequential order, so that the node ids do not depend on the
+    // number of threads.
+    std::vector<TreeRoot<Key> > Foundation(const Query &query) {
+      WorkStealingScheduler scheduler(foundation_threads_);
 
       // Forest with no torso up.
+      std::array<ArmorGroups, PART_NUM> part_groups;
+      scheduler.Run(HEAD, PART_NUM, [this, &part_groups, &query](
+          int /*worker*/, int part) {
+          part_groups[part] = ClassifyArmors(static_cast<ArmorPart>(part),
+                                             query);
+        });
       std::array<std::vector<int>, PART_NUM> part_forests;
       for (int part = HEAD; part < PART_NUM; ++part) {
-        part_forests[part] = 
-          std::move(ClassifyArmors(static_cast<ArmorPart>(part),
-                                   query));
+        part_forests[part].reserve(part_groups[part].size());
+        for (auto &item : part_groups[part]) {
+          part_forests[part].push_back(
+              pool_.template MakeOR<ARMORS>(item.first, &item.second));
+        }
       }
       
+      // Branch and bound: a partial set (the parts up to merged) is
+      // dropped if a foundation effect cannot reach its required
+      // points, even with the best armors for the remaining parts
+      // and the best jewels in all the holes.
+      std::vector<Effect> effects;
+      std::vector<int> skill_ids;
+      for (int i = 0; 
+           i < query.effects.size() && i < FOUNDATION_NUM; ++i) {
+        effects.push_back(query.effects[i]);
+        skill_ids.push_back(query.effects[i].skill_id);
+      }
+      PointsBound bound(data_, query, skill_ids);
+      auto feasible = [&effects, &bound](const Key &key, 
+                                         int merged) {
+        for (int i = 0; i < effects.size(); ++i) {
+          int points = key.PointsAt(i) + bound.KeyJewels(key, i);
+          int torso_ups = key.multiplier();
+          for (int part = merged + 1; part < BODY; ++part) {
+            points += bound.Part(part, i);
+            if (bound.TorsoUp(part)) torso_ups++;
+          }
+          if (merged < BODY) {
+            int body = bound.Part(BODY, i);
+            points += (body > 0) ? body * (1 + torso_ups) : body;
+          }
+          if (points < effects[i].points) return false;
+        }
+        return true;
+      };
+
       std::vector<int> current;
       for (int part = HEAD; part < PART_NUM; ++part) {
+        if (Expired()) {
+          current.clear();
+          break;
+        }
         if (HEAD == part) {
-          current = part_forests[part];
+          for (int id : part_forests[part]) {
+            if (feasible(pool_.Or(id).key, part)) {
+              current.push_back(id);
+            }
+          }
         } else {
-          current = std::move(MergeForests(part_forests[part], current,
-                                           part == BODY));
+          current = MergeForests(part_forests[part], current,
+                                 part == BODY, 
+                                 [&feasible, part](const Key &key) {
+                                   return feasible(key, part);
+                                 },
+                                 &scheduler);
         }
       }
 
-      std::vector<TreeRoot> result;
+      // Trees with the most slack on the foundation effects first.
+      std::vector<int> slack(current.size());
+      for (size_t n = 0; n < current.size(); ++n) {
+        const Key &key = pool_.Or(current[n]).key;
+        slack[n] = 1000;
+        for (int i = 0; i < effects.size(); ++i) {
+          slack[n] = (std::min)(slack[n], key.PointsAt(i) + 
+                                bound.KeyJewels(key, i) - effects[i].points);
+        }
+      }
+      std::vector<int> order(current.size());
+      for (size_t n = 0; n < order.size(); ++n) order[n] = n;
+      std::stable_sort(order.begin(), order.end(), [&slack](int a, int b) {
+          return slack[a] > slack[b];
+        });
+
+      std::vector<TreeRoot<Key> > result;
       
-      for (int id : current) {
-        result.emplace_back(id, pool_.Or(id));
+      for (int n : order) {
+        result.emplace_back(current[n], pool_.Or(current[n]), arena_);
       }
 
       return result;
     }
 
-    void SearchCore(const Query &query) {
+    // Builds the tree iterator chain (foundation, jewel filters and
+    // skill splitters) of the query. With witness, the chain only
+    // decides whether a solution exists: the last splitter does not
+    // split the trees (see SkillSplitIterator), so that Trees() must
+    // not be expanded into armor sets.
+    void SearchTrees(const Query &query, bool witness = false) {
       // Add in custom armors
       InitializeExtraArmors(query);
 
@@ -312,156 +620,138 @@ namespace monster_avengers {
       int foundations = (query.effects.size() < FOUNDATION_NUM)
           ? query.effects.size() : FOUNDATION_NUM;
       for (int i = 0; i < foundations; ++i) {
-        CHECK_SUCCESS(ApplySingleJewelFilter(query.effects, i, query.jewel_filter));
+        CHECK_SUCCESS(ApplySingleJewelFilter(query.effects, i, query.jewel_filter,
+                                             query.jewel_frontier));
       }
       for (int i = foundations; i < query.effects.size(); ++i) {
-        CHECK_SUCCESS(ApplySkillSplitter(query, i));	
+        CHECK_SUCCESS(ApplySkillSplitter(
+            query, i, witness && i + 1 == query.effects.size()));
       }
-      CHECK_SUCCESS(PrepareOutput());
-      CHECK_SUCCESS(ApplyDefenseFilter(query));
     }
 
-    template <OutputSpec Spec>
-    void Search(const Query &query, const std::string &output_path = "") {
-      // Optimize the Query
-      Query optimized_query = OptimizeQuery(query);
-
-      SearchCore(optimized_query);
-
-      // Prepare formatter
-      ArmorSetFormatter<Spec> formatter(output_path, &data_, 
-                                        optimized_query);
-      
-      int count = 0;
-      while (count < query.max_results && !output_iterators_.back()->empty()) {
-        formatter(**output_iterators_.back());
-	++count;
-        ++(*output_iterators_.back());
+    // Builds the trees, and the output of the armor sets in the
+    // descending order of defense (within each tree if the query is
+    // anytime), or drawn at random if the query asks for samples.
+    void SearchCore(const Query &query) {
+      if (query.sample) {
+        Sample(query, query.max_results, query.seed);
+        return;
       }
+      SearchTrees(query);
+      CHECK_SUCCESS(PrepareRankedOutput(query));
     }
 
-    std::string SearchEncoded(const Query &query) {
-      // Optimize the Query
-      Query optimized_query = OptimizeQuery(query);
-
-      SearchCore(optimized_query);
-
-      // Prepare formatter
-      EncodeFormatter formatter(&data_, optimized_query);
-
-      std::string output;
-      int count = 0;
-      while (count < query.max_results && !output_iterators_.back()->empty()) {
-        formatter(**output_iterators_.back(), &output);
-	++count;
-        ++(*output_iterators_.back());
-      }
-      return output;
+    // Builds the trees, and the output of k armor sets drawn
+    // uniformly from those with at least the defense of the query.
+    void Sample(const Query &query, int k, uint64_t seed) {
+      SearchTrees(query);
+      CHECK_SUCCESS(PrepareSampledOutput(query, k, seed));
     }
 
-    std::wstring SearchSerialized(const Query &query) {
-      // Optimize the Query
-      Query optimized_query = OptimizeQuery(query);
-
-      SearchCore(optimized_query);
-
-      // Prepare formatter
-      ResultSerializer serializer(&data_, optimized_query);
-
-      std::string output;
-      int count = 0;
-      while (count < query.max_results && !output_iterators_.back()->empty()) {
-        serializer.Add(**output_iterators_.back());
-	++count;
-        ++(*output_iterators_.back());
+    // Builds the trees, and counts their armor sets with at least the
+    // defense of the query without expanding them.
+    SetCount Count(const Query &query) {
+      SearchTrees(query);
+      SetCounter<Key> counter(&pool_, &data_);
+      SetCount total = 0;
+      TreeIterator<Key> *trees = Trees();
+      while (!trees->empty()) {
+        total += counter.Count((**trees).id, query.defense);
+        ++(*trees);
       }
-      return serializer.ToString();
+      return total;
     }
 
-    void Explore(const Query &input_query,
-                 const std::string output_path = "") {
-      Timer overall_timer;
-      overall_timer.Tic();
-      Timer timer;
+    inline void PushSnapshot() {
       pool_.PushSnapshot();
+      snapshots_.push_back(arena_->GetMark());
+    }
 
-      ExploreFormatter formatter(output_path);
-      
-      for (int i = 1; i < data_.skill_systems().size(); ++i) {
-        timer.Tic();
-        if (input_query.HasSkill(i)) {
-          formatter.Push(i, false,
-                         data_.skill_system(i).name,
-                         timer.Toc());
-          continue;
-        }
-        pool_.RestoreSnapshot();
-        iterators_.clear();
-        
-        Query updated_query = input_query;
-        updated_query.effects.push_back({
-            i, data_.skill_system(i).LowestPositivePoints()});
-        Query query = OptimizeQuery(updated_query, false);
-        
-        // Add in custom armors
-        InitializeExtraArmors(query);
-
-        // Core Search
-        CHECK_SUCCESS(ApplyFoundation(query));
-        for (int i = 0; i < FOUNDATION_NUM; ++i) {
-          CHECK_SUCCESS(ApplySingleJewelFilter(query.effects, i, 
-					       query.jewel_filter));
-        }
-        for (int i = FOUNDATION_NUM; i < query.effects.size(); ++i) {
-          CHECK_SUCCESS(ApplySkillSplitter(query, i));	
-        }
-
-        formatter.Push(i, !iterators_.back()->empty(), 
-                       data_.skill_system(i).name,
-                       timer.Toc());
-      }
-      wprintf(L"Overall: %.4lf sec\n", overall_timer.Toc());
+    // Discards the iterators and the nodes created after the last
+    // snapshot, so that the session can be reused for another query.
+    inline void RestoreSnapshot() {
+      ranked_ = nullptr;
+      instrumented_output_ = nullptr;
+      instrumented_trees_.clear();
+      output_iterators_.clear();
+      iterators_.clear();
+      arena_->Rewind(snapshots_.back());
+      pool_.RestoreSnapshot();
     }
 
-    Query OptimizeQuery(const Query &query, bool verbose = true) {
-      std::vector<double> scores;
-      std::vector<int> indices;
-      for (int i = 0; i < query.effects.size(); ++i) {
-        const Effect &effect = query.effects[i];
-        indices.push_back(i);
-        scores.push_back(data_.EffectScore(effect));
-        if (verbose) {
-          wprintf(L"(%03d) %ls: %.5lf\n", 
-                  effect.skill_id,
-                  data_.skill_system(effect.skill_id).name.c_str(),
-                  scores.back());
-        }
+    // The stats of the session so far. The RSS fields are left for
+    // the caller to fill after the session is released.
+    SessionStats Stats() const {
+      SessionStats stats;
+      stats.or_nodes = pool_.OrSize();
+      stats.and_nodes = pool_.AndSize();
+      stats.arena_peak_bytes = arena_->peak() - begin_.used;
+      stats.truncated = nullptr != deadline_ && deadline_->Hit();
+      if (nullptr != ranked_) {
+        stats.expanded_states = ranked_->states();
+        stats.pruned_subtrees = ranked_->pruned();
       }
-
-      std::sort(indices.begin(), indices.end(), 
-                [&scores](int a, int b) {
-                  return scores[a] < scores[b];
-                });
-      Query optimized = query;
-      optimized.effects.clear();
-      for (int i = 0; i < query.effects.size(); ++i) {
-        optimized.effects.push_back(query.effects[indices[i]]);
+      stats.foundation_seconds = foundation_seconds_;
+      for (size_t i = 1; i < iterators_.size(); ++i) {
+        double seconds = 
+          iterators_[i]->Seconds() - iterators_[i - 1]->Seconds();
+        if (i <= jewel_filters_) {
+          stats.jewel_filter_seconds.push_back(seconds);
+        } else {
+          stats.skill_splitter_seconds.push_back(seconds);
+        }
       }
-      return optimized;
+      return stats;
     }
 
-    void ListSkills() {
-      data_.PrintSkillSystems();
+    // Wraps the stages built from now on with counters (see
+    // InstrumentedTreeIterator), for Stages().
+    inline void Instrument() {
+      instrumented_ = true;
     }
 
+    // The work of each stage of an instrumented session so far, in
+    // the order of the chain, the output last. Unlike the counters
+    // of the stages, the OR nodes and the time of a stage leave out
+    // the stages it pulls from.
+    std::vector<StageStats> Stages() const {
+      std::vector<StageStats> stages;
+      for (size_t i = 0; i < instrumented_trees_.size(); ++i) {
+        stages.push_back(instrumented_trees_[i]->stats());
+        if (0 < i) Subtract(*instrumented_trees_[i - 1], &stages.back());
+      }
+      if (nullptr != instrumented_output_) {
+        stages.push_back(instrumented_output_->stats());
+        if (!instrumented_trees_.empty()) {
+          Subtract(*instrumented_trees_.back(), &stages.back());
+        }
+        // The output creates no OR nodes, those of its pulls belong to
+        // the tree stages.
+        stages.back().or_nodes = 0;
+      }
+      return stages;
+    }
+    
     // ----- Debug -----
-    void Summarize() {
-      data_.Summarize();
-      Log(INFO, L"OR Nodes: %lld\n", pool_.OrSize());
-      Log(INFO, L"AND Nodes: %lld\n", pool_.AndSize());
+    void Summarize() const {
+      Stats().Summarize();
     } 
 
   private:
+    inline bool Expired() const {
+      return nullptr != deadline_ && deadline_->Expired();
+    }
+
+    // Takes the pulls from before out of the stage after it.
+    static void Subtract(const InstrumentedTreeIterator<Key> &before,
+                         StageStats *stage) {
+      StageStats stats = before.stats();
+      stage->trees_in = stats.trees_out;
+      stage->keys_in = stats.keys_out;
+      stage->or_nodes -= before.pulled().or_nodes;
+      stage->seconds -= before.pulled().seconds;
+    }
+
     void InitializeExtraArmors(const Query &query) {
       data_.ClearExtraArmor();
       // Amulets
@@ -470,10 +760,13 @@ namespace monster_avengers {
       }
     }
     
-    // Returns a vector of newly created or nodes' indices.
-    std::vector<int> ClassifyArmors(ArmorPart part,
-                                    const Query &query) {
-      std::unordered_map<Signature, std::vector<int> > armor_map;
+    typedef SignatureMap<Key, std::vector<int> > ArmorGroups;
+
+    // Groups the armors of the part by signature. Only reads the
+    // session, so that the parts can be classified concurrently.
+    ArmorGroups ClassifyArmors(ArmorPart part,
+                               const Query &query) const {
+      ArmorGroups armor_map;
 
       std::vector<Effect> effects;
       int query_size = query.effects.size();
@@ -484,109 +777,921 @@ namespace monster_avengers {
       for (int id : data_.ArmorIds(part)) {
 	if (query.armor_filter.Validate(data_, id)) {
 	  const Armor &armor = data_.armor(id);
-	  Signature key(armor, effects);
+	  Key key(armor, effects);
 	  
-	  auto it = armor_map.find(key);
-	  if (armor_map.end() == it) {
-	    armor_map[key] = {id};
-	  } else {
-	    it->second.push_back(id);
-	  }
+	  armor_map[key].push_back(id);
 	}
       }
-      
-      std::vector<int> forest;
-      forest.reserve(armor_map.size());
-      for (auto &item : armor_map) {
-        forest.push_back(pool_.MakeOR<ARMORS>(item.first, 
-                                              &item.second));
-      }
-      return forest;
+      return armor_map;
     }
 
+    // The pairs of a contiguous range of left OR nodes, in scan
+    // order. slots[n] is the index of the key of pairs[n] in keys,
+    // which holds the distinct keys in the order they were first seen.
+    struct MergePartition {
+      std::vector<Key> keys;
+      std::vector<std::pair<int, int> > pairs;
+      std::vector<int> slots;
+    };
+
+    // Merges every pair of left and right OR nodes whose combined key
+    // passes feasible. The left OR nodes are partitioned across the
+    // scheduler's workers, each with its own map. The partitions are
+    // then replayed in order, which creates the same nodes with the
+    // same ids as a sequential scan.
+    template <typename Feasible>
     std::vector<int> MergeForests(const std::vector<int> &left_ors, 
                                   const std::vector<int> &right_ors, 
-                                  bool is_body = false) {
-      std::unordered_map<Signature, std::vector<int> > and_map;
-      for (int i : left_ors) {
-        const OR &left = pool_.Or(i);
-        for (int j : right_ors) {
-          const OR &right = pool_.Or(j);
-          Signature key = left.key;
-          if (is_body) {
-            key.BodyRefactor(right.key.multiplier() + 1);
-          }
-          key += right.key;
-          int id = pool_.MakeAnd(i, j);
-          auto it = and_map.find(key);
-          if (and_map.end() == it) {
-            and_map[key] = {id};
-          } else {
-            it->second.push_back(id);
+                                  bool is_body,
+                                  Feasible feasible,
+                                  WorkStealingScheduler *scheduler) {
+      int num_partitions = (std::min)(scheduler->size(), 
+                                      static_cast<int>(left_ors.size()));
+      if (num_partitions < 1) num_partitions = 1;
+      std::vector<MergePartition> partitions(num_partitions);
+      scheduler->Run(0, num_partitions, [&](int /*worker*/, int p) {
+          MergePartition &partition = partitions[p];
+          SignatureIndex<Key> index;
+          bool added = false;
+          size_t begin = left_ors.size() * p / num_partitions;
+          size_t end = left_ors.size() * (p + 1) / num_partitions;
+          for (size_t a = begin; a < end; ++a) {
+            if (Expired()) break;
+            int i = left_ors[a];
+            const OR<Key> &left = pool_.Or(i);
+            for (int j : right_ors) {
+              const OR<Key> &right = pool_.Or(j);
+              Key key = left.key;
+              if (is_body) {
+                key.BodyRefactor(right.key.multiplier() + 1);
+              }
+              key += right.key;
+              if (!feasible(key)) continue;
+              partition.slots.push_back(
+                  index.Insert(key, &partition.keys, &added));
+              partition.pairs.emplace_back(i, j);
+            }
           }
+        });
+
+      SignatureMap<Key, std::vector<int> > and_map;
+      std::vector<int> targets;
+      for (MergePartition &partition : partitions) {
+        targets.clear();
+        for (const Key &key : partition.keys) {
+          targets.push_back(and_map.Position(key));
         }
+        for (size_t n = 0; n < partition.pairs.size(); ++n) {
+          and_map.at(targets[partition.slots[n]]).second.push_back(
+              pool_.MakeAnd(partition.pairs[n].first, 
+                            partition.pairs[n].second));
+        }
+        partition = MergePartition();
       }
       
       std::vector<int> forest;
       forest.reserve(and_map.size());
       for (auto &item : and_map) {
-        forest.push_back(pool_.MakeOR<ANDS>(item.first,
-                                            &item.second));
+        forest.push_back(pool_.template MakeOR<ANDS>(item.first,
+                                                     &item.second));
       }
       return forest;
     }
 
+    // Appends the tree iterator built by make to the chain, wrapped
+    // if the session is instrumented.
+    template <typename Make>
+    void PushStage(const StageStats &stage, Make make) {
+      StageStats initial = stage;
+      size_t or_size = pool_.OrSize();
+      TreeIterator<Key> *iter = nullptr;
+      {
+        ScopedTimer timer(&initial.seconds);
+        iter = make();
+      }
+      if (instrumented_) {
+        initial.or_nodes = pool_.OrSize() - or_size;
+        instrumented_trees_.push_back(
+            arena_->New<InstrumentedTreeIterator<Key> >(iter, &pool_, 
+                                                        initial));
+        iter = instrumented_trees_.back();
+      }
+      iterators_.push_back(iter);
+    }
+
+    // Appends the armor set iterator built by make to the output
+    // chain, wrapped if the session is instrumented.
+    template <typename Make>
+    void PushOutput(const StageStats &stage, Make make) {
+      StageStats initial = stage;
+      ArmorSetIterator *iter = nullptr;
+      {
+        ScopedTimer timer(&initial.seconds);
+        iter = make();
+      }
+      if (instrumented_) {
+        instrumented_output_ = 
+          arena_->New<InstrumentedArmorSetIterator>(iter, initial);
+        iter = instrumented_output_;
+      }
+      output_iterators_.push_back(iter);
+    }
+
     Status ApplyFoundation(const Query &query) {
       iterators_.clear();
-      iterators_.emplace_back(new ListIterator(Foundation(query)));
+      instrumented_trees_.clear();
+      jewel_filters_ = 0;
+      foundation_seconds_ = 0.0;
+      PushStage(StageStats("foundation"), 
+                [this, &query]() -> TreeIterator<Key>* {
+          std::vector<TreeRoot<Key> > forest;
+          {
+            ScopedTimer timer(&foundation_seconds_);
+            forest = Foundation(query);
+          }
+          return arena_->New<ListIterator<Key> >(std::move(forest),
+                                                 deadline_);
+        });
       return Status(SUCCESS);
     }
 
     Status ApplySingleJewelFilter(const std::vector<Effect> &effects, 
                                   int effect_id, 
-				  const JewelFilter &filter) {
-      TreeIterator *new_iter = 
-        new JewelFilterIterator(iterators_.back().get(),
-                                data_,
-                                &pool_,
-                                effect_id,
-                                effects,
-				filter);
-      iterators_.emplace_back(new_iter);
+				  const JewelFilter &filter,
+                                  bool frontier = false) {
+      PushStage(StageStats("jewel_filter", effect_id), 
+                [this, &effects, effect_id, &filter, 
+                 frontier]() -> TreeIterator<Key>* {
+          return arena_->New<JewelFilterIterator<Key> >(iterators_.back(),
+                                                        data_,
+                                                        &pool_,
+                                                        effect_id,
+                                                        effects,
+                                                        filter,
+                                                        frontier);
+        });
+      jewel_filters_++;
       return Status(SUCCESS);
     }
 
     Status ApplySkillSplitter(const Query &query,
-                              int effect_id) {
-      TreeIterator *new_iter = 
-        new SkillSplitIterator(iterators_.back().get(),
-                               data_,
-                               &pool_,
-                               effect_id,
-                               query);
-      iterators_.emplace_back(new_iter);
+                              int effect_id,
+                              bool witness = false) {
+      PushStage(StageStats("skill_splitter", effect_id), 
+                [this, &query, effect_id, 
+                 witness]() -> TreeIterator<Key>* {
+          return arena_->New<SkillSplitIterator<Key> >(iterators_.back(),
+                                                       data_,
+                                                       &pool_,
+                                                       effect_id,
+                                                       query,
+                                                       witness);
+        });
       return Status(SUCCESS);
     }
 
-    Status PrepareOutput() {
-      output_iterators_.emplace_back(new ExpansionIterator(iterators_.back().get(), 
-							   &pool_));
+    Status PrepareRankedOutput(const Query &query) {
+      PushOutput(StageStats(query.anytime ? "anytime_expansion" : 
+                            "ranked_expansion"), 
+                 [this, &query]() -> ArmorSetIterator* {
+          ranked_ = arena_->New<RankedExpansionIterator<Key> >(
+              iterators_.back(), &pool_, &data_, query.defense, deadline_,
+              query.anytime);
+          return ranked_;
+        });
       return Status(SUCCESS);
     }
 
-    Status ApplyDefenseFilter(const Query &query) {
-      output_iterators_.emplace_back(new DefenseFilterIterator(output_iterators_.back().get(),
-							       &data_,
-							       query.defense));
+    Status PrepareSampledOutput(const Query &query, int k, uint64_t seed) {
+      PushOutput(StageStats("sampling"), 
+                 [this, &query, k, seed]() -> ArmorSetIterator* {
+          return arena_->New<SamplingIterator<Key> >(iterators_.back(), 
+                                                     &pool_, &data_, 
+                                                     query.defense, k, seed,
+                                                     deadline_);
+        });
       return Status(SUCCESS);
     }
-    
+
+    std::unique_ptr<Arena> owned_arena_;
+    Arena *arena_;
+    Arena::Mark begin_;
+    std::vector<Arena::Mark> snapshots_;
     DataSet data_;
-    NodePool pool_;
-    std::vector<std::unique_ptr<TreeIterator> > iterators_;
-    std::vector<std::unique_ptr<ArmorSetIterator> > output_iterators_;
+    NodePool<Key> pool_;
+    int foundation_threads_;
+    const Deadline *deadline_;
+    // The iterators are owned by the arena.
+    std::vector<TreeIterator<Key>*> iterators_;
+    std::vector<ArmorSetIterator*> output_iterators_;
+    // The ranked output, if any, for its stats.
+    RankedExpansionIterator<Key> *ranked_;
+    double foundation_seconds_;
+    // The jewel filters come right after the foundation in
+    // iterators_, the skill splitters after them.
+    size_t jewel_filters_;
+    bool instrumented_;
+    // The wrappers of the stages of an instrumented session.
+    std::vector<InstrumentedTreeIterator<Key>*> instrumented_trees_;
+    InstrumentedArmorSetIterator *instrumented_output_;
+  };
+
+  // ArmorUp serves queries on top of a shared Engine. Each search
+  // runs in its own SearchSession, so that the Search* methods can be
+  // called concurrently from multiple threads. Each thread reuses its
+  // own arena across the searches it runs.
+  //
+  // The session of a query is instantiated with the narrowest
+  // Signature that holds its skills (see sig::BytesFor()), so that
+  // small queries get cheaper keys. Queries with more skills than a
+  // WideSignature holds are rejected.
+  class ArmorUp {
+  public:
+    // Each search builds its foundation with foundation_threads
+    // threads (one per hardware thread if <= 0). Keep it at 1 when
+    // searches already run concurrently.
+    ArmorUp(const std::string &data_folder, int foundation_threads = 1) 
+      : engine_(data_folder), foundation_threads_(foundation_threads),
+        stats_mutex_(), last_stats_() {}
+
+    // The Search* methods and Count() stop early once deadline (if
+    // any) has expired, with the results found so far (see
+    // SessionStats::truncated).
+    template <OutputSpec Spec>
+    void Search(const Query &query, const std::string &output_path = "",
+                SessionStats *stats = nullptr,
+                const Deadline *deadline = nullptr) const {
+      return DispatchByWidth(
+          query.effects.size(),
+          [&](auto width) {
+            return SearchWith<typename decltype(width)::Key, Spec>(
+                query, output_path, stats, deadline);
+          },
+          [] {});
+    }
+
+    std::string SearchEncoded(const Query &query,
+                              SessionStats *stats = nullptr,
+                              const Deadline *deadline = nullptr) const {
+      return DispatchByWidth(
+          query.effects.size(),
+          [&](auto width) {
+            return SearchEncodedWith<typename decltype(width)::Key>(
+                query, stats, deadline);
+          },
+          [] { return std::string(); });
+    }
+
+    std::wstring SearchSerialized(const Query &query,
+                                  SessionStats *stats = nullptr,
+                                  const Deadline *deadline = nullptr) const {
+      return DispatchByWidth(
+          query.effects.size(),
+          [&](auto width) {
+            return SearchSerializedWith<typename decltype(width)::Key>(
+                query, stats, deadline);
+          },
+          [] { return std::wstring(); });
+    }
+
+    // Receives the pieces of a streamed result, returns false to stop
+    // the search.
+    typedef std::function<bool(const std::wstring &)> ChunkWriter;
+
+    // Writes the same JSON as SearchSerialized(), one armor set at a
+    // time as the output produces them, so that the result is never
+    // held in memory as a whole.
+    void SearchStreamed(const Query &query, const ChunkWriter &write,
+                        SessionStats *stats = nullptr,
+                        const Deadline *deadline = nullptr) const {
+      return DispatchByWidth(
+          query.effects.size(),
+          [&](auto width) {
+            return SearchStreamedWith<typename decltype(width)::Key>(
+                query, write, stats, deadline);
+          },
+          [&] { write(L"[]"); });
+    }
+
+    // The number of armor sets of the query, regardless of
+    // max_results.
+    SetCount Count(const Query &query, SessionStats *stats = nullptr,
+                   const Deadline *deadline = nullptr) const {
+      return DispatchByWidth(
+          query.effects.size(),
+          [&](auto width) {
+            return CountWith<typename decltype(width)::Key>(
+                query, stats, deadline);
+          },
+          [] { return SetCount(0); });
+    }
+
+    // The plan of the search of the query as JSON: the order of its
+    // skills chosen by OptimizeQuery() with their scores, and the
+    // work of each stage of the search (see StageStats), run up to
+    // max_results armor sets.
+    std::wstring Explain(const Query &query, SessionStats *stats = nullptr,
+                         const Deadline *deadline = nullptr) const {
+      return DispatchByWidth(
+          query.effects.size(),
+          [&](auto width) {
+            return ExplainWith<typename decltype(width)::Key>(
+                query, stats, deadline);
+          },
+          [] { return std::wstring(L"{}"); });
+    }
+
+    // Tests every skill system not in the query, reporting whether
+    // it can be added to the query with its lowest positive points.
+    // The skill systems are tested in parallel by num_threads workers
+    // (one per hardware thread if num_threads <= 0), each with its own
+    // SearchSession. The results are reported in skill id order.
+    // The skills searched with the full pipeline only look for a
+    // witness (see SearchSession::SearchTrees()). If measure_savings
+    // is set, they are searched again with the complete chain, and
+    // the time saved by the witness search is reported.
+    void Explore(const Query &input_query,
+                 const std::string output_path = "",
+                 int num_threads = 0,
+                 ExploreMode mode = EXPLORE_FULL,
+                 bool measure_savings = false) const {
+      // The explored skill comes on top of the query's skills.
+      return DispatchByWidth(
+          input_query.effects.size() + 1,
+          [&](auto width) {
+            return ExploreWith<typename decltype(width)::Key>(
+                input_query, output_path, num_threads, mode,
+                measure_savings);
+          },
+          [] {});
+    }
+
+    Query OptimizeQuery(const Query &query, bool verbose = true) const {
+      return engine_.OptimizeQuery(query, verbose);
+    }
+
+    inline const Engine &engine() const {
+      return engine_;
+    }
+
+    void ListSkills() const {
+      engine_.data().PrintSkillSystems();
+    }
+
+    // ----- Debug -----
+    // Node counts and memory usage are reported for the most recent
+    // search.
+    void Summarize() const {
+      engine_.data().Summarize();
+      SessionStats stats;
+      {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        stats = last_stats_;
+      }
+      stats.Summarize();
+    } 
+
+  private:
+    // Names the Signature chosen by DispatchByWidth().
+    template <typename SignatureType>
+    struct Width {
+      typedef SignatureType Key;
+    };
+
+    // Calls f with the Width of the narrowest Signature that holds
+    // num_effects skills, or returns fallback() if none does.
+    template <typename F, typename Fallback>
+    static auto DispatchByWidth(int num_effects, F f, Fallback fallback)
+      -> decltype(fallback()) {
+      switch (sig::BytesFor(num_effects)) {
+      case SmallSignature::BYTES:
+        return f(Width<SmallSignature>());
+      case Signature::BYTES:
+        return f(Width<Signature>());
+      case WideSignature::BYTES:
+        return f(Width<WideSignature>());
+      default:
+        Log(WARNING, L"Query with %d skills is not supported (at most %d).",
+            num_effects, WideSignature::MAX_EFFECTS);
+        return fallback();
+      }
+    }
+
+    // Searches query in a SearchSession and passes its first
+    // max_results armor sets to format(). begin(data, optimized_query)
+    // is called before the first armor set and end() after the last
+    // one. begin() and format() return false to stop. The time spent
+    // in the hooks is reported as formatting, except the time they add
+    // to *wait_seconds (if given), which is also left out of the search
+    // time.
+    template <typename Key, typename Begin, typename Format, typename End>
+    void SearchAndFormat(const Query &query, SessionStats *stats,
+                         const Deadline *deadline, Begin begin,
+                         Format format, End end,
+                         const double *wait_seconds = nullptr) const {
+      Timer timer;
+      timer.Tic();
+
+      // Optimize the Query
+      Query optimized_query = engine_.OptimizeQuery(query);
+
+      SessionStats session_stats;
+      {
+        SearchSession<Key> session(engine_, ThreadArena(), 
+                                   foundation_threads_, deadline);
+        session.SearchCore(optimized_query);
+
+        int count = 0;
+        double first_result = -1.0;
+        double format_seconds = 0.0;
+        bool open = false;
+        {
+          ScopedTimer format_timer(&format_seconds);
+          open = begin(session.data(), optimized_query);
+        }
+        ArmorSetIterator *output = session.Output();
+        while (open && count < query.max_results && !output->empty()) {
+          if (0 == count) first_result = timer.Toc();
+          {
+            ScopedTimer format_timer(&format_seconds);
+            open = format(**output);
+          }
+          ++count;
+          ++(*output);
+        }
+        {
+          ScopedTimer format_timer(&format_seconds);
+          end();
+        }
+        double waited = nullptr == wait_seconds ? 0.0 : *wait_seconds;
+        session_stats = session.Stats();
+        session_stats.first_result_seconds = first_result;
+        session_stats.results = count;
+        session_stats.format_seconds = format_seconds - waited;
+        session_stats.SetSearchSeconds(timer.Toc() - waited);
+      }
+      RecordMetrics(session_stats);
+      Record(session_stats, stats);
+    }
+
+    template <typename Key, OutputSpec Spec>
+    void SearchWith(const Query &query, const std::string &output_path,
+                    SessionStats *stats, const Deadline *deadline) const {
+      std::unique_ptr<ArmorSetFormatter<Spec> > formatter;
+      SearchAndFormat<Key>(
+          query, stats, deadline,
+          [&](const DataSet &data, const Query &optimized_query) {
+            formatter.reset(new ArmorSetFormatter<Spec>(
+                output_path, &data, optimized_query));
+            return true;
+          },
+          [&](const ArmorSet &armor_set) {
+            (*formatter)(armor_set);
+            return true;
+          },
+          [&] { formatter.reset(); });
+    }
+
+    template <typename Key>
+    std::string SearchEncodedWith(const Query &query,
+                                  SessionStats *stats,
+                                  const Deadline *deadline) const {
+      std::string output;
+      std::unique_ptr<EncodeFormatter> formatter;
+      SearchAndFormat<Key>(
+          query, stats, deadline,
+          [&](const DataSet &data, const Query &optimized_query) {
+            formatter.reset(new EncodeFormatter(&data, optimized_query));
+            return true;
+          },
+          [&](const ArmorSet &armor_set) {
+            (*formatter)(armor_set, &output);
+            return true;
+          },
+          [&] { formatter.reset(); });
+      return output;
+    }
+
+    template <typename Key>
+    std::wstring SearchSerializedWith(const Query &query,
+                                      SessionStats *stats,
+                                      const Deadline *deadline) const {
+      std::wstring result;
+      std::unique_ptr<ResultSerializer> serializer;
+      SearchAndFormat<Key>(
+          query, stats, deadline,
+          [&](const DataSet &data, const Query &optimized_query) {
+            serializer.reset(new ResultSerializer(&data, optimized_query));
+            return true;
+          },
+          [&](const ArmorSet &armor_set) {
+            serializer->Add(armor_set);
+            return true;
+          },
+          [&] {
+            result = serializer->ToString();
+            serializer.reset();
+          });
+      return result;
+    }
+
+    template <typename Key>
+    void SearchStreamedWith(const Query &query, const ChunkWriter &write,
+                            SessionStats *stats,
+                            const Deadline *deadline) const {
+      std::unique_ptr<ResultSerializer> serializer;
+      // Only the serialization is formatting, not the time write()
+      // waits for the client.
+      double write_seconds = 0.0;
+      bool open = false;
+      bool first = true;
+      auto timed_write = [&](const std::wstring &chunk) {
+        ScopedTimer write_timer(&write_seconds);
+        open = write(chunk);
+        return open;
+      };
+      SearchAndFormat<Key>(
+          query, stats, deadline,
+          [&](const DataSet &data, const Query &optimized_query) {
+            serializer.reset(new ResultSerializer(&data, optimized_query));
+            return timed_write(L"[");
+          },
+          [&](const ArmorSet &armor_set) {
+            std::wstring json = serializer->ToJson(armor_set);
+            json.insert(0, first ? L"" : L", ");
+            first = false;
+            return timed_write(json);
+          },
+          [&] {
+            if (open) timed_write(L"]");
+            serializer.reset();
+          },
+          &write_seconds);
+    }
+
+    template <typename Key>
+    SetCount CountWith(const Query &query, SessionStats *stats,
+                       const Deadline *deadline) const {
+      Timer timer;
+      timer.Tic();
+
+      Query optimized_query = engine_.OptimizeQuery(query);
+
+      SetCount count = 0;
+      SessionStats session_stats;
+      {
+        SearchSession<Key> session(engine_, ThreadArena(), 
+                                   foundation_threads_, deadline);
+        count = session.Count(optimized_query);
+        session_stats = session.Stats();
+        session_stats.SetSearchSeconds(timer.Toc());
+      }
+      RecordMetrics(session_stats);
+      Record(session_stats, stats);
+      return count;
+    }
+
+    template <typename Key>
+    std::wstring ExplainWith(const Query &query, SessionStats *stats,
+                             const Deadline *deadline) const {
+      Timer timer;
+      timer.Tic();
+
+      Query optimized_query = engine_.OptimizeQuery(query, false);
+
+      std::vector<StageStats> stages;
+      SessionStats session_stats;
+      {
+        SearchSession<Key> session(engine_, ThreadArena(), 
+                                   foundation_threads_, deadline);
+        session.Instrument();
+        session.SearchCore(optimized_query);
+        int count = 0;
+        ArmorSetIterator *output = session.Output();
+        while (count < query.max_results && !output->empty()) {
+          ++count;
+          ++(*output);
+        }
+        stages = session.Stages();
+        session_stats = session.Stats();
+        session_stats.results = count;
+        session_stats.SetSearchSeconds(timer.Toc());
+      }
+      Record(session_stats, stats);
+
+      const DataSet &data = engine_.data();
+      std::wostringstream output;
+      output.imbue(LOCALE_UTF8);
+      output << L"{\"signature_bytes\": " << Key::BYTES 
+             << L", \"effects\": [";
+      for (size_t i = 0; i < optimized_query.effects.size(); ++i) {
+        const Effect &effect = optimized_query.effects[i];
+        if (0 < i) output << L", ";
+        output << L"{\"skill_id\": " << effect.skill_id
+               << L", \"name\": " 
+               << JsonString(data.skill_system(effect.skill_id).name.c_str())
+               << L", \"points\": " << effect.points
+               << L", \"score\": " << JsonNumber(data.EffectScore(effect))
+               << L"}";
+      }
+      output << L"], \"stages\": [";
+      for (size_t i = 0; i < stages.size(); ++i) {
+        const StageStats &stage = stages[i];
+        std::string name(stage.name);
+        if (0 < i) output << L", ";
+        output << L"{\"stage\": \"" 
+               << std::wstring(name.begin(), name.end()) << L"\""
+               << L", \"effect_id\": " << stage.effect_id
+               << L", \"trees_in\": " << stage.trees_in
+               << L", \"trees_out\": " << stage.trees_out
+               << L", \"jewel_keys_in\": " << stage.keys_in
+               << L", \"jewel_keys_out\": " << stage.keys_out
+               << L", \"armor_sets_out\": " << stage.armor_sets_out
+               << L", \"satisfy_calls\": " << stage.satisfy_calls
+               << L", \"or_nodes\": " << stage.or_nodes
+               << L", \"seconds\": " << JsonNumber(stage.seconds) << L"}";
+      }
+      output << L"], \"or_nodes\": " << session_stats.or_nodes
+             << L", \"and_nodes\": " << session_stats.and_nodes
+             << L", \"results\": " << session_stats.results
+             << L", \"truncated\": " 
+             << (session_stats.truncated ? L"true" : L"false")
+             << L", \"seconds\": " 
+             << JsonNumber(session_stats.search_seconds) << L"}";
+      return output.str();
+    }
+
+    // The control characters are escaped too, which JSON does not
+    // allow raw in a string.
+    static std::wstring JsonString(const std::wstring &text) {
+      std::wstring result = L"\"";
+      for (wchar_t c : text) {
+        if (L'"' == c || L'\\' == c) {
+          result += L'\\';
+          result += c;
+        } else if (L'\n' == c) {
+          result += L"\\n";
+        } else if (L'\t' == c) {
+          result += L"\\t";
+        } else if (static_cast<unsigned>(c) < 0x20) {
+          wchar_t buffer[8];
+          swprintf(buffer, 8, L"\\u%04x", static_cast<unsigned>(c));
+          result += buffer;
+        } else {
+          result += c;
+        }
+      }
+      return result + L"\"";
+    }
+
+    static std::wstring JsonNumber(double value) {
+      wchar_t buffer[32];
+      swprintf(buffer, 32, L"%.6f", value);
+      return buffer;
+    }
+
+    template <typename Key>
+    void ExploreWith(const Query &input_query,
+                     const std::string output_path,
+                     int num_threads,
+                     ExploreMode mode,
+                     bool measure_savings) const {
+      Timer overall_timer;
+      overall_timer.Tic();
+      const DataSet &data = engine_.data();
+      int num_skills = static_cast<int>(data.skill_systems().size());
+
+      // In incremental mode, the base query is searched only once.
+      Query base_query = engine_.OptimizeQuery(input_query, false);
+      bool incremental = EXPLORE_INCREMENTAL == mode && 
+        !base_query.effects.empty();
+      std::unique_ptr<SearchSession<Key> > base_session;
+      std::unique_ptr<CachedTreeIterator<Key> > base_forest;
+      if (incremental) {
+        base_session.reset(new SearchSession<Key>(engine_, nullptr, 
+                                                  num_threads));
+        base_session->SearchTrees(base_query);
+        base_forest.reset(new CachedTreeIterator<Key>(base_session->Trees()));
+      }
+      size_t base_forest_size = incremental ? base_forest->size() : 0;
+      std::atomic<int> incremental_count(0);
+
+      // Skills that cannot reach their lowest positive points even
+      // with the best armors and jewels are rejected without a search.
+      std::vector<int> upper_bounds = SkillUpperBounds(data, input_query);
+      std::atomic<int> rejected_count(0);
+
+      std::vector<ExploreResult> results(num_skills);
+      WorkStealingScheduler scheduler(num_threads);
+      std::vector<std::unique_ptr<SearchSession<Key> > > sessions(
+          scheduler.size());
+      
+      scheduler.Run(1, num_skills, [&](int worker, int i) {
+          Timer timer;
+          timer.Tic();
+          if (input_query.HasSkill(i)) {
+            results[i].pass = false;
+            results[i].duration = timer.Toc();
+            return;
+          }
+          if (upper_bounds[i] < data.skill_system(i).LowestPositivePoints()) {
+            results[i].pass = false;
+            results[i].duration = timer.Toc();
+            rejected_count++;
+            return;
+          }
+          if (incremental && 
+              IsIndependentSkill(data, i, base_query.effects, 
+                                 base_query.jewel_filter)) {
+            results[i].pass = ExploreSkill(base_forest->roots(),
+                                           base_session->data(),
+                                           base_session->pool(),
+                                           i, base_query.effects,
+                                           base_query.jewel_filter);
+            results[i].duration = timer.Toc();
+            incremental_count++;
+            return;
+          }
+          if (!sessions[worker]) {
+            sessions[worker].reset(new SearchSession<Key>(engine_));
+            sessions[worker]->PushSnapshot();
+          }
+          SearchSession<Key> *session = sessions[worker].get();
+          session->RestoreSnapshot();
+        
+          Query updated_query = input_query;
+          updated_query.effects.push_back({
+              i, data.skill_system(i).LowestPositivePoints()});
+          Query query = engine_.OptimizeQuery(updated_query, false);
+        
+          session->SearchTrees(query, true);
+          results[i].pass = !session->Trees()->empty();
+          results[i].duration = timer.Toc();
+
+          if (measure_savings) {
+            session->RestoreSnapshot();
+            Timer complete_timer;
+            complete_timer.Tic();
+            session->SearchTrees(query);
+            // The witness search decides the same (see
+            // SkillSplitIterator).
+            CHECK(results[i].pass == !session->Trees()->empty());
+            results[i].saved = (std::max)(
+                0.0, complete_timer.Toc() - results[i].duration);
+          }
+        });
+
+      ExploreFormatter formatter(output_path);
+      double total_saved = 0.0;
+      for (int i = 1; i < num_skills; ++i) {
+        formatter.Push(i, results[i].pass, 
+                       data.skill_system(i).name,
+                       results[i].duration,
+                       results[i].saved);
+        if (results[i].saved > 0.0) total_saved += results[i].saved;
+      }
+
+      // Report the session that used the most memory.
+      SessionStats session_stats;
+      for (auto &session : sessions) {
+        if (session) {
+          SessionStats stats = session->Stats();
+          if (stats.arena_peak_bytes >= session_stats.arena_peak_bytes) {
+            session_stats = stats;
+          }
+        }
+      }
+      sessions.clear();
+      base_forest.reset();
+      base_session.reset();
+      Record(session_stats, nullptr);
+      wprintf(L"Pre-rejected: %d skills by upper bound.\n", 
+              rejected_count.load());
+      if (measure_savings) {
+        wprintf(L"Witness search saved %.4lf sec in total.\n", 
+                total_saved);
+      }
+      if (incremental) {
+        wprintf(L"Incremental: %d skills tested on the cached forest "
+                L"of %lld trees.\n", incremental_count.load(),
+                static_cast<long long>(base_forest_size));
+      }
+      wprintf(L"Overall: %.4lf sec (%d threads)\n", overall_timer.Toc(),
+              scheduler.size());
+    }
+
+    struct ExploreResult {
+      bool pass;
+      double duration;
+      // Time saved by the witness search compared to the complete
+      // chain, negative if not measured.
+      double saved;
+
+      ExploreResult() : pass(false), duration(0.0), saved(-1.0) {}
+    };
+
+    static Arena *ThreadArena() {
+      static thread_local Arena arena;
+      return &arena;
+    }
+
+    // Called after the session is released. Trims the thread's arena
+    // and completes the stats with the steady state memory usage.
+    void Record(SessionStats stats, SessionStats *output) const {
+      Arena *arena = ThreadArena();
+      arena->Reset();
+      stats.arena_reserved_bytes = arena->reserved();
+      stats.rss_kb = CurrentRssKb();
+      stats.process_peak_rss_kb = PeakRssKb();
+      {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        last_stats_ = stats;
+      }
+      if (nullptr != output) *output = stats;
+    }
+
+    // Adds a search to MetricsRegistry::Global().
+    static void RecordMetrics(const SessionStats &stats) {
+      MetricsRegistry &registry = MetricsRegistry::Global();
+      static Counter *searches = registry.GetCounter(
+          "armor_up_searches_total", "Searches run.");
+      static Counter *truncated = registry.GetCounter(
+          "armor_up_truncated_searches_total", 
+          "Searches cut short by their deadline.");
+      static Histogram *search_seconds = registry.GetHistogram(
+          "armor_up_search_seconds", "Time of a whole search.",
+          Histogram::SecondBuckets());
+      static Histogram *foundation_seconds = registry.GetHistogram(
+          "armor_up_foundation_seconds", "Time building the foundation.",
+          Histogram::SecondBuckets());
+      static Histogram *expansion_seconds = registry.GetHistogram(
+          "armor_up_expansion_seconds", 
+          "Time ranking, sampling or counting the armor sets.",
+          Histogram::SecondBuckets());
+      static Histogram *format_seconds = registry.GetHistogram(
+          "armor_up_format_seconds", "Time formatting the armor sets.",
+          Histogram::SecondBuckets());
+      static Histogram *or_nodes = registry.GetHistogram(
+          "armor_up_or_nodes", "OR nodes created by a search.",
+          Histogram::SizeBuckets());
+      static Histogram *and_nodes = registry.GetHistogram(
+          "armor_up_and_nodes", "AND nodes created by a search.",
+          Histogram::SizeBuckets());
+      static Histogram *results = registry.GetHistogram(
+          "armor_up_results", "Armor sets returned by a search.",
+          Histogram::SizeBuckets());
+      searches->Add();
+      if (stats.truncated) truncated->Add();
+      search_seconds->Observe(stats.search_seconds);
+      foundation_seconds->Observe(stats.foundation_seconds);
+      expansion_seconds->Observe(stats.expansion_seconds);
+      format_seconds->Observe(stats.format_seconds);
+      or_nodes->Observe(static_cast<double>(stats.or_nodes));
+      and_nodes->Observe(static_cast<double>(stats.and_nodes));
+      results->Observe(static_cast<double>(stats.results));
+      // The stages are labeled by the position of their skill in the
+      // optimized query.
+      // The foundation skills have a jewel filter each, the others a
+      // skill splitter.
+      static const std::vector<Histogram*> jewel_filter_seconds = 
+        StageHistograms("jewel_filter", 0, FOUNDATION_NUM);
+      static const std::vector<Histogram*> skill_splitter_seconds = 
+        StageHistograms("skill_splitter", FOUNDATION_NUM, 
+                        Query::MAX_EFFECTS);
+      size_t position = 0;
+      for (double seconds : stats.jewel_filter_seconds) {
+        if (position >= jewel_filter_seconds.size()) break;
+        jewel_filter_seconds[position++]->Observe(seconds);
+      }
+      position = 0;
+      for (double seconds : stats.skill_splitter_seconds) {
+        if (position >= skill_splitter_seconds.size()) break;
+        skill_splitter_seconds[position++]->Observe(seconds);
+      }
+    }
+
+    // The histograms of a stage at the positions [begin, end) of a
+    // query, looked up once so that recording a search does not take
+    // the lock of the registry.
+    static std::vector<Histogram*> StageHistograms(const std::string &stage,
+                                                   int begin, int end) {
+      std::vector<Histogram*> histograms;
+      for (int position = begin; position < end; ++position) {
+        histograms.push_back(MetricsRegistry::Global().GetHistogram(
+            "armor_up_stage_seconds", 
+            "Time in a stage of the tree iterator chain.",
+            Histogram::SecondBuckets(),
+            "stage=\"" + stage + "\",position=\"" + 
+            std::to_string(position) + "\""));
+      }
+      return histograms;
+    }
+
+    const Engine engine_;
+    const int foundation_threads_;
+    mutable std::mutex stats_mutex_;
+    mutable SessionStats last_stats_;
   };
 }
 
 #endif  // _MONSTER_AVENGERS_ARMOR_UP_
-
@@ -0,0 +1,410 @@
+#ifndef _MONSTER_AVENGERS_COUNTING_
+#define _MONSTER_AVENGERS_COUNTING_
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "data/data_set.h"
+#include "supp/deadline.h"
+#include "or_and_tree.h"
+#include "iterator.h"
+
+namespace monster_avengers {
+
+  // The number of armor sets of a search, an unsigned 128-bit
+  // integer as the product of the parts can overflow 64 bits on loose
+  // queries. Not every compiler has __int128 (MSVC does not), so that
+  // it is kept in two 64-bit halves, with the arithmetic that the
+  // counting and the sampling need. Like the built-in unsigned
+  // integers, it wraps around.
+  struct SetCount {
+    uint64_t hi;
+    uint64_t lo;
+
+    SetCount() : hi(0), lo(0) {}
+
+    SetCount(uint64_t value) : hi(0), lo(value) {}
+
+    SetCount(uint64_t hi_, uint64_t lo_) : hi(hi_), lo(lo_) {}
+
+    inline SetCount &operator+=(const SetCount &other) {
+      uint64_t sum = lo + other.lo;
+      hi += other.hi + (sum < lo ? 1 : 0);
+      lo = sum;
+      return *this;
+    }
+
+    inline SetCount &operator-=(const SetCount &other) {
+      hi -= other.hi + (lo < other.lo ? 1 : 0);
+      lo -= other.lo;
+      return *this;
+    }
+
+    inline SetCount &operator++() {
+      return *this += 1;
+    }
+
+    inline SetCount operator++(int) {
+      SetCount old = *this;
+      *this += 1;
+      return old;
+    }
+
+    inline SetCount operator~() const {
+      return SetCount(~hi, ~lo);
+    }
+
+    // Returns *this / divisor and sets *remainder to *this % divisor,
+    // for a divisor other than 0. Bit by bit, unless both fit in 64
+    // bits.
+    SetCount DivMod(const SetCount &divisor, SetCount *remainder) const {
+      if (0 == hi && 0 == divisor.hi) {
+        *remainder = SetCount(lo % divisor.lo);
+        return SetCount(lo / divisor.lo);
+      }
+      SetCount quotient;
+      SetCount rest;
+      for (int bit = 127; bit >= 0; --bit) {
+        // The bit shifted out of rest, which is below divisor before
+        // the shift, means that rest now exceeds it.
+        bool carry = 0 != (rest.hi >> 63);
+        rest.hi = (rest.hi << 1) | (rest.lo >> 63);
+        rest.lo = (rest.lo << 1) | (((64 <= bit ? hi >> (bit - 64) :
+                                      lo >> bit)) & 1);
+        if (carry || !Less(rest, divisor)) {
+          rest -= divisor;
+          if (64 <= bit) {
+            quotient.hi |= static_cast<uint64_t>(1) << (bit - 64);
+          } else {
+            quotient.lo |= static_cast<uint64_t>(1) << bit;
+          }
+        }
+      }
+      *remainder = rest;
+      return quotient;
+    }
+
+    static inline bool Less(const SetCount &a, const SetCount &b) {
+      return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+    }
+  };
+
+  inline bool operator==(const SetCount &a, const SetCount &b) {
+    return a.hi == b.hi && a.lo == b.lo;
+  }
+
+  inline bool operator!=(const SetCount &a, const SetCount &b) {
+    return !(a == b);
+  }
+
+  inline bool operator<(const SetCount &a, const SetCount &b) {
+    return SetCount::Less(a, b);
+  }
+
+  inline bool operator>(const SetCount &a, const SetCount &b) {
+    return SetCount::Less(b, a);
+  }
+
+  inline bool operator<=(const SetCount &a, const SetCount &b) {
+    return !SetCount::Less(b, a);
+  }
+
+  inline bool operator>=(const SetCount &a, const SetCount &b) {
+    return !SetCount::Less(a, b);
+  }
+
+  inline SetCount operator+(SetCount a, const SetCount &b) {
+    return a += b;
+  }
+
+  inline SetCount operator-(SetCount a, const SetCount &b) {
+    return a -= b;
+  }
+
+  // The low halves are multiplied in 32-bit pieces into 128 bits, the
+  // cross products only reach the high half.
+  inline SetCount operator*(const SetCount &a, const SetCount &b) {
+    const uint64_t MASK = 0xFFFFFFFFULL;
+    uint64_t a0 = a.lo & MASK, a1 = a.lo >> 32;
+    uint64_t b0 = b.lo & MASK, b1 = b.lo >> 32;
+    uint64_t p00 = a0 * b0;
+    uint64_t p01 = a0 * b1;
+    uint64_t p10 = a1 * b0;
+    uint64_t p11 = a1 * b1;
+    uint64_t middle = (p00 >> 32) + (p01 & MASK) + (p10 & MASK);
+    return SetCount(p11 + (p01 >> 32) + (p10 >> 32) + (middle >> 32) +
+                    a.lo * b.hi + a.hi * b.lo,
+                    (middle << 32) | (p00 & MASK));
+  }
+
+  inline SetCount operator/(const SetCount &a, const SetCount &b) {
+    SetCount remainder;
+    return a.DivMod(b, &remainder);
+  }
+
+  inline SetCount operator%(const SetCount &a, const SetCount &b) {
+    SetCount remainder;
+    a.DivMod(b, &remainder);
+    return remainder;
+  }
+
+  inline std::string SetCountString(SetCount count) {
+    if (0 == count) return "0";
+    std::string result;
+    SetCount digit;
+    while (0 < count) {
+      count = count.DivMod(10, &digit);
+      result.push_back('0' + static_cast<int>(digit.lo));
+    }
+    std::reverse(result.begin(), result.end());
+    return result;
+  }
+
+  // SetCounter counts the armor sets under the ORs of the final
+  // forest without expanding them, the same armor sets that
+  // RankedExpansionIterator produces with the same min_defense.
+  //
+  // Without a defense requirement the count of an OR is memoized by
+  // its id: an ARMORS OR counts its armors, and an ANDS OR sums the
+  // products of the counts of the left and the right OR of its
+  // ANDs. This is linear in the size of the DAG.
+  //
+  // With a defense requirement, the count of an OR is memoized by its
+  // id and the defense that is still needed. An OR whose lowest
+  // defense already meets it counts fully, and an OR whose highest
+  // defense cannot meet it counts zero (see DefenseBounds), so that
+  // only the ORs straddling the requirement are split by armor.
+  template <typename Key>
+  class SetCounter {
+  public:
+    SetCounter(const NodePool<Key> *pool, const DataSet *data)
+      : pool_(pool), bounds_(pool, data), counts_(),
+        defense_counts_() {}
+
+    SetCount Count(int or_id) {
+      if (counts_.size() <= static_cast<size_t>(or_id)) {
+        counts_.resize(std::max(pool_->OrSize(),
+                                static_cast<size_t>(or_id) + 1),
+                       NotComputed());
+      }
+      if (NotComputed() != counts_[or_id]) return counts_[or_id];
+      const OR<Key> &or_node = pool_->Or(or_id);
+      SetCount result = 0;
+      if (ANDS == or_node.tag) {
+        for (int and_id : or_node.daughters) {
+          const AND &and_node = pool_->And(and_id);
+          result += Count(and_node.left) * Count(and_node.right);
+        }
+      } else {
+        result = or_node.daughters.size();
+      }
+      counts_[or_id] = result;
+      return result;
+    }
+
+    // The armor sets under or_id with at least min_defense defense.
+    SetCount Count(int or_id, int min_defense) {
+      if (min_defense <= bounds_.Min(or_id)) return Count(or_id);
+      if (min_defense > bounds_.Max(or_id)) return 0;
+      int64_t code = (static_cast<int64_t>(or_id) << 32) |
+        static_cast<uint32_t>(min_defense);
+      auto it = defense_counts_.find(code);
+      if (defense_counts_.end() != it) return it->second;
+      SetCount result = 0;
+      ForEachChoice(*pool_, or_id, [&](const ArmorChoice &choice) {
+          result += Count(choice, min_defense);
+        });
+      defense_counts_[code] = result;
+      return result;
+    }
+
+    // The armor sets that take choice, with at least min_defense
+    // defense from its armor on.
+    SetCount Count(const ArmorChoice &choice, int min_defense) {
+      int rest = min_defense - bounds_.Armor(choice.armor_id);
+      if (-1 == choice.next_or) return rest <= 0 ? 1 : 0;
+      return Count(choice.next_or, rest);
+    }
+
+    inline DefenseBounds<Key> *bounds() {
+      return &bounds_;
+    }
+
+  private:
+    static inline SetCount NotComputed() {
+      return ~SetCount(0);
+    }
+
+    const NodePool<Key> *pool_;
+    DefenseBounds<Key> bounds_;
+    std::vector<SetCount> counts_;
+    std::unordered_map<int64_t, SetCount> defense_counts_;
+  };
+
+  // SamplingIterator draws num_samples armor sets uniformly at random
+  // (with replacement) from the final forest, among the armor sets
+  // with at least min_defense defense. The whole forest of base_iter
+  // is consumed on construction.
+  //
+  // A draw walks down from a root. The root, and then at each OR an
+  // AND with an armor of its left OR (or an armor of the last part),
+  // is picked with a probability proportional to the number of armor
+  // sets under it (see SetCounter). The cumulative counts of the
+  // choices are memoized like the counts, so that after the counting
+  // pass a draw costs O(depth * log(branching)).
+  //
+  // The draws stop early once deadline (if any) has expired.
+  template <typename Key>
+  class SamplingIterator : public ArmorSetIterator {
+  public:
+    SamplingIterator(TreeIterator<Key> *base_iter,
+                     const NodePool<Key> *pool,
+                     const DataSet *data,
+                     int min_defense,
+                     int num_samples,
+                     uint64_t seed,
+                     const Deadline *deadline = nullptr)
+      : pool_(pool), counter_(pool, data), min_defense_(min_defense),
+        num_samples_(num_samples), drawn_(0), deadline_(deadline),
+        generator_(seed),
+        roots_(), root_prefix_(), choices_(), prefix_(), root_(-1),
+        keys_root_(-1) {
+      SetCount total = 0;
+      while (!base_iter->empty()) {
+        const TreeRoot<Key> &root = **base_iter;
+        total += counter_.Count(root.id, min_defense_);
+        if (root_prefix_.empty() || total != root_prefix_.back()) {
+          roots_.emplace_back(root);
+          root_prefix_.push_back(total);
+        }
+        ++(*base_iter);
+      }
+      choices_.resize(pool_->OrSize());
+      Proceed();
+    }
+
+    void operator++() override {
+      Proceed();
+    }
+
+    inline const ArmorSet& operator*() const override {
+      return armor_set_;
+    }
+
+    inline bool empty() const override {
+      return -1 == root_;
+    }
+
+    inline int BaseIndex() const override {
+      return roots_[root_].id;
+    }
+
+    // The number of armor sets that the samples are drawn from.
+    inline SetCount total() const {
+      return root_prefix_.empty() ? 0 : root_prefix_.back();
+    }
+
+  private:
+    const std::vector<ArmorChoice> &Choices(int or_id) {
+      std::vector<ArmorChoice> &choices = choices_[or_id];
+      if (!choices.empty()) return choices;
+      ForEachChoice(*pool_, or_id, [&choices](const ArmorChoice &c) {
+          choices.push_back(c);
+        });
+      return choices;
+    }
+
+    // The cumulative counts of the choices of or_id with min_defense
+    // still needed. Any need up to the lowest defense of or_id keeps
+    // every armor set, so that they share one entry.
+    const std::vector<SetCount> &Prefix(int or_id, int min_defense) {
+      min_defense = std::max(min_defense, counter_.bounds()->Min(or_id));
+      int64_t code = (static_cast<int64_t>(or_id) << 32) |
+        static_cast<uint32_t>(min_defense);
+      auto it = prefix_.find(code);
+      if (prefix_.end() != it) return it->second;
+      std::vector<SetCount> &prefix = prefix_[code];
+      SetCount total = 0;
+      for (const ArmorChoice &choice : Choices(or_id)) {
+        total += counter_.Count(choice, min_defense);
+        prefix.push_back(total);
+      }
+      return prefix;
+    }
+
+    // Uniform in [0, n) for n > 0. The 128 random bits are rejected
+    // above the largest multiple of n, so that there is no modulo
+    // bias. The two halves are drawn in sequence, so that a seed
+    // gives the same samples whatever the compiler.
+    SetCount Uniform(const SetCount &n) {
+      SetCount remainder = (~SetCount(0) % n + 1) % n;
+      while (true) {
+        uint64_t hi = generator_();
+        uint64_t lo = generator_();
+        SetCount bits(hi, lo);
+        if (0 == remainder || bits < SetCount(0) - remainder) {
+          return bits % n;
+        }
+      }
+    }
+
+    // The index of the choice that r falls in.
+    static inline int Pick(const std::vector<SetCount> &prefix, 
+                           SetCount r) {
+      return static_cast<int>(
+          std::upper_bound(prefix.begin(), prefix.end(), r) - 
+          prefix.begin());
+    }
+
+    void Proceed() {
+      if (drawn_ >= num_samples_ || 0 == total() ||
+          ExpansionExpired(deadline_, drawn_)) {
+        root_ = -1;
+        return;
+      }
+      drawn_++;
+      int root = Pick(root_prefix_, Uniform(total()));
+      int or_id = roots_[root].id;
+      int need = min_defense_;
+      int depth = 0;
+      while (-1 != or_id) {
+        const std::vector<SetCount> &prefix = Prefix(or_id, need);
+        const ArmorChoice &choice = 
+          Choices(or_id)[Pick(prefix, Uniform(prefix.back()))];
+        armor_set_.ids[depth++] = choice.armor_id;
+        need -= counter_.bounds()->Armor(choice.armor_id);
+        or_id = choice.next_or;
+      }
+      if (keys_root_ != root) {
+        armor_set_.jewel_keys = roots_[root].jewel_keys;
+        keys_root_ = root;
+      }
+      root_ = root;
+    }
+
+    const NodePool<Key> *pool_;
+    SetCounter<Key> counter_;
+    int min_defense_;
+    int num_samples_;
+    int drawn_;
+    const Deadline *deadline_;
+    std::mt19937_64 generator_;
+    // Only the roots with armor sets to draw, with the cumulative
+    // counts.
+    std::vector<RootSnapshot> roots_;
+    std::vector<SetCount> root_prefix_;
+    std::vector<std::vector<ArmorChoice> > choices_;
+    std::unordered_map<int64_t, std::vector<SetCount> > prefix_;
+    int root_;
+    // The root whose jewel keys are in armor_set_.
+    int keys_root_;
+    ArmorSet armor_set_;
+  };
+
+}  // namespace monster_avengers
+
+#endif  // _MONSTER_AVENGERS_COUNTING_
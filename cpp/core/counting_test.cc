@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <vector>
+
+#include "data/data_set.h"
+#include "core/counting.h"
+#include "supp/helpers.h"
+
+using namespace monster_avengers;
+
+namespace {
+  // The defenses of every armor set under or_id, by expanding it.
+  std::vector<int> ExpandDefenses(const NodePool<Signature> &pool,
+                                  const DataSet &data, int or_id) {
+    const OR<Signature> &or_node = pool.Or(or_id);
+    std::vector<int> result;
+    if (ARMORS == or_node.tag) {
+      for (int armor_id : or_node.daughters) {
+        result.push_back(data.armor(armor_id).max_defense);
+      }
+      return result;
+    }
+    for (int and_id : or_node.daughters) {
+      const AND &and_node = pool.And(and_id);
+      std::vector<int> rest = ExpandDefenses(pool, data, and_node.right);
+      for (int armor_id : pool.Or(and_node.left).daughters) {
+        for (int defense : rest) {
+          result.push_back(data.armor(armor_id).max_defense + defense);
+        }
+      }
+    }
+    return result;
+  }
+
+  int MakeArmors(NodePool<Signature> *pool, const DataSet &data,
+                 ArmorPart part, size_t begin, size_t end) {
+    const std::vector<int> &ids = data.ArmorIds(part);
+    std::vector<int> armors(ids.begin() + begin, ids.begin() + end);
+    return pool->MakeOR<ARMORS>(Signature(), &armors);
+  }
+}  // namespace
+
+int main(int argc, char **argv) {
+  // SetCountTest: the arithmetic carries across the halves.
+  {
+    const uint64_t MAX_64 = ~static_cast<uint64_t>(0);
+    SetCount square = SetCount(MAX_64) * MAX_64;
+    CHECK(SetCount(MAX_64 - 1, 1) == square);
+    CHECK(MAX_64 == square / MAX_64);
+    CHECK(0 == square % MAX_64);
+    CHECK(SetCount(1, 0) == SetCount(MAX_64) + 1);
+    CHECK(MAX_64 == SetCount(1, 0) - 1);
+    CHECK(SetCount(3, 5) > SetCount(2, MAX_64));
+    SetCount remainder;
+    CHECK(SetCount(0, 0x2000000000000000ULL) ==
+          SetCount(1, 7).DivMod(8, &remainder));
+    CHECK(7 == remainder);
+    CHECK("0" == SetCountString(0));
+    CHECK("18446744073709551616" == SetCountString(SetCount(1, 0)));
+    CHECK("340282366920938463463374607431768211455" ==
+          SetCountString(~SetCount(0)));
+  }
+
+  if (argc < 2) {
+    Log(FATAL, L"usage: counting_test <dataset>");
+    return 1;
+  }
+  DataSet data(argv[1]);
+
+  // CountTest: on a small DAG with shared ORs, the counts (with any
+  // defense requirement) agree with the expansion.
+  NodePool<Signature> pool;
+  int hands_a = MakeArmors(&pool, data, HANDS, 0, 3);
+  int hands_b = MakeArmors(&pool, data, HANDS, 2, 7);
+  int body_a = MakeArmors(&pool, data, BODY, 0, 4);
+  int body_b = MakeArmors(&pool, data, BODY, 10, 12);
+  int head = MakeArmors(&pool, data, HEAD, 5, 10);
+  std::vector<int> ands = {pool.MakeAnd(body_a, hands_a),
+                           pool.MakeAnd(body_b, hands_b),
+                           pool.MakeAnd(body_a, hands_b)};
+  int body = pool.MakeOR<ANDS>(Signature(), &ands);
+  ands = {pool.MakeAnd(head, body), pool.MakeAnd(head, hands_a)};
+  int root = pool.MakeOR<ANDS>(Signature(), &ands);
+
+  SetCounter<Signature> counter(&pool, &data);
+  for (int or_id : {hands_a, body, root}) {
+    std::vector<int> defenses = ExpandDefenses(pool, data, or_id);
+    CHECK(defenses.size() == counter.Count(or_id).lo);
+    CHECK(0 == counter.Count(or_id).hi);
+    int lowest = *std::min_element(defenses.begin(), defenses.end());
+    int highest = *std::max_element(defenses.begin(), defenses.end());
+    CHECK(lowest < highest);
+    for (int min_defense = lowest - 1; min_defense <= highest + 1;
+         ++min_defense) {
+      uint64_t expected = std::count_if(
+          defenses.begin(), defenses.end(),
+          [min_defense](int defense) { return defense >= min_defense; });
+      CHECK(SetCount(expected) == counter.Count(or_id, min_defense));
+    }
+  }
+
+  return 0;
+}
@@ -1,18 +1,24 @@
 #ifndef _MONSTER_AVENGERS_EXPLORE_
 #define _MONSTER_AVENGERS_EXPLORE_
 
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
 #include <vector>
 
 #include "data/data_set.h"
+#include "utils/query.h"
 #include "utils/signature.h"
 #include "utils/jewels_query.h"
 #include "iterator.h"
+#include "points_bound.h"
 
 namespace monster_avengers {
   
-  class CachedTreeIterator : public TreeIterator {
+  template <typename Key>
+  class CachedTreeIterator : public TreeIterator<Key> {
   public:
-    explicit CachedTreeIterator(TreeIterator *base_iter) 
+    explicit CachedTreeIterator(TreeIterator<Key> *base_iter) 
       : cache_(), current_(0) {
       while (!base_iter->empty()) {
         cache_.push_back(**base_iter);
@@ -24,7 +30,7 @@ namespace monster_avengers {
       if (current_ < cache_.size()) current_++;
     }
 
-    inline const TreeRoot &operator*() const override {
+    inline const TreeRoot<Key> &operator*() const override {
       return cache_[current_];
     }
 
@@ -40,52 +46,159 @@ namespace monster_avengers {
       return cache_.size();
     }
 
+    inline const std::vector<TreeRoot<Key> > &roots() const {
+      return cache_;
+    }
+
   private:
-    std::vector<TreeRoot> cache_;
+    std::vector<TreeRoot<Key> > cache_;
     size_t current_;
   };
 
-  bool ExploreSkill(TreeIterator *iterator,
+  // Upper bounds of the points that every skill system can reach on
+  // an armor set allowed by the query's armor and jewel filters. The
+  // bound of a part is its best armor, with the best jewels in its
+  // holes, which is SkillSplitter::Max() on the unfiltered foundation
+  // plus the jewels. A skill whose bound is below its lowest positive
+  // points cannot be activated.
+  std::vector<int> SkillUpperBounds(const DataSet &data, 
+                                    const Query &query) {
+    DataSet query_data(data);
+    for (const Armor &amulet : query.amulets) {
+      query_data.AddExtraArmor(AMULET, amulet);
+    }
+    int num_skills = static_cast<int>(data.skill_systems().size());
+    std::vector<int> skill_ids(num_skills);
+    for (int s = 0; s < num_skills; ++s) {
+      skill_ids[s] = s;
+    }
+    PointsBound bound(query_data, query, skill_ids);
+
+    int torso_up_parts = 0;
+    for (int part = HEAD; part < PART_NUM; ++part) {
+      if (BODY != part && bound.TorsoUp(part)) torso_up_parts++;
+    }
+    std::vector<int> result(num_skills, 0);
+    for (int s = 0; s < num_skills; ++s) {
+      for (int part = HEAD; part < PART_NUM; ++part) {
+        int points = bound.Part(part, s);
+        if (BODY == part && points > 0) {
+          result[s] += points * (1 + torso_up_parts);
+        } else {
+          result[s] += points;
+        }
+      }
+    }
+    return result;
+  }
+
+  // Returns true if none of the jewels that can appear in the jewel
+  // keys of a search on previous_effects has points in skill_id. The
+  // jewel keys of such a search then have exactly zero points in
+  // skill_id, which is what ExploreSkill() assumes.
+  bool IsIndependentSkill(const DataSet &data,
+                          int skill_id,
+                          const std::vector<Effect> &previous_effects,
+                          const JewelFilter &filter) {
+    for (int i = 0; i < data.jewels().size(); ++i) {
+      if (!filter.Validate(data, i)) continue;
+      const Jewel &jewel = data.jewel(i);
+      bool used = false;
+      bool affects = false;
+      for (const Effect &jewel_effect : jewel.effects) {
+        if (jewel_effect.skill_id == skill_id) {
+          affects = true;
+        } else if (jewel_effect.points > 0) {
+          for (const Effect &effect : previous_effects) {
+            if (effect.skill_id == jewel_effect.skill_id) {
+              used = true;
+              break;
+            }
+          }
+        }
+      }
+      if (used && affects) return false;
+    }
+    return true;
+  }
+
+  // Tests whether skill_id (with its lowest positive points) can be
+  // added to a query, given the final forest of that query's search
+  // on previous_effects. The forest and the pool are only read, so
+  // that multiple skills can be explored concurrently on the same
+  // forest. Exact only if IsIndependentSkill() holds.
+  template <typename Key>
+  bool ExploreSkill(const std::vector<TreeRoot<Key> > &forest,
                     const DataSet &data, 
-                    NodePool *pool, 
+                    NodePool<Key> *pool, 
                     int skill_id, 
-                    const std::vector<Effect> &previous_effects) {
+                    const std::vector<Effect> &previous_effects,
+                    const JewelFilter &filter) {
     std::vector<Effect> effects = previous_effects;
     effects.emplace_back(skill_id, 
                          data.skill_system(skill_id).LowestPositivePoints());
     int effect_id = effects.size() - 1;
     
-    // Construct the hole client
-    HoleClient hole_client(data, skill_id, effects);
+    // Construct the hole client. Only the existence of a fitting
+    // combination matters, so that the frontiers are enough.
+    HoleClient<Key> hole_client(data, skill_id, effects, filter, true);
 
-    // Construct the splitter.
-    SkillSplitter splitter(data, pool, effect_id, skill_id);
+    // Construct the splitter. Only Max() is used, which does not
+    // create nodes.
+    SkillSplitter<Key> splitter(data, pool, effect_id, skill_id);
 
-    Signature inverse_points(sig::InverseKey(effects.begin(), 
-                                             effects.end()));
+    Key inverse_points(sig::InverseKey<Key>(effects.begin(), 
+                                            effects.end()));
+
+    int required = effects[effect_id].points;
+
+    // The most points of skill_id that the jewels can provide on a
+    // hole alignment, memoized by alignment. Used to skip the trees
+    // and the jewel keys that cannot reach the required points.
+    std::unordered_map<int64_t, int> max_points_memo;
+    auto max_points = [&](int one, int two, int three, 
+                          int body_holes, int multiplier) {
+      int64_t code = ((((static_cast<int64_t>(one) * 64 + two) * 64 + 
+                        three) * 8 + body_holes) * 8 + multiplier);
+      auto it = max_points_memo.find(code);
+      if (max_points_memo.end() != it) return it->second;
+      int result = 0;
+      for (const Key &new_key : 
+             hole_client.Query(one, two, three, body_holes, multiplier)) {
+        result = std::max(result, sig::GetPoints(new_key, effect_id));
+      }
+      max_points_memo[code] = result;
+      return result;
+    };
 
     int one(0), two(0), three(0), body_holes(0);
     
-    iterator->Reset();
-    while (!iterator->empty()) {
-      const TreeRoot &root = **iterator;
-      const OR &node = pool->Or(root.id);
+    for (const TreeRoot<Key> &root : forest) {
+      const OR<Key> &node = pool->Or(root.id);
       int sub_max = splitter.Max(root);
-      Signature key0 = sig::AddPoints(node.key, effect_id, sub_max);
+      sig::KeyHoles(node.key, &one, &two, &three);
+      if (sub_max + max_points(one, two, three, node.key.BodyHoleSum(),
+                               root.torso_multiplier) < required) {
+        continue;
+      }
+      Key key0 = sig::AddPoints(node.key, effect_id, sub_max);
       
-      for (const Signature &jewel_key : root.jewel_keys) {
-        HoleClient::GetResidual(node.key, jewel_key,
-                                &one, &two, &three, &body_holes);
-        for (const Signature &new_key : 
+      for (const Key &jewel_key : root.jewel_keys) {
+        HoleClient<Key>::GetResidual(node.key, jewel_key,
+                                     &one, &two, &three, &body_holes);
+        if (sub_max + max_points(one, two, three, body_holes, 
+                                 root.torso_multiplier) < required) {
+          continue;
+        }
+        for (const Key &new_key : 
                hole_client.Query(one, two, three, 
                                  body_holes, root.torso_multiplier)) {
-          Signature key1 = jewel_key + new_key;
+          Key key1 = jewel_key + new_key;
           if (sig::Satisfy(key0 | key1, inverse_points)) {
             return true;
           }
         }
       }
-      ++(*iterator);
     }
     return false;
   }
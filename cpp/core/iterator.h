@@ -1,131 +1,337 @@
 #ifndef _MONSTER_AVENGERS_ITERATOR_
 #define _MONSTER_AVENGERS_ITERATOR_
 
+#include <algorithm>
+#include <cstdint>
 #include <memory>
 #include <array>
+#include <queue>
+#include <vector>
+#include "supp/deadline.h"
+#include "supp/timer.h"
 #include "or_and_tree.h"
 #include "utils/formatter.h"
 
 namespace monster_avengers {
 
+  template <typename Key>
   class TreeIterator {
   public:
+    virtual ~TreeIterator() {}
     virtual void operator++() = 0;
-    virtual const TreeRoot &operator*() const = 0;
+    virtual const TreeRoot<Key> &operator*() const = 0;
     virtual bool empty() const = 0;
     virtual void Reset() = 0;
+    // Seconds spent in the iterator so far, including the time spent
+    // pulling from the iterators before it.
+    virtual double Seconds() const { return 0.0; }
+    // Calls to sig::Satisfy() made by the iterator itself so far.
+    virtual int64_t SatisfyCalls() const { return 0; }
   };
 
   class ArmorSetIterator {
   public:
+    virtual ~ArmorSetIterator() {}
     virtual void operator++() = 0;
     virtual const ArmorSet& operator*() const = 0;
     virtual bool empty() const = 0;
     virtual int BaseIndex() const = 0;
     // virtual void Reset() = 0;
   };
-  
-  class ExpansionIterator : public ArmorSetIterator {
+
+  // The work of a stage of the iterator chains of a search. The trees
+  // and the jewel keys coming in are those that came out of the stage
+  // before.
+  struct StageStats {
+    const char *name;
+    // The position of the skill of the stage in the query, -1 if the
+    // stage has none.
+    int effect_id;
+    int64_t trees_in;
+    int64_t trees_out;
+    int64_t keys_in;
+    int64_t keys_out;
+    int64_t armor_sets_out;
+    int64_t satisfy_calls;
+    int64_t or_nodes;
+    double seconds;
+
+    StageStats(const char *name_ = "", int effect_id_ = -1)
+      : name(name_), effect_id(effect_id_), trees_in(0), trees_out(0),
+        keys_in(0), keys_out(0), armor_sets_out(0), satisfy_calls(0),
+        or_nodes(0), seconds(0.0) {}
+  };
+
+  // InstrumentedTreeIterator counts what a stage of the tree iterator
+  // chain yields: the trees and their jewel keys, along with the OR
+  // nodes created and the time spent while building it and pulling
+  // from it. The pulls include the stages before it, as pulling from
+  // a stage pulls from them. The stage is built before it is wrapped,
+  // so that the OR nodes and the time of its construction are passed
+  // in.
+  template <typename Key>
+  class InstrumentedTreeIterator : public TreeIterator<Key> {
   public:
-    ExpansionIterator(TreeIterator *base_iter, 
-                     const NodePool *pool)
-      : base_iter_(base_iter), pool_(pool), top_(-1) {
+    InstrumentedTreeIterator(TreeIterator<Key> *base_iter,
+                             const NodePool<Key> *pool,
+                             const StageStats &initial)
+      : base_iter_(base_iter), pool_(pool), stats_(initial),
+        pulled_(StageStats()) {
+      CountCurrent();
+    }
+
+    inline void operator++() override {
+      size_t or_size = pool_->OrSize();
+      {
+        ScopedTimer timer(&pulled_.seconds);
+        ++(*base_iter_);
+      }
+      pulled_.or_nodes += pool_->OrSize() - or_size;
+      CountCurrent();
+    }
+
+    inline const TreeRoot<Key> &operator*() const override {
+      return **base_iter_;
+    }
+
+    inline bool empty() const override {
+      return base_iter_->empty();
+    }
+
+    inline void Reset() override {
+      base_iter_->Reset();
+    }
+
+    inline double Seconds() const override {
+      return base_iter_->Seconds();
+    }
+
+    inline int64_t SatisfyCalls() const override {
+      return base_iter_->SatisfyCalls();
+    }
+
+    // The trees_in and keys_in are left to the caller.
+    StageStats stats() const {
+      StageStats stats = stats_;
+      stats.satisfy_calls = base_iter_->SatisfyCalls();
+      stats.or_nodes += pulled_.or_nodes;
+      stats.seconds += pulled_.seconds;
+      return stats;
+    }
+
+    // Only the OR nodes and the time of the pulls, which the stage
+    // after it accounts for as well.
+    inline const StageStats &pulled() const {
+      return pulled_;
+    }
+
+  private:
+    inline void CountCurrent() {
       if (!base_iter_->empty()) {
-        int or_id = (**base_iter).id;
-        armor_set_.jewel_keys = (**base_iter).jewel_keys;
-        while (-1 != or_id) {
-          const OR &or_node = pool_->Or(or_id);
-          if (ANDS == or_node.tag) {
-            const AND &and_node = pool_->And(or_node.daughters[0]);
-            top_++;
-            stack_[top_].or_id = or_id;
-            stack_[top_].and_id = 0;
-            stack_[top_].armor_or_id = and_node.left;
-            stack_[top_].armor_seq = 0;
-            armor_set_.ids[top_] = pool_->Or(and_node.left).daughters[0];
-            or_id = and_node.right;
-          } else {
-            top_++;
-            stack_[top_].or_id = -1;
-            stack_[top_].and_id = -1;
-            stack_[top_].armor_or_id = or_id;
-            stack_[top_].armor_seq = 0;
-            armor_set_.ids[top_] = pool_->Or(or_id).daughters[0];
-            or_id = -1;
-          }
-        }
+        stats_.trees_out++;
+        stats_.keys_out += (**base_iter_).jewel_keys.size();
       }
     }
 
-    void operator++() override {
-      if (-1 >= top_) return;
+    TreeIterator<Key> *base_iter_;
+    const NodePool<Key> *pool_;
+    StageStats stats_;
+    StageStats pulled_;
+  };
+
+  // InstrumentedArmorSetIterator counts the armor sets of an output
+  // stage, and the time spent while pulling from it (including the
+  // tree stages it pulls from), like InstrumentedTreeIterator.
+  class InstrumentedArmorSetIterator : public ArmorSetIterator {
+  public:
+    InstrumentedArmorSetIterator(ArmorSetIterator *base_iter,
+                                 const StageStats &initial)
+      : base_iter_(base_iter), stats_(initial) {
+      if (!base_iter_->empty()) stats_.armor_sets_out++;
+    }
+
+    inline void operator++() override {
       {
-        const OR &armor_or = pool_->Or(stack_[top_].armor_or_id);
-        if ((++stack_[top_].armor_seq) < armor_or.daughters.size()) {
-          armor_set_.ids[top_] = armor_or.daughters[stack_[top_].armor_seq];
-          return;
-        } 
+        ScopedTimer timer(&stats_.seconds);
+        ++(*base_iter_);
       }
-      
-      top_--;
-      int or_id = stack_[top_].or_id;
-      while (0 <= top_) {
-        const OR &armor_or = pool_->Or(stack_[top_].armor_or_id);
-        if ((++stack_[top_].armor_seq) < armor_or.daughters.size()) {
-          armor_set_.ids[top_] = armor_or.daughters[stack_[top_].armor_seq];
-          or_id = pool_->OrAnd(stack_[top_].or_id, stack_[top_].and_id).right;
-          break;
-        }
-        const OR &or_node = pool_->Or(stack_[top_].or_id);
-        if ((++stack_[top_].and_id) < or_node.daughters.size()) {
-          const AND &and_node = 
-            pool_->OrAnd(stack_[top_].or_id, stack_[top_].and_id);
-          stack_[top_].armor_or_id = and_node.left;
-          stack_[top_].armor_seq = 0;
-          armor_set_.ids[top_] = pool_->Or(and_node.left).daughters[0];
-          or_id = and_node.right;
-          break;
-        }
-        top_--;
+      if (!base_iter_->empty()) stats_.armor_sets_out++;
+    }
+
+    inline const ArmorSet &operator*() const override {
+      return **base_iter_;
+    }
+
+    inline bool empty() const override {
+      return base_iter_->empty();
+    }
+
+    inline int BaseIndex() const override {
+      return base_iter_->BaseIndex();
+    }
+
+    inline const StageStats &stats() const {
+      return stats_;
+    }
+
+  private:
+    ArmorSetIterator *base_iter_;
+    StageStats stats_;
+  };
+  
+  // DefenseBounds memoizes, for each OR, the highest and the lowest
+  // defense (the sum of max_defense of the armors) of the armor sets
+  // under it. The tables grow with the pool.
+  template <typename Key>
+  class DefenseBounds {
+  public:
+    DefenseBounds(const NodePool<Key> *pool, const DataSet *data)
+      : pool_(pool), data_(data), max_(), min_() {}
+
+    inline int Armor(int armor_id) const {
+      return data_->armor(armor_id).max_defense;
+    }
+
+    inline int Max(int or_id) {
+      return Bound(or_id, true, &max_);
+    }
+
+    inline int Min(int or_id) {
+      return Bound(or_id, false, &min_);
+    }
+
+  private:
+    enum { NOT_COMPUTED = -1 };
+
+    int Bound(int or_id, bool highest, std::vector<int> *memo) {
+      if (memo->size() <= static_cast<size_t>(or_id)) {
+        memo->resize(std::max(pool_->OrSize(), 
+                              static_cast<size_t>(or_id) + 1), 
+                     static_cast<int>(NOT_COMPUTED));
       }
-      
-      if (-1 >= top_) {
-        if (!base_iter_->empty()) {
-          ++(*base_iter_);
-          if (!base_iter_->empty()) {
-            or_id = (**base_iter_).id;
-            armor_set_.jewel_keys = (**base_iter_).jewel_keys;
-          } else {
-            or_id = -1;
-          }
+      if (NOT_COMPUTED != (*memo)[or_id]) return (*memo)[or_id];
+      const OR<Key> &or_node = pool_->Or(or_id);
+      int result = 0;
+      bool first = true;
+      for (int daughter : or_node.daughters) {
+        int bound = 0;
+        if (ANDS == or_node.tag) {
+          const AND &and_node = pool_->And(daughter);
+          bound = Bound(and_node.left, highest, memo) + 
+            Bound(and_node.right, highest, memo);
         } else {
-          or_id = -1;
+          bound = Armor(daughter);
+        }
+        if (first || (highest ? bound > result : bound < result)) {
+          result = bound;
         }
+        first = false;
       }
-      
-      while (-1 != or_id) {
-        const OR &or_node = pool_->Or(or_id);
-        if (ANDS == or_node.tag) {
-          const AND &and_node = pool_->And(or_node.daughters[0]);
-          top_++;
-          stack_[top_].or_id = or_id;
-          stack_[top_].and_id = 0;
-          stack_[top_].armor_or_id = and_node.left;
-          stack_[top_].armor_seq = 0;
-          armor_set_.ids[top_] = pool_->Or(and_node.left).daughters[0];
-          or_id = and_node.right;
-        } else {
-          top_++;
-          stack_[top_].or_id = -1;
-          stack_[top_].and_id = -1;
-          stack_[top_].armor_or_id = or_id;
-          stack_[top_].armor_seq = 0;
-          armor_set_.ids[top_] = pool_->Or(or_id).daughters[0];
-          or_id = -1;
+      (*memo)[or_id] = result;
+      return result;
+    }
+
+    const NodePool<Key> *pool_;
+    const DataSet *data_;
+    std::vector<int> max_;
+    std::vector<int> min_;
+  };
+
+  // A choice of an ANDS OR is an AND with an armor of its left OR,
+  // and leads to the right OR of the AND. A choice of an ARMORS OR is
+  // one of its armors, and completes the armor set (next_or is -1).
+  struct ArmorChoice {
+    int armor_id;
+    int next_or;
+  };
+
+  // Calls f(choice) for each ArmorChoice of or_id.
+  template <typename Key, typename F>
+  void ForEachChoice(const NodePool<Key> &pool, int or_id, F f) {
+    const OR<Key> &or_node = pool.Or(or_id);
+    if (ANDS == or_node.tag) {
+      for (int and_id : or_node.daughters) {
+        const AND &and_node = pool.And(and_id);
+        for (int armor_id : pool.Or(and_node.left).daughters) {
+          f(ArmorChoice{armor_id, and_node.right});
         }
       }
-      
-      return;
+    } else {
+      for (int armor_id : or_node.daughters) {
+        f(ArmorChoice{armor_id, -1});
+      }
+    }
+  }
+
+  // A tree root kept by an armor set iterator after its TreeIterator
+  // has moved on, with the jewel keys widened as in ArmorSet.
+  struct RootSnapshot {
+    template <typename Key>
+    explicit RootSnapshot(const TreeRoot<Key> &root) 
+      : id(root.id), jewel_keys() {
+      for (const Key &jewel_key : root.jewel_keys) {
+        jewel_keys.emplace_back(jewel_key);
+      }
+    }
+
+    int id;
+    std::vector<WideSignature> jewel_keys;
+  };
+
+  // Whether an expansion that has taken steps steps (popped states,
+  // draws) should stop for deadline. The deadline is only checked
+  // every 1024 steps, and the first interval always runs, so that the
+  // trees found before the deadline still yield armor sets.
+  inline bool ExpansionExpired(const Deadline *deadline, int64_t steps) {
+    return nullptr != deadline && 0 < steps && 0 == steps % 1024 &&
+      deadline->Expired();
+  }
+
+  // RankedExpansionIterator expands the trees into armor sets in the
+  // descending order of their defense (the sum of max_defense of the
+  // armors), so that the first K armor sets are the true top K. Armor
+  // sets below min_defense are never produced. Unless per_tree (see
+  // below), the whole forest of base_iter is consumed on
+  // construction.
+  //
+  // Each OR is annotated with the maximum defense reachable from it,
+  // and the expansion is best-first. A state is a partial armor set
+  // (the armors chosen so far on the path) with the OR that remains
+  // to be expanded, and it is ranked by the defense of the chosen
+  // armors plus the bound of that OR. The choices of an OR (an AND
+  // with an armor of its left OR, or an armor of the last part) are
+  // sorted by their bounds once. A popped state only pushes its best
+  // choice and its next sibling, and the siblings below min_defense
+  // are skipped at once, together with their subtrees.
+  //
+  // With per_tree, the trees are instead pulled from base_iter one at
+  // a time, and only the armor sets of each tree are ranked. The
+  // first armor sets then come out as soon as the first tree does,
+  // without waiting for the whole forest.
+  //
+  // The expansion stops early once deadline (if any) has expired.
+  template <typename Key>
+  class RankedExpansionIterator : public ArmorSetIterator {
+  public:
+    RankedExpansionIterator(TreeIterator<Key> *base_iter,
+                            const NodePool<Key> *pool,
+                            const DataSet *data,
+                            int min_defense,
+                            const Deadline *deadline = nullptr,
+                            bool per_tree = false)
+      : base_iter_(base_iter), pool_(pool), bounds_(pool, data),
+        min_defense_(min_defense), deadline_(deadline),
+        per_tree_(per_tree), roots_(), choice_heads_(), choices_(),
+        queue_(), sequence_(0), root_(-1), keys_root_(-1),
+        states_(0), pruned_(0) {
+      if (!per_tree_) {
+        while (PullTree()) {}
+      }
+      Proceed();
+    }
+
+    void operator++() override {
+      Proceed();
     }
 
     inline const ArmorSet& operator*() const override {
@@ -133,25 +339,184 @@ namespace monster_avengers {
     }
 
     inline bool empty() const override {
-      return -1 >= top_;
+      return -1 == root_;
     }
 
     inline int BaseIndex() const override {
-      return (**base_iter_).id;
+      return roots_[root_].id;
+    }
+
+    // Number of states popped from the queue so far.
+    inline int64_t states() const {
+      return states_;
     }
-    
+
+    // Number of subtrees skipped so far for being below min_defense.
+    inline int64_t pruned() const {
+      return pruned_;
+    }
+
   private:
-    struct StackElement {
+    // Taking armor_id leads to next_or (-1 if the armor set is then
+    // complete), and bound is the best defense after armor_id.
+    struct Choice {
+      int bound;
+      int armor_id;
+      int next_or;
+    };
+
+    struct ChoiceRange {
+      int begin;
+      int size;
+    };
+
+    // The first depth ids are the armors chosen so far, and choice is
+    // the next choice of or_id to take.
+    struct State {
+      int bound;
+      int defense;
+      int root;
       int or_id;
-      int and_id;
-      int armor_or_id;
-      int armor_seq;
+      int choice;
+      int depth;
+      int64_t sequence;
+      std::array<int, PART_NUM> ids;
+    };
+
+    // Ties are broken by the order of insertion, so that the output
+    // is deterministic.
+    struct StateLess {
+      bool operator()(const State &a, const State &b) const {
+        if (a.bound != b.bound) return a.bound < b.bound;
+        return a.sequence > b.sequence;
+      }
     };
-    
-    TreeIterator *base_iter_;
-    const NodePool *pool_;
-    std::array<StackElement, PART_NUM> stack_;
-    int top_;
+
+    // Takes the next tree of base_iter, returns false if there is
+    // none left.
+    bool PullTree() {
+      if (base_iter_->empty()) return false;
+      roots_.emplace_back(**base_iter_);
+      ++(*base_iter_);
+
+      int bound = bounds_.Max(roots_.back().id);
+      if (bound < min_defense_) {
+        pruned_++;
+        return true;
+      }
+      State state;
+      state.bound = bound;
+      state.defense = 0;
+      state.root = static_cast<int>(roots_.size()) - 1;
+      state.or_id = roots_.back().id;
+      state.choice = 0;
+      state.depth = 0;
+      Push(state);
+      return true;
+    }
+
+    const ChoiceRange &Choices(int or_id) {
+      if (choice_heads_.size() <= static_cast<size_t>(or_id)) {
+        choice_heads_.resize(std::max(pool_->OrSize(), 
+                                      static_cast<size_t>(or_id) + 1),
+                             ChoiceRange{-1, 0});
+      }
+      ChoiceRange &range = choice_heads_[or_id];
+      if (-1 != range.begin) return range;
+      range.begin = static_cast<int>(choices_.size());
+      ForEachChoice(*pool_, or_id, [this](const ArmorChoice &choice) {
+          int bound = bounds_.Armor(choice.armor_id);
+          if (-1 != choice.next_or) bound += bounds_.Max(choice.next_or);
+          choices_.push_back(Choice{bound, choice.armor_id, 
+                                    choice.next_or});
+        });
+      range.size = static_cast<int>(choices_.size()) - range.begin;
+      std::stable_sort(choices_.begin() + range.begin, choices_.end(),
+                       [](const Choice &a, const Choice &b) {
+                         return a.bound > b.bound;
+                       });
+      return range;
+    }
+
+    inline void Push(State state) {
+      state.sequence = sequence_++;
+      queue_.push(state);
+    }
+
+    void Proceed() {
+      root_ = -1;
+      while (true) {
+        if (queue_.empty()) {
+          if (!per_tree_) return;
+          // The previous tree is done.
+          roots_.clear();
+          keys_root_ = -1;
+          if (!PullTree()) return;
+          continue;
+        }
+        if (ExpansionExpired(deadline_, states_)) return;
+        State state = queue_.top();
+        queue_.pop();
+        states_++;
+
+        if (-1 == state.or_id) {
+          Emit(state);
+          return;
+        }
+
+        ChoiceRange range = Choices(state.or_id);
+        Choice choice = choices_[range.begin + state.choice];
+
+        // The siblings are sorted, so that once the next one is below
+        // min_defense all the remaining ones are.
+        if (state.choice + 1 < range.size) {
+          int bound = state.defense + 
+            choices_[range.begin + state.choice + 1].bound;
+          if (bound >= min_defense_) {
+            State sibling = state;
+            sibling.bound = bound;
+            sibling.choice++;
+            Push(sibling);
+          } else {
+            pruned_ += range.size - state.choice - 1;
+          }
+        }
+
+        // The state moves down to its best choice.
+        state.bound = state.defense + choice.bound;
+        state.defense += bounds_.Armor(choice.armor_id);
+        state.or_id = choice.next_or;
+        state.choice = 0;
+        state.ids[state.depth++] = choice.armor_id;
+        Push(state);
+      }
+    }
+
+    void Emit(const State &state) {
+      armor_set_.ids = state.ids;
+      if (keys_root_ != state.root) {
+        armor_set_.jewel_keys = roots_[state.root].jewel_keys;
+        keys_root_ = state.root;
+      }
+      root_ = state.root;
+    }
+
+    TreeIterator<Key> *base_iter_;
+    const NodePool<Key> *pool_;
+    DefenseBounds<Key> bounds_;
+    int min_defense_;
+    const Deadline *deadline_;
+    bool per_tree_;
+    std::vector<RootSnapshot> roots_;
+    std::vector<ChoiceRange> choice_heads_;
+    std::vector<Choice> choices_;
+    std::priority_queue<State, std::vector<State>, StateLess> queue_;
+    int64_t sequence_;
+    int root_;
+    // The root whose jewel keys are in armor_set_.
+    int keys_root_;
+    int64_t states_;
+    int64_t pruned_;
     ArmorSet armor_set_;
   };
 }
@@ -2,9 +2,13 @@
 #define _MONSTER_AVENGERS_SEARCH_UTIL_
 
 #include <algorithm>
+#include <memory>
+#include <new>
+#include <type_traits>
 #include <vector>
 #include <array>
 #include <unordered_map>
+#include "supp/arena.h"
 #include "data/data_set.h"
 #include "utils/jewels_query.h"
 
@@ -15,23 +19,53 @@ namespace monster_avengers {
     ARMORS
   };
 
+  // An immutable list of node (or armor) ids, whose storage is owned
+  // by the arena of the NodePool.
+  class IdList {
+  public:
+    IdList() : ids_(nullptr), size_(0) {}
+    IdList(const int *ids, int size) : ids_(ids), size_(size) {}
+
+    inline const int *begin() const {
+      return ids_;
+    }
+
+    inline const int *end() const {
+      return ids_ + size_;
+    }
+
+    inline size_t size() const {
+      return size_;
+    }
+
+    inline bool empty() const {
+      return 0 == size_;
+    }
+
+    inline int operator[](int i) const {
+      return ids_[i];
+    }
+
+  private:
+    const int *ids_;
+    int size_;
+  };
+
+  template <typename Key>
   struct OR {
-    Signature key;
+    Key key;
     ORTag tag;
-    std::vector<int> daughters;
+    IdList daughters;
 
     OR() = default;
       
-    OR(Signature key_, ORTag tag_, 
-       std::vector<int> *daughters_) :
+    OR(Key key_, ORTag tag_, IdList daughters_) :
       key(key_),
-      tag(tag_) {
-      daughters.swap(*daughters_);
-    }
+      tag(tag_),
+      daughters(daughters_) {}
   };
 
   struct AND {
-    Signature key;
     int left;
     int right;
 
@@ -41,6 +75,52 @@ namespace monster_avengers {
       : left(left_), right(right_) {}
   };
 
+  // Nodes are stored in fixed size chunks allocated from the arena,
+  // so that references to nodes stay valid while new nodes are
+  // created.
+  template <typename Node>
+  class NodeStore {
+  public:
+    static const int CHUNK_BITS = 12;
+    static const int CHUNK_SIZE = 1 << CHUNK_BITS;
+
+    explicit NodeStore(Arena *arena) 
+      : arena_(arena), chunks_(), size_(0) {
+      static_assert(std::is_trivially_destructible<Node>::value,
+                    "Nodes in arena are never destructed.");
+    }
+
+    inline int Add(const Node &node) {
+      if (size_ == (chunks_.size() << CHUNK_BITS)) {
+        chunks_.push_back(arena_->AllocateArray<Node>(CHUNK_SIZE));
+      }
+      new (&chunks_[size_ >> CHUNK_BITS][size_ & (CHUNK_SIZE - 1)]) Node(node);
+      return size_++;
+    }
+
+    inline const Node &operator[](int id) const {
+      return chunks_[id >> CHUNK_BITS][id & (CHUNK_SIZE - 1)];
+    }
+
+    inline size_t size() const {
+      return size_;
+    }
+
+    // Drops the nodes (and the chunks allocated for them) beyond size.
+    inline void Truncate(size_t size) {
+      size_ = size;
+      chunks_.resize((size + CHUNK_SIZE - 1) >> CHUNK_BITS);
+    }
+
+  private:
+    Arena *arena_;
+    std::vector<Node*> chunks_;
+    size_t size_;
+  };
+
+  // NodePool allocates all of its nodes and daughter lists from an
+  // arena. If no arena is provided, the pool creates its own.
+  template <typename Key>
   class NodePool {
   public:
     struct Snapshot {
@@ -50,21 +130,28 @@ namespace monster_avengers {
       size_t and_size;
     };
     
-    NodePool() : or_pool_(), and_pool_(), snapshots_() {}
+    NodePool() 
+      : owned_arena_(new Arena()), arena_(owned_arena_.get()),
+        or_pool_(arena_), and_pool_(arena_), snapshots_() {}
+
+    explicit NodePool(Arena *arena) 
+      : owned_arena_(), arena_(arena),
+        or_pool_(arena_), and_pool_(arena_), snapshots_() {}
     
     // Returns the index of the newly created OR node.
     template <ORTag Tag>
-    int MakeOR(Signature key, std::vector<int> *daughters) {
-      or_pool_.emplace_back(key, Tag, daughters);
-      return or_pool_.size() - 1;
+    int MakeOR(Key key, const std::vector<int> *daughters) {
+      int *ids = arena_->AllocateArray<int>(daughters->size());
+      std::copy(daughters->begin(), daughters->end(), ids);
+      return or_pool_.Add(OR<Key>(key, Tag, 
+                             IdList(ids, static_cast<int>(daughters->size()))));
     }
 
     int MakeAnd(int left, int right) {
-      and_pool_.emplace_back(left, right);
-      return and_pool_.size() - 1;
+      return and_pool_.Add(AND(left, right));
     }
     
-    inline const OR &Or(int id) const {
+    inline const OR<Key> &Or(int id) const {
       return or_pool_[id];
     }
 
@@ -72,7 +159,7 @@ namespace monster_avengers {
       return and_pool_[id];
     }
 
-    inline const OR &AndLeftOr(int and_id) const {
+    inline const OR<Key> &AndLeftOr(int and_id) const {
       return or_pool_[and_pool_[and_id].left];
     }
 
@@ -88,35 +175,47 @@ namespace monster_avengers {
       return and_pool_.size();
     }
 
+    inline Arena *arena() const {
+      return arena_;
+    }
+
     inline void PushSnapshot() {
       snapshots_.emplace_back(or_pool_.size(), and_pool_.size());
     }
 
     inline void PopSnapshot() {
-      or_pool_.resize(snapshots_.back().or_size);
-      and_pool_.resize(snapshots_.back().and_size);
+      RestoreSnapshot();
       snapshots_.pop_back();
     }
     
     inline void RestoreSnapshot() {
-      or_pool_.resize(snapshots_.back().or_size);
-      and_pool_.resize(snapshots_.back().and_size);
+      or_pool_.Truncate(snapshots_.back().or_size);
+      and_pool_.Truncate(snapshots_.back().and_size);
     }
 
   private:
-    std::vector<OR> or_pool_;
-    std::vector<AND> and_pool_;
+    std::unique_ptr<Arena> owned_arena_;
+    Arena *arena_;
+    NodeStore<OR<Key> > or_pool_;
+    NodeStore<AND> and_pool_;
     std::vector<Snapshot> snapshots_;
   };
+
+  template <typename Key>
+  using JewelKeyList = std::vector<Key, ArenaAllocator<Key> >;
   
+  // jewel_keys are allocated from the arena if one is given.
+  template <typename Key>
   struct TreeRoot {
     int id; // OR node id
-    std::vector<Signature> jewel_keys;
+    JewelKeyList<Key> jewel_keys;
     int torso_multiplier;
     
-    TreeRoot(int id_) : id(id_), jewel_keys(), torso_multiplier(1) {}
-    TreeRoot(int id_, const OR &node) : 
-      id(id_), jewel_keys(), 
+    TreeRoot(int id_, Arena *arena = nullptr) 
+      : id(id_), jewel_keys(ArenaAllocator<Key>(arena)), 
+        torso_multiplier(1) {}
+    TreeRoot(int id_, const OR<Key> &node, Arena *arena = nullptr) : 
+      id(id_), jewel_keys(ArenaAllocator<Key>(arena)), 
       torso_multiplier(node.key.multiplier()) {}
   };
 
@@ -128,17 +227,25 @@ namespace monster_avengers {
       : id(id_), points(points_) {}
   };
 
+  // Splits the ORs of a forest by the points of one skill. The
+  // forest is a DAG, so the same OR is reached from many roots and
+  // many ANDs. Max and Split results are memoized per OR id in dense
+  // tables, which makes a pass over the forest linear in its size.
+  //
+  // The memo refers to OR ids, so a splitter must not outlive a
+  // RestoreSnapshot() of its pool.
+  template <typename Key>
   class SkillSplitter {
   public:
     SkillSplitter(const DataSet &data,
-                  NodePool *pool,
+                  NodePool<Key> *pool,
                   int effect_id,
                   int skill_id) 
       : pool_(pool), effect_id_(effect_id) {
-      armor_points_.resize(data.armors().size());
-      is_body_.resize(data.armors().size());
-      int i = 0;
-      for (const Armor &armor : data.armors()) {
+      armor_points_.resize(data.ArmorCount());
+      is_body_.resize(data.ArmorCount());
+      for (int i = 0; i < data.ArmorCount(); ++i) {
+        const Armor &armor = data.armor(i);
         armor_points_[i] = 0;
         is_body_[i] = armor.part == BODY;
         for (const Effect &effect : armor.effects) {
@@ -147,35 +254,89 @@ namespace monster_avengers {
             break;
           }
         }
-        i++;
       }
     }
 
-    inline int Max(const TreeRoot &root) const {
+    inline int Max(const TreeRoot<Key> &root) {
       return MaxOr(root.id, root.torso_multiplier);
     }
 
-    inline std::vector<int> Split(const TreeRoot &root, int sub_min) {
-      std::vector<TempOr> temp_ors;
+    inline std::vector<int> Split(const TreeRoot<Key> &root, int sub_min) {
       std::vector<int> result;
-      SplitOr(root.id, sub_min, &temp_ors, 
-              root.torso_multiplier);
-      for (TempOr &item : temp_ors) {
-        result.push_back(item.id);
+      SplitRange range = SplitOr(root.id, sub_min, root.torso_multiplier);
+      for (int i = range.begin; i < range.begin + range.size; ++i) {
+        result.push_back(split_results_[i].id);
       }
       return result;
     }
     
   private:
     typedef std::unordered_map<int, std::vector<int> > PointsIdListMap;
+
+    enum { NOT_COMPUTED = -1000000 };
+
+    // A range of split_results_ (or armor_groups_), and the maximum
+    // points in it.
+    struct SplitRange {
+      int begin;
+      int size;
+      int max;
+
+      SplitRange() : begin(-1), size(0), max(-1000) {}
+    };
+
+    // The armors of an ARMORS OR with the same points. The OR holding
+    // them is only created when an AND needs it.
+    struct ArmorGroup {
+      int points;
+      int or_id;
+      std::vector<int> armor_ids;
+
+      ArmorGroup(int points_, std::vector<int> &&armor_ids_)
+        : points(points_), or_id(-1), armor_ids(std::move(armor_ids_)) {}
+    };
+
+    // A memoized split of an ANDS OR, chained per OR id.
+    struct SplitEntry {
+      int sub_min;
+      int multiplier;
+      SplitRange range;
+      int next;
+
+      SplitEntry(int sub_min_, int multiplier_, SplitRange range_, 
+                 int next_)
+        : sub_min(sub_min_), multiplier(multiplier_), range(range_),
+          next(next_) {}
+    };
+
+    // Returns the memo slot of or_id under multiplier, growing the
+    // table up to the current pool size if needed.
+    template <typename Value>
+    Value &Slot(std::vector<std::vector<Value> > *memo, 
+                int multiplier, int or_id, const Value &empty) {
+      if (memo->size() <= static_cast<size_t>(multiplier)) {
+        memo->resize(multiplier + 1);
+      }
+      std::vector<Value> &table = (*memo)[multiplier];
+      if (table.size() <= static_cast<size_t>(or_id)) {
+        table.resize(std::max(pool_->OrSize(), 
+                              static_cast<size_t>(or_id) + 1), empty);
+      }
+      return table[or_id];
+    }
+
+    inline int ArmorPoints(int armor_id, int multiplier) const {
+      int points = armor_points_[armor_id];
+      if (is_body_[armor_id] && multiplier > 1) {
+        points *= multiplier;
+      }
+      return points;
+    }
     
     int MaxArmorOr(int or_id, int multiplier) const {
       int result = -1000;
       for (int armor_id : pool_->Or(or_id).daughters) {
-        int points = armor_points_[armor_id];
-        if (is_body_[armor_id] && multiplier > 1) {
-          points *= multiplier;
-        }
+        int points = ArmorPoints(armor_id, multiplier);
         if (points > result) {
           result = points;
         }
@@ -183,15 +344,18 @@ namespace monster_avengers {
       return result;
     }
 
-    int MaxAnd(int and_id, int multiplier) const {
+    int MaxAnd(int and_id, int multiplier) {
       const AND &node = pool_->And(and_id);
-      const OR &right_node = pool_->Or(node.right);
+      const OR<Key> &right_node = pool_->Or(node.right);
       return MaxArmorOr(node.left, multiplier) + 
         (ANDS == right_node.tag ? MaxOr(node.right, multiplier) : 
          MaxArmorOr(node.right, multiplier));
     }
     
-    int MaxOr(int or_id, int multiplier) const {
+    int MaxOr(int or_id, int multiplier) {
+      int &memo = Slot(&max_memo_, multiplier, or_id,
+                       static_cast<int>(NOT_COMPUTED));
+      if (NOT_COMPUTED != memo) return memo;
       int result = -1000;
       for (int and_id : pool_->Or(or_id).daughters) {
         int tmp = MaxAnd(and_id, multiplier);
@@ -199,137 +363,150 @@ namespace monster_avengers {
           result = tmp;
         }
       }
+      // The slot may have moved while recursing.
+      Slot(&max_memo_, multiplier, or_id, 
+           static_cast<int>(NOT_COMPUTED)) = result;
       return result;
     }
 
-    int SplitArmorOr(int or_id, PointsIdListMap *new_armors, 
-                     int multiplier) {
-      int result_max = -1000;
+    // Groups the armors of an ARMORS OR by points, into a range of
+    // armor_groups_.
+    SplitRange GroupArmorOr(int or_id, int multiplier) {
+      SplitRange &memo = Slot(&group_memo_, multiplier, or_id, 
+                              SplitRange());
+      if (-1 != memo.begin) return memo;
+      PointsIdListMap temp_map;
+      SplitRange range;
       for (int armor_id : pool_->Or(or_id).daughters) {
-        int points = armor_points_[armor_id];
-        if (is_body_[armor_id] && multiplier > 1) {
-          points *= multiplier;
-        }
-        if (points > result_max) {
-          result_max = points;
-        }
-        auto it = new_armors->find(points);
-        if (new_armors->end() != it) {
-          it->second.push_back(armor_id);
-        } else {
-          (*new_armors)[points] = {armor_id};
+        int points = ArmorPoints(armor_id, multiplier);
+        if (points > range.max) {
+          range.max = points;
         }
+        temp_map[points].push_back(armor_id);
+      }
+      range.begin = static_cast<int>(armor_groups_.size());
+      range.size = static_cast<int>(temp_map.size());
+      for (auto &item : temp_map) {
+        armor_groups_.emplace_back(item.first, std::move(item.second));
       }
-      return result_max;
+      memo = range;
+      return range;
     }
 
-    int SplitArmorOr(int or_id, std::vector<TempOr> *new_armors, 
-                     int sub_min, int multiplier) {
-      PointsIdListMap temp_map;
-      int result_max = -1000;
-      const OR &node = pool_->Or(or_id);
-      for (int armor_id : node.daughters) {
-        int points = armor_points_[armor_id];
-        if (is_body_[armor_id] && multiplier > 1) {
-          points *= multiplier;
-        }
-        if (points > result_max) {
-          result_max = points;
-        }
-        auto it = temp_map.find(points);
-        if (temp_map.end() != it) {
-          it->second.push_back(armor_id);
-        } else {
-          temp_map[points] = {armor_id};
-        }
+    // Returns the id of the OR holding the armors of the group, which
+    // splits the ARMORS OR or_id.
+    int ArmorGroupOr(int or_id, int group) {
+      if (-1 == armor_groups_[group].or_id) {
+        armor_groups_[group].or_id =
+          pool_->template MakeOR<ARMORS>(sig::AddPoints(pool_->Or(or_id).key,
+                                               effect_id_,
+                                               armor_groups_[group].points),
+                                &armor_groups_[group].armor_ids);
       }
+      return armor_groups_[group].or_id;
+    }
 
-      // node may be invalid below due to MakeOR<ARMORS>().
-      Signature key = node.key;
-      
-      for (auto &item : temp_map) {
-        int new_or_id = pool_->MakeOR<ARMORS>(sig::AddPoints(key,
-                                                             effect_id_,
-                                                             item.first),
-                                              &item.second);
-        new_armors->emplace_back(new_or_id, item.first);
+    // Splits an ARMORS OR into one OR per points, as a range of
+    // split_results_.
+    SplitRange SplitArmorOr(int or_id, int multiplier) {
+      {
+        const SplitRange &memo = Slot(&armor_split_memo_, multiplier, 
+                                      or_id, SplitRange());
+        if (-1 != memo.begin) return memo;
       }
-      
-      return result_max;
+      SplitRange groups = GroupArmorOr(or_id, multiplier);
+      SplitRange range;
+      range.begin = static_cast<int>(split_results_.size());
+      range.size = groups.size;
+      range.max = groups.max;
+      for (int i = groups.begin; i < groups.begin + groups.size; ++i) {
+        int new_or_id = ArmorGroupOr(or_id, i);
+        split_results_.emplace_back(new_or_id, armor_groups_[i].points);
+      }
+      Slot(&armor_split_memo_, multiplier, or_id, SplitRange()) = range;
+      return range;
     }
 
-
     void SplitAnd(int and_id, int sub_min, 
                   PointsIdListMap *new_ands, int multiplier) {
-      PointsIdListMap split_armors;
       const AND &node = pool_->And(and_id);
-      int left_max = SplitArmorOr(node.left, &split_armors, multiplier);
-      std::vector<TempOr> split_right;
-      const OR &right_node = pool_->Or(node.right);
-      int right_max = (ANDS == right_node.tag) ?
-        SplitOr(node.right, sub_min - left_max,
-                &split_right, multiplier) :
-        SplitArmorOr(node.right, &split_right, 
-                     sub_min - left_max, multiplier);
-
-      // Note(breakds), node may already have been invalid as the
-      // above code may trigger reallocation of vector in pool_.
-      
-      Signature left_key = pool_->Or(pool_->And(and_id).left).key;
-      for (auto &left_item : split_armors) {
-        if (right_max + left_item.first >= sub_min) {
-          int left_or_id = 
-            pool_->MakeOR<ARMORS>(sig::AddPoints(left_key,
-                                                 effect_id_,
-                                                 left_item.first),
-                                  &left_item.second);
-          for (auto &right_item : split_right) {
-            int points = left_item.first + right_item.points;
+      int left_id = node.left;
+      int right_id = node.right;
+      SplitRange left = GroupArmorOr(left_id, multiplier);
+      SplitRange right = (ANDS == pool_->Or(right_id).tag) ?
+        SplitOr(right_id, sub_min - left.max, multiplier) :
+        SplitArmorOr(right_id, multiplier);
+
+      for (int i = left.begin; i < left.begin + left.size; ++i) {
+        int left_points = armor_groups_[i].points;
+        if (right.max + left_points >= sub_min) {
+          int left_or_id = ArmorGroupOr(left_id, i);
+          for (int j = right.begin; j < right.begin + right.size; ++j) {
+            const TempOr &right_item = split_results_[j];
+            int points = left_points + right_item.points;
             if (points >= sub_min) {
               int new_and_id = pool_->MakeAnd(left_or_id,
                                               right_item.id);
-              auto it = new_ands->find(points);
-              if (new_ands->end() != it) {
-                it->second.push_back(new_and_id);
-              } else {
-                (*new_ands)[points] = {new_and_id};
-              }
+              (*new_ands)[points].push_back(new_and_id);
             }
           }
         }
       }
     }
 
-    int SplitOr(int or_id, int sub_min, 
-                std::vector<TempOr> *result, int multiplier) {
+    SplitRange SplitOr(int or_id, int sub_min, int multiplier) {
+      int &head = Slot(&split_heads_, 0, or_id, -1);
+      for (int entry = head; -1 != entry; 
+           entry = split_entries_[entry].next) {
+        if (split_entries_[entry].sub_min == sub_min &&
+            split_entries_[entry].multiplier == multiplier) {
+          return split_entries_[entry].range;
+        }
+      }
+
       PointsIdListMap new_ands;
       for (int and_id : pool_->Or(or_id).daughters) {
         SplitAnd(and_id, sub_min, &new_ands, multiplier);
       }
 
-      int result_max = -1000;
+      SplitRange range;
+      range.begin = static_cast<int>(split_results_.size());
+      range.size = static_cast<int>(new_ands.size());
       if (!new_ands.empty()) {
-        Signature key = pool_->Or(or_id).key;
+        Key key = pool_->Or(or_id).key;
         for (auto &item : new_ands) {
-          result->emplace_back(pool_->MakeOR<ANDS>(sig::AddPoints(key,
-                                                                  effect_id_,
-                                                                  item.first),
-                                                   &item.second),
-                               item.first);
-          if (item.first > result_max) {
-            result_max = item.first;
+          split_results_.emplace_back(pool_->template MakeOR<ANDS>(sig::AddPoints(key,
+                                                                         effect_id_,
+                                                                         item.first),
+                                                          &item.second),
+                                      item.first);
+          if (item.first > range.max) {
+            range.max = item.first;
           }
         }
       }
-      return result_max;
-    }
 
+      // The head may have moved while recursing.
+      int &new_head = Slot(&split_heads_, 0, or_id, -1);
+      split_entries_.emplace_back(sub_min, multiplier, range, new_head);
+      new_head = static_cast<int>(split_entries_.size()) - 1;
+      return range;
+    }
     
-    
-    NodePool *pool_;
+    NodePool<Key> *pool_;
     std::vector<int> armor_points_;
     std::vector<bool> is_body_;
     int effect_id_;
+
+    // Memo tables, indexed by [multiplier][or_id].
+    std::vector<std::vector<int> > max_memo_;
+    std::vector<std::vector<SplitRange> > group_memo_;
+    std::vector<std::vector<SplitRange> > armor_split_memo_;
+    // Heads of the SplitEntry chains, indexed by [0][or_id].
+    std::vector<std::vector<int> > split_heads_;
+    std::vector<SplitEntry> split_entries_;
+    std::vector<ArmorGroup> armor_groups_;
+    std::vector<TempOr> split_results_;
   };
   
 }  // namespace monster_avengers
@@ -0,0 +1,124 @@
+#ifndef _MONSTER_AVENGERS_POINTS_BOUND_
+#define _MONSTER_AVENGERS_POINTS_BOUND_
+
+#include <algorithm>
+#include <vector>
+
+#include "data/data_set.h"
+#include "utils/query.h"
+#include "utils/signature.h"
+
+namespace monster_avengers {
+
+  // PointsBound holds upper bounds of the points that a list of
+  // skills can get from the jewels and from each armor part, under
+  // the armor and jewel filters of a query. Negative points of the
+  // jewels are ignored, so that the bounds are never below what a
+  // real armor set can reach.
+  class PointsBound {
+  public:
+    PointsBound(const DataSet &data,
+                const Query &query,
+                const std::vector<int> &skill_ids)
+      : size_(static_cast<int>(skill_ids.size())),
+        jewels_(4, std::vector<int>(skill_ids.size(), 0)),
+        parts_(PART_NUM, std::vector<int>(skill_ids.size(), 0)),
+        torso_up_(PART_NUM, false) {
+      std::vector<int> index(data.skill_systems().size(), -1);
+      for (int i = 0; i < size_; ++i) {
+        index[skill_ids[i]] = i;
+      }
+
+      // Best single jewel for each number of holes.
+      std::vector<std::vector<int> > single(
+          4, std::vector<int>(size_, 0));
+      for (int id = 0; id < data.jewels().size(); ++id) {
+        if (!query.jewel_filter.Validate(data, id)) continue;
+        const Jewel &jewel = data.jewel(id);
+        if (jewel.holes < 1 || jewel.holes > 3) continue;
+        for (const Effect &effect : jewel.effects) {
+          int i = index[effect.skill_id];
+          if (-1 != i) {
+            single[jewel.holes][i] = (std::max)(single[jewel.holes][i],
+                                                effect.points);
+          }
+        }
+      }
+      for (int holes = 1; holes <= 3; ++holes) {
+        for (int first = 1; first <= holes; ++first) {
+          for (int i = 0; i < size_; ++i) {
+            jewels_[holes][i] = (std::max)(jewels_[holes][i],
+                                           single[first][i] +
+                                           jewels_[holes - first][i]);
+          }
+        }
+      }
+
+      std::vector<int> points(size_);
+      for (int part = HEAD; part < PART_NUM; ++part) {
+        for (int id : data.ArmorIds(static_cast<ArmorPart>(part))) {
+          if (!query.armor_filter.Validate(data, id)) continue;
+          const Armor &armor = data.armor(id);
+          if (armor.TorsoUp()) {
+            torso_up_[part] = true;
+            continue;
+          }
+          points = jewels_[(std::min)((std::max)(armor.holes, 0), 3)];
+          for (const Effect &effect : armor.effects) {
+            int i = index[effect.skill_id];
+            if (-1 != i) points[i] += effect.points;
+          }
+          for (int i = 0; i < size_; ++i) {
+            parts_[part][i] = (std::max)(parts_[part][i], points[i]);
+          }
+        }
+      }
+    }
+
+    inline int size() const {
+      return size_;
+    }
+
+    // Most points of the i-th skill from the jewels in the holes of
+    // a single armor.
+    inline int Jewels(int holes, int i) const {
+      return jewels_[holes][i];
+    }
+
+    // Most points of the i-th skill from an armor of the part, with
+    // the best jewels in its holes. The torso multiplier is not
+    // applied to the body.
+    inline int Part(int part, int i) const {
+      return parts_[part][i];
+    }
+
+    // Whether the part has a torso up armor.
+    inline bool TorsoUp(int part) const {
+      return torso_up_[part];
+    }
+
+    // Most points of the i-th skill from the jewels in the holes of
+    // key, including the (multiplied) body holes.
+    template <typename Key>
+    inline int KeyJewels(const Key &key, int i) const {
+      int one(0), two(0), three(0);
+      sig::KeyHoles(key, &one, &two, &three);
+      int result = one * jewels_[1][i] + two * jewels_[2][i] +
+        three * jewels_[3][i];
+      int body_holes = key.BodyHoleSum();
+      if (body_holes > 0) {
+        result += jewels_[(std::min)(body_holes, 3)][i] * key.multiplier();
+      }
+      return result;
+    }
+
+  private:
+    int size_;
+    std::vector<std::vector<int> > jewels_;
+    std::vector<std::vector<int> > parts_;
+    std::vector<bool> torso_up_;
+  };
+
+}  // namespace monster_avengers
+
+#endif  // _MONSTER_AVENGERS_POINTS_BOUND_
@@ -6,6 +6,7 @@
 #include <string>
 #include <cstdio>
 #include <map>
+#include <memory>
 #include <unordered_map>
 
 #include "language_text.h"
@@ -19,49 +20,67 @@
 
 namespace monster_avengers {
   
+  // The loaded skill systems, jewels, items and armors are immutable
+  // and shared (not copied) among copies of a DataSet. Copying a
+  // DataSet is therefore cheap, and each copy can carry its own
+  // extra armors (e.g. the custom amulets of a query) without
+  // affecting the others.
   class DataSet {
   public:
     int torso_up_id;
     
     DataSet(const std::string &descriptor) 
       : skill_systems_(), jewels_(), armors_(),
-        armor_indices_by_parts_() {
+        extra_armors_(), armor_indices_by_parts_() {
       DataLoader loader;
       loader.Initialize(descriptor);
 
       // ---------- Skills ----------
       // TROSO UP is alwasy the skill system with id 0.
       torso_up_id = 0; 
-      skill_systems_ = loader.Get()->LoadSkillSystems();
+      skill_systems_ = std::make_shared<const std::vector<SkillSystem> >(
+          loader.Get()->LoadSkillSystems());
       
       // ---------- Jewels ----------
-      jewels_ = loader.Get()->LoadJewels();
+      jewels_ = std::make_shared<const std::vector<Jewel> >(
+          loader.Get()->LoadJewels());
       
       // ---------- Items ----------
-      items_ = loader.Get()->LoadItems();
+      items_ = std::make_shared<const std::vector<Item> >(
+          loader.Get()->LoadItems());
 
 
       // ---------- Armors ----------
       {
-        armors_ = loader.Get()->LoadArmors();
+        std::vector<Armor> armors = loader.Get()->LoadArmors();
         // Add the dummy amulet.
-        armors_.push_back(Armor::Amulet(0, {}));
+        armors.push_back(Armor::Amulet(0, {}));
         // Initialize armor_indices_by_parts_
         armor_indices_by_parts_.resize(PART_NUM);
         int i = 0;
-        for (const Armor &armor : armors_) {
+        for (const Armor &armor : armors) {
           armor_indices_by_parts_[armor.part].push_back(i++);
         }
-        reserved_armor_count_ = static_cast<int>(armors_.size());
+        reserved_armor_count_ = static_cast<int>(armors.size());
+        armors_ = std::make_shared<const std::vector<Armor> >(
+            std::move(armors));
       }
     }
 
+    DataSet(const DataSet &other) = default;
+
     inline const std::vector<Jewel> &jewels() const {
+      return *jewels_;
+    }
+
+    // The jewel list is shared by all the copies of the data set.
+    inline const std::shared_ptr<const std::vector<Jewel> > &
+    shared_jewels() const {
       return jewels_;
     }
 
     inline const Jewel &jewel(int id) const {
-      return jewels_[id];
+      return (*jewels_)[id];
     }
 
     inline const std::vector<int> &ArmorIds(ArmorPart part) const {
@@ -69,62 +88,67 @@ namespace monster_avengers {
     }
 
     inline const Armor &armor(int id) const {
-      return armors_[id];
+      return id < reserved_armor_count_ ? (*armors_)[id] :
+        extra_armors_[id - reserved_armor_count_];
+    }
+
+    // Number of armors, including the extra armors.
+    inline int ArmorCount() const {
+      return reserved_armor_count_ + static_cast<int>(extra_armors_.size());
     }
 
     inline const LanguageText &ItemName(int id) const {
-      return items_[id].name;
+      return (*items_)[id].name;
     }
 
     inline const Armor &armor(ArmorPart part, int id) const {
-      return armors_[armor_indices_by_parts_[part][id]];
+      return armor(armor_indices_by_parts_[part][id]);
     }
 
     inline bool ProvidesTorsoUp(ArmorPart part, int id) const {
-      const Armor &armor = armors_[armor_indices_by_parts_[part][id]];
+      const Armor &armor = this->armor(part, id);
       return  1 == armor.effects.size() &&
         armor.effects[0].skill_id == torso_up_id;
     }
 
     inline bool ProvidesTorsoUp(int id) const {
-      const Armor &armor = armors_[id];
+      const Armor &armor = this->armor(id);
       return  1 == armor.effects.size() &&
         armor.effects[0].skill_id == torso_up_id;
     }
 
-    inline const std::vector<Armor> &armors() const {
-      return armors_;
-    }
-
     inline const SkillSystem &skill_system(int id) const {
-      return skill_systems_[id];
+      return (*skill_systems_)[id];
     }
 
     inline const std::vector<SkillSystem> &skill_systems() const {
-      return skill_systems_;
+      return *skill_systems_;
     }
 
     inline void AddExtraArmor(ArmorPart part, const Armor &armor) {
-      armor_indices_by_parts_[part].push_back(armors_.size());
-      armors_.push_back(armor);
+      armor_indices_by_parts_[part].push_back(ArmorCount());
+      extra_armors_.push_back(armor);
     }
 
     inline void ClearExtraArmor() {
-      while (armors_.size() > reserved_armor_count_) {
-        armors_.pop_back();
+      extra_armors_.clear();
+      for (std::vector<int> &indices : armor_indices_by_parts_) {
+        while (!indices.empty() && indices.back() >= reserved_armor_count_) {
+          indices.pop_back();
+        }
       }
     }
 
-    void PrintSkillSystems() {
-      for (int i = 0; i < skill_systems_.size(); ++i) {
-        wprintf(L"%d: %ls\n", i, skill_systems_[i].name.c_str());
+    void PrintSkillSystems() const {
+      for (int i = 0; i < skill_systems_->size(); ++i) {
+        wprintf(L"%d: %ls\n", i, skill_system(i).name.c_str());
       }
     }
 
-    double EffectScore(const Effect &effect) {
+    double EffectScore(const Effect &effect) const {
       int armor_count = 0;
       for (int i = 0; i < reserved_armor_count_; ++i) {
-        for (const Effect &armor_effect : armors_[i].effects) {
+        for (const Effect &armor_effect : (*armors_)[i].effects) {
           if (armor_effect.skill_id == effect.skill_id) {
             armor_count++;
             break;
@@ -133,7 +157,7 @@ namespace monster_avengers {
       }
 
       double jewel_index = 0;
-      for (const Jewel &jewel : jewels_) {
+      for (const Jewel &jewel : *jewels_) {
         for (const Effect &jewel_effect : jewel.effects) {
           if (jewel_effect.skill_id == effect.skill_id) {
             jewel_index += 
@@ -148,10 +172,10 @@ namespace monster_avengers {
         * armor_count;
     }
 
-    void Summarize() {
-      Log(INFO, L"Skill Systems: %lld", skill_systems_.size());
-      Log(INFO, L"Jewels: %lld", jewels_.size());
-      Log(INFO, L"Armors: %lld", armors_.size());
+    void Summarize() const {
+      Log(INFO, L"Skill Systems: %lld", skill_systems_->size());
+      Log(INFO, L"Jewels: %lld", jewels_->size());
+      Log(INFO, L"Armors: %d", ArmorCount());
       Log(INFO, L" - HELMS: %lld", armor_indices_by_parts_[HEAD].size());
       Log(INFO, L" - CUIRASSES: %lld", armor_indices_by_parts_[BODY].size());
       Log(INFO, L" - GLOVES: %lld", armor_indices_by_parts_[HANDS].size());
@@ -162,10 +186,11 @@ namespace monster_avengers {
     }
     
   private:
-    std::vector<SkillSystem> skill_systems_;
-    std::vector<Jewel> jewels_;
-    std::vector<Item> items_;
-    std::vector<Armor> armors_;
+    std::shared_ptr<const std::vector<SkillSystem> > skill_systems_;
+    std::shared_ptr<const std::vector<Jewel> > jewels_;
+    std::shared_ptr<const std::vector<Item> > items_;
+    std::shared_ptr<const std::vector<Armor> > armors_;
+    std::vector<Armor> extra_armors_;
     int reserved_armor_count_;
     std::vector<std::vector<int> > armor_indices_by_parts_;
   };
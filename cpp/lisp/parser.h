@@ -208,7 +208,8 @@ namespace monster_avengers {
         if (L':' == buffer_) {
           result->name = KEYWORD;
           result->value = L"";
-          while (!IsSpace(GetChar())) {
+          // A keyword can end a list, as in (:explain).
+          while (!IsSpace(GetChar()) && L')' != buffer_) {
             result->value += buffer_;
           }
           return true;
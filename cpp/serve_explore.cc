@@ -17,7 +17,12 @@ int main(int argc, char **argv) {
     CHECK_SUCCESS(Query::ParseFile(argv[2], &query));
     Timer timer;
     timer.Tic();
-    armor_up.Explore(query, argv[3]);
+    int threads = (argc >= 5) ? std::stoi(argv[4]) : 0;
+    ExploreMode mode = 
+      (argc >= 6 && std::string("incremental") == argv[5]) ?
+      EXPLORE_INCREMENTAL : EXPLORE_FULL;
+    bool measure_savings = argc >= 7 && std::string("savings") == argv[6];
+    armor_up.Explore(query, argv[3], threads, mode, measure_savings);
     double duration = timer.Toc();
     wprintf(L"Computation: %.4lf seconds.\n", duration);
   }
@@ -1,3 +1,5 @@
+#include <fstream>
+
 #include "data/data_set.h"
 #include "utils/query.h"
 #include "core/armor_up.h"
@@ -8,13 +10,25 @@ using namespace monster_avengers;
 int main(int argc, char **argv) {
   std::setlocale(LC_ALL, "en_US.UTF-8");
   CHECK(2 <= argc);
-  ArmorUp armor_up(argv[1]);
+  // The optional 4th argument is the number of threads building the
+  // foundation, one per hardware thread by default.
+  int threads = (argc >= 5) ? std::stoi(argv[4]) : 0;
+  ArmorUp armor_up(argv[1], threads);
   if (argc < 4) {
     armor_up.ListSkills();
   } else {
     Query query;
     CHECK_SUCCESS(Query::ParseFile(argv[2], &query));
-    armor_up.Search<LISP>(query, argv[3]);
+    if (query.explain) {
+      std::wofstream output(argv[3]);
+      output.imbue(LOCALE_UTF8);
+      output << armor_up.Explain(query) << L"\n";
+    } else if (query.count) {
+      std::ofstream output(argv[3]);
+      output << SetCountString(armor_up.Count(query)) << "\n";
+    } else {
+      armor_up.Search<LISP>(query, argv[3]);
+    }
   }
   return 0;
 }
@@ -1,65 +1,273 @@
 #include <memory>
+#include <string>
+#include <thread>
 
 #include "micro_http_server.h"
 #include "daemon.h"
+#include "response_cache.h"
 #include "supp/helpers.h"
 #include "core/armor_up.h"
 
 using micro_http_server::Daemon;
 using micro_http_server::PostHandler;
+using micro_http_server::ResponseCache;
+using micro_http_server::ResponseCacheStats;
+using micro_http_server::ResponseStream;
 using micro_http_server::SimplePostServer;
 
 std::unique_ptr<ArmorUp> armor_up;
 
+// The time budget of a request in milliseconds, 0 for no limit. A
+// request can ask for a shorter one with its budget_ms field.
+int max_budget_ms = 0;
+
+// The complete responses of the recent queries, keyed by
+// Query::Fingerprint().
+ResponseCache response_cache;
+
 
 class SpecialPostHandler : public PostHandler{
 public:
+  SpecialPostHandler() : query_cache_(), budget_ms_(0) {}
     
   int ProcessKeyValue(const std::string &key, 
 		      const std::string &value) override {
     if (key == "query") {
       query_cache_ = value;
-      return MHD_NO;
+    } else if (key == "budget_ms") {
+      try {
+        budget_ms_ = std::stoi(value);
+      } catch (std::exception&) {
+        budget_ms_ = 0;
+      }
     }
     return MHD_YES;
   }
 
-  std::string GenerateResponse() override {
-    std::string content;
-    try {
-      std::wstring query_text;
-      query_text.assign(query_cache_.begin(), query_cache_.end());
-      Query query;
-      if (!Query::Parse(query_text, &query).Success()) {
-        throw 0;
+  // The armor sets are written to the stream one at a time. Partial
+  // results are flagged with a trailer, as the headers are already
+  // sent by then. Complete responses are kept in response_cache and
+  // shared with the identical queries in flight, which leave their
+  // worker to wait for it. A waiter that cannot get a worker back
+  // gets the busy message with an X-Armor-Up-Error trailer, as its
+  // status is already sent.
+  bool GenerateResponse(
+      const std::shared_ptr<ResponseStream> &stream) override {
+    MetricsRegistry &registry = MetricsRegistry::Global();
+    static Counter *requests = registry.GetCounter(
+        "armor_up_requests_total", "Queries received.");
+    static Counter *parse_errors = registry.GetCounter(
+        "armor_up_parse_errors_total", "Queries that failed to parse.");
+    static Histogram *parse_seconds = registry.GetHistogram(
+        "armor_up_parse_seconds", "Time parsing a query.",
+        Histogram::SecondBuckets());
+    static Counter *cache_hits = registry.GetCounter(
+        "armor_up_response_cache_total", 
+        "Queries by whether the response cache answered them.",
+        "result=\"hit\"");
+    static Counter *cache_misses = registry.GetCounter(
+        "armor_up_response_cache_total", 
+        "Queries by whether the response cache answered them.",
+        "result=\"miss\"");
+    static Counter *cache_collapsed = registry.GetCounter(
+        "armor_up_response_cache_total", 
+        "Queries by whether the response cache answered them.",
+        "result=\"collapsed\"");
+
+    requests->Add();
+    std::wstring query_text;
+    query_text.assign(query_cache_.begin(), query_cache_.end());
+    Query query;
+    Status status(SUCCESS);
+    double parse_time = 0.0;
+    {
+      ScopedTimer timer(&parse_time);
+      status = Query::Parse(query_text, &query);
+    }
+    parse_seconds->Observe(parse_time);
+    if (!status.Success()) {
+      parse_errors->Add();
+      stream->Write("\"Query Format Error!\"");
+      return true;
+    }
+    int budget_ms = max_budget_ms;
+    if (0 < budget_ms_ && (0 == budget_ms || budget_ms_ < budget_ms)) {
+      budget_ms = budget_ms_;
+    }
+    if (query.explain) {
+      // Not cached, as the plan carries the timing of this very run.
+      std::shared_ptr<Deadline> deadline(
+          0 < budget_ms ? new Deadline(budget_ms) : new Deadline());
+      stream->SetDeadline(deadline);
+      std::wstring plan = armor_up->Explain(query, nullptr, deadline.get());
+      stream->Write(std::string(plan.begin(), plan.end()));
+      return true;
+    }
+    uint64_t fingerprint = query.Fingerprint();
+    std::string body;
+    ResponseCache::Outcome outcome = response_cache.Acquire(
+        fingerprint, &body, [stream](bool shared, const std::string &body) {
+          if (shared) {
+            stream->Complete(body);
+          } else if (!ResponseStream::Resubmit(stream)) {
+            stream->AddTrailer("X-Armor-Up-Error", "503");
+            stream->Complete(micro_http_server::ERROR_BUSY_MESSAGE);
+          }
+        });
+    if (ResponseCache::CACHED == outcome) {
+      cache_hits->Add();
+      stream->Write(body);
+      Log(INFO, L"Query %016llx answered from the response cache.",
+          static_cast<unsigned long long>(fingerprint));
+      LogCacheStats();
+      return true;
+    }
+    if (ResponseCache::COLLAPSED == outcome) {
+      cache_collapsed->Add();
+      Log(INFO, L"Query %016llx waits for an identical query in flight.",
+          static_cast<unsigned long long>(fingerprint));
+      return false;
+    }
+    cache_misses->Add();
+    // Also cancelled if the client goes away.
+    std::shared_ptr<Deadline> deadline(
+        0 < budget_ms ? new Deadline(budget_ms) : new Deadline());
+    stream->SetDeadline(deadline);
+    SessionStats stats;
+    // A copy of the body is kept for the cache as long as it fits.
+    size_t max_cached_bytes = response_cache.MaxBytes();
+    bool cacheable = true;
+    // A failed write means that the client went away and the search
+    // stopped, leaving the body unfinished, even if the deadline was
+    // not checked since.
+    bool complete = true;
+    auto write = [stream, &body, &cacheable, &complete, max_cached_bytes](
+        const std::string &content) {
+      if (cacheable) {
+        if (body.size() + content.size() <= max_cached_bytes) {
+          body += content;
+        } else {
+          cacheable = false;
+          body.clear();
+        }
       }
-      std::wstring answer = std::move(armor_up->SearchSerialized(query));
-      content.assign(answer.begin(), answer.end());
-    } catch (int e) {
-      content = "\"Query Format Error!\"";
+      if (!stream->Write(content)) complete = false;
+      return complete;
+    };
+    if (query.count) {
+      // The count is a string, as it can exceed the precision of a
+      // JSON number.
+      std::string count = SetCountString(
+          armor_up->Count(query, &stats, deadline.get()));
+      write("{\"count\":\"" + count + "\"}");
+    } else {
+      std::string content;
+      armor_up->SearchStreamed(query, [&write, &content](
+          const std::wstring &chunk) {
+          content.assign(chunk.begin(), chunk.end());
+          return write(content);
+        }, &stats, deadline.get());
+    }
+    response_cache.Finish(fingerprint, body, 
+                          cacheable && complete && !stats.truncated);
+    if (stats.truncated) {
+      stream->AddTrailer("X-Armor-Up-Truncated", "true");
+      Log(WARNING, L"Query truncated after %d ms.", budget_ms);
     }
-    return content;
+    Log(INFO, L"Query: %lld OR, %lld AND, query peak %lld KB (arena), "
+        L"process RSS %ld KB (peak since start %ld KB), "
+        L"first result after %.4lf sec.",
+        stats.or_nodes, stats.and_nodes, stats.arena_peak_bytes >> 10,
+        stats.rss_kb, stats.process_peak_rss_kb, 
+        stats.first_result_seconds);
+    LogCacheStats();
+    return true;
+  }
+
+  static void LogCacheStats() {
+    HoleCacheStats hole_stats = HoleTableCache::Global().Stats();
+    Log(INFO, L"Hole tables: %lld hits, %lld misses, %lld evictions, "
+        L"%lld cached (%lld KB).",
+        hole_stats.hits, hole_stats.misses, hole_stats.evictions,
+        static_cast<int64_t>(hole_stats.size),
+        static_cast<int64_t>(hole_stats.bytes >> 10));
+    ResponseCacheStats response_stats = response_cache.Stats();
+    int64_t requests = response_stats.hits + response_stats.collapsed +
+      response_stats.misses;
+    Log(INFO, L"Responses: %lld hits, %lld collapsed, %lld misses "
+        L"(hit rate %.1lf%%), %lld evictions, %lld cached (%lld KB).",
+        response_stats.hits, response_stats.collapsed,
+        response_stats.misses,
+        0 < requests ? 100.0 * (response_stats.hits + 
+                                response_stats.collapsed) / requests : 0.0,
+        response_stats.evictions,
+        static_cast<int64_t>(response_stats.size),
+        static_cast<int64_t>(response_stats.bytes >> 10));
   }
 
   std::string query_cache_;
+  int budget_ms_;
 };
 
 
+namespace {
+  // Reads an option of the form --name=value, returns false if arg
+  // is not the option.
+  bool ReadIntFlag(const std::string &arg, const std::string &name, 
+                   int *value) {
+    std::string prefix = "--" + name + "=";
+    if (0 != arg.compare(0, prefix.size(), prefix)) return false;
+    try {
+      *value = std::stoi(arg.substr(prefix.size()));
+    } catch (std::exception&) {
+      Log(FATAL, L"Invalid value for --%s.", name.c_str());
+      _exit(-1);
+    }
+    return true;
+  }
+}  // namespace
+
 int main(int argc, char **argv) {
   if (argc < 2) {
-    Log(FATAL, L"Please call the command as: armor_up_server [dataset folder] [port]");
+    Log(FATAL, L"Please call the command as: armor_up_server [dataset folder] [port]"
+        L" [--threads=N] [--queue-size=N] [--hole-cache-mb=N]"
+        L" [--budget-ms=N] [--response-cache-mb=N]");
   }
 
   int port = 8887;
-  
-  if (argc >= 3) {
+  int threads = std::thread::hardware_concurrency();
+  int queue_size = micro_http_server::DEFAULT_QUEUE_SIZE;
+  int hole_cache_mb = 
+    static_cast<int>(HoleTableCache::DEFAULT_MAX_BYTES >> 20);
+  int response_cache_mb = 
+    static_cast<int>(ResponseCache::DEFAULT_MAX_BYTES >> 20);
+  if (threads < 1) threads = 1;
+
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (ReadIntFlag(arg, "threads", &threads) ||
+        ReadIntFlag(arg, "queue-size", &queue_size) ||
+        ReadIntFlag(arg, "hole-cache-mb", &hole_cache_mb) ||
+        ReadIntFlag(arg, "budget-ms", &max_budget_ms) ||
+        ReadIntFlag(arg, "response-cache-mb", &response_cache_mb)) {
+      continue;
+    }
     try {
-      port = std::stoi(argv[2]);
-    } catch (std::invalid_argument&) {
-      Log(FATAL, L"Invalid port %s.", argv[2]);
+      port = std::stoi(arg);
+    } catch (std::exception&) {
+      Log(FATAL, L"Invalid port %s.", argv[i]);
       _exit(-1);
     }
   }
+
+  if (threads < 1) {
+    Log(FATAL, L"--threads should be positive, got %d.", threads);
+    _exit(-1);
+  }
+  if (queue_size < 1) {
+    Log(FATAL, L"--queue-size should be positive, got %d.", queue_size);
+    _exit(-1);
+  }
   
   Log(INFO, L"Starting Server.");
 
@@ -69,11 +277,17 @@ int main(int argc, char **argv) {
   Log(INFO, L"Server Started.");
 
   // Initialize the armor up engine.
+  HoleTableCache::Global().SetMaxBytes(
+      static_cast<size_t>((std::max)(hole_cache_mb, 0)) << 20);
+  response_cache.SetMaxBytes(
+      static_cast<size_t>((std::max)(response_cache_mb, 0)) << 20);
   armor_up.reset(new ArmorUp(argv[1]));
 
   Log(INFO, L"armor up!");
 
-  SimplePostServer<SpecialPostHandler> server(port);
+  SimplePostServer<SpecialPostHandler> server(port, threads, queue_size);
+
+  Log(INFO, L"Serving on port %d with %d search threads.", port, threads);
 
   while (true) {
     sleep(10);
@@ -9,9 +9,20 @@
 #include <cwchar>
 #include <cstdio>
 #include <microhttpd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <type_traits>
+#include <utility>
+#include <vector>
+#include "supp/deadline.h"
 #include "supp/helpers.h"
+#include "supp/metrics.h"
+#include "supp/thread_pool.h"
 
 using namespace monster_avengers;
 
@@ -19,6 +30,180 @@ namespace micro_http_server {
 
   const int MAX_POST_DATA_SIZE = 2048;
 
+  // Default number of requests waiting for a worker. Requests beyond
+  // it are answered with 503 right away.
+  const int DEFAULT_QUEUE_SIZE = 64;
+
+  // Size of the blocks in which a streamed body is sent.
+  const size_t STREAM_BLOCK_SIZE = 32 << 10;
+
+  // A worker writing a streamed body waits once this many bytes are
+  // not sent yet, so that a slow client does not pile the whole body
+  // up in memory.
+  const size_t MAX_PENDING_BYTES = 1 << 20;
+
+  // ResponseStream carries a chunked response body from the worker
+  // writing it to the server thread sending it. The connection is
+  // suspended while there is nothing to send, and resumed by the next
+  // Write() or Close(). If the client goes away, Write() returns false
+  // and the registered Deadline (if any) is cancelled, so that the
+  // worker can stop early.
+  //
+  // A handler can also leave the stream open when its worker is done,
+  // and complete it later from another thread (see Complete()), or
+  // have the response generated again on a worker (see Resubmit()).
+  class ResponseStream {
+  public:
+    // Submits the generation of the response of a stream to a
+    // worker, returns false if no worker can take it.
+    typedef std::function<bool(const std::shared_ptr<ResponseStream>&)> 
+    Submitter;
+
+    explicit ResponseStream(MHD_Connection *connection)
+      : connection_(connection), response_(nullptr), submitter_(), mutex_(),
+        drained_(), chunks_(), offset_(0), pending_bytes_(0),
+        trailers_(), deadline_(), suspended_(false),
+        closed_(false), abandoned_(false) {}
+
+    // ----- Worker side -----
+
+    // Returns false if the client has gone away.
+    bool Write(const std::string &data) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      drained_.wait(lock, [this]() {
+          return abandoned_ || pending_bytes_ < MAX_PENDING_BYTES;
+        });
+      if (abandoned_) return false;
+      if (data.empty()) return true;
+      chunks_.push_back(data);
+      pending_bytes_ += data.size();
+      WakeUp();
+      return true;
+    }
+
+    // Sent as a trailer after the body.
+    void AddTrailer(const std::string &name, const std::string &value) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      trailers_.emplace_back(name, value);
+    }
+
+    // The deadline is cancelled if the client goes away before
+    // Close(). The stream shares it, as the client can go away after
+    // the worker is done with it.
+    void SetDeadline(const std::shared_ptr<Deadline> &deadline) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      deadline_ = deadline;
+    }
+
+    void Close() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+      deadline_.reset();
+      WakeUp();
+    }
+
+    // Writes data and closes the stream, without waiting for the
+    // client to catch up. For a body that is already in memory.
+    void Complete(const std::string &data) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!abandoned_ && !data.empty()) {
+        chunks_.push_back(data);
+        pending_bytes_ += data.size();
+      }
+      closed_ = true;
+      deadline_.reset();
+      WakeUp();
+    }
+
+    // Generates the response of stream again on a worker. Returns
+    // false if no worker can take it, the stream is then left to the
+    // caller.
+    static bool Resubmit(const std::shared_ptr<ResponseStream> &stream) {
+      return stream->submitter_(stream);
+    }
+
+    // ----- Server side -----
+
+    inline void SetResponse(MHD_Response *response) {
+      response_ = response;
+    }
+
+    inline void SetSubmitter(Submitter submitter) {
+      submitter_ = std::move(submitter);
+    }
+
+    // MHD_ContentReaderCallback, cls is a std::shared_ptr<ResponseStream>.
+    static ssize_t Read(void *cls, uint64_t pos, char *buffer, size_t max) {
+      ResponseStream *stream = 
+        static_cast<std::shared_ptr<ResponseStream>*>(cls)->get();
+      std::lock_guard<std::mutex> lock(stream->mutex_);
+      if (!stream->chunks_.empty()) {
+        const std::string &chunk = stream->chunks_.front();
+        size_t size = (std::min)(max, chunk.size() - stream->offset_);
+        memcpy(buffer, chunk.data() + stream->offset_, size);
+        stream->offset_ += size;
+        stream->pending_bytes_ -= size;
+        if (stream->offset_ == chunk.size()) {
+          stream->chunks_.pop_front();
+          stream->offset_ = 0;
+        }
+        stream->drained_.notify_all();
+        return static_cast<ssize_t>(size);
+      }
+      if (stream->closed_) {
+        for (const auto &trailer : stream->trailers_) {
+          MHD_add_response_footer(stream->response_, trailer.first.c_str(),
+                                  trailer.second.c_str());
+        }
+        return MHD_CONTENT_READER_END_OF_STREAM;
+      }
+      stream->suspended_ = true;
+      MHD_suspend_connection(stream->connection_);
+      return 0;
+    }
+
+    // MHD_ContentReaderFreeCallback, called once MHD is done with the
+    // response, whether the body was sent completely or not.
+    static void Free(void *cls) {
+      std::shared_ptr<ResponseStream> *holder = 
+        static_cast<std::shared_ptr<ResponseStream>*>(cls);
+      {
+        ResponseStream *stream = holder->get();
+        std::lock_guard<std::mutex> lock(stream->mutex_);
+        stream->abandoned_ = true;
+        if (stream->deadline_) stream->deadline_->Cancel();
+        stream->drained_.notify_all();
+      }
+      delete holder;
+    }
+
+  private:
+    // Called with mutex_ held. A connection is never resumed after it
+    // is abandoned, as MHD only releases the response of a connection
+    // that is not suspended.
+    inline void WakeUp() {
+      if (suspended_) {
+        suspended_ = false;
+        MHD_resume_connection(connection_);
+      }
+    }
+
+    MHD_Connection *connection_;
+    MHD_Response *response_;
+    Submitter submitter_;
+    std::mutex mutex_;
+    std::condition_variable drained_;
+    std::deque<std::string> chunks_;
+    // Bytes of chunks_.front() already sent.
+    size_t offset_;
+    size_t pending_bytes_;
+    std::vector<std::pair<std::string, std::string> > trailers_;
+    std::shared_ptr<Deadline> deadline_;
+    bool suspended_;
+    bool closed_;
+    bool abandoned_;
+  };
+
   
   namespace {
 
@@ -35,72 +220,104 @@ namespace micro_http_server {
       return info->handler->ProcessKeyValue(key, data);
     }
 
-    int SendResponse(MHD_Connection *connection, char *content) {
+    int SendResponse(MHD_Connection *connection, char *content,
+                     unsigned int status_code = MHD_HTTP_OK) {
       MHD_Response *response = 
         MHD_create_response_from_buffer(strlen(content),
         				static_cast<void*>(content),
         				MHD_RESPMEM_PERSISTENT);
       MHD_add_response_header(response, "Content-Type", "application/json");
       MHD_add_response_header(response, "Connection", "Keep-Alive");
+      int ret = MHD_queue_response(connection, status_code, response);
+      MHD_destroy_response(response);
+      return ret;
+    }
+
+    // The metrics of MetricsRegistry::Global(), in the Prometheus text
+    // format.
+    int SendMetrics(MHD_Connection *connection) {
+      std::string content = MetricsRegistry::Global().Render();
+      MHD_Response *response = 
+        MHD_create_response_from_buffer(content.size(),
+        				const_cast<char*>(content.data()),
+        				MHD_RESPMEM_MUST_COPY);
+      MHD_add_response_header(response, "Content-Type", 
+                              "text/plain; version=0.0.4");
+      MHD_add_response_header(response, "Connection", "Keep-Alive");
       int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
       MHD_destroy_response(response);
       return ret;
     }
 
+    // The handler is shared with the worker generating the response,
+    // which can outlive the request if the client goes away.
     template <typename Handler>
     struct PostCycleInfo {
-      Handler* handler;
+      std::shared_ptr<Handler> handler;
       MHD_PostProcessor *post_processor;
+      bool dispatched;
 
       PostCycleInfo(MHD_Connection *connection) :
 	handler(new Handler()),
 	post_processor(MHD_create_post_processor(connection,
 						 MAX_POST_DATA_SIZE,
 						 IteratePostData<Handler>,
-						 static_cast<void*>(this)))
+						 static_cast<void*>(this))),
+        dispatched(false)
       {}
 
 
       ~PostCycleInfo() {
-	delete handler;
 	MHD_destroy_post_processor(post_processor);
       }
     };
 
     constexpr char ERROR_GET_MESSAGE[] = 
-      "GET is not supported by SimplePostServer.";
+      "GET is not supported by SimplePostServer, except for /metrics.";
+
+    constexpr char ERROR_BUSY_MESSAGE[] = 
+      "\"Server is busy, please try again later.\"";
   }  // namespace
 
 
   class PostHandler {
   public:
+    virtual ~PostHandler() {}
     virtual int ProcessKeyValue(const std::string &key,
 				const std::string &value) = 0;
-    virtual std::string GenerateResponse() = 0;
-    
-    virtual int HandleRequest(MHD_Connection *connection) {
-      std::string content = std::move(GenerateResponse());
-      int size = content.size() + 4;
-      buffer_.reset(new char[size]);
-      snprintf(buffer_.get(), size, "%s", content.c_str());
-      return SendResponse(connection, buffer_.get());
-    }
-
-  private:
-    std::unique_ptr<char[]> buffer_;
+    // Called from a worker thread, writes the body of the response
+    // to stream as it is generated. The stream is closed afterwards,
+    // unless it returns false: the response is then completed later
+    // by whoever holds the stream (see ResponseStream::Complete()).
+    virtual bool GenerateResponse(
+        const std::shared_ptr<ResponseStream> &stream) = 0;
   };
-  
+
+  // SimplePostServer accepts connections on a single thread, and
+  // dispatches the GenerateResponse() of the POST requests to a pool
+  // of num_workers threads. The response is chunked, and its body is
+  // sent as the worker writes it (see ResponseStream). The connection
+  // is suspended while the worker has nothing new, so that a slow
+  // request does not block the others. At most queue_size requests
+  // can wait for a worker. GET /metrics is answered right away on the
+  // server thread with the metrics of the process.
   template <typename Handler>
   class SimplePostServer {
   public:
-    SimplePostServer(int port) {
-      daemon_ = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY, port,
-				 nullptr, nullptr, &EntryPoint, nullptr, 
+    SimplePostServer(int port, int num_workers = 1,
+                     int queue_size = DEFAULT_QUEUE_SIZE) 
+      : workers_(new ThreadPool(num_workers, queue_size)) {
+      daemon_ = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY | 
+                                 MHD_USE_SUSPEND_RESUME, port,
+				 nullptr, nullptr, &EntryPoint, this, 
 				 MHD_OPTION_NOTIFY_COMPLETED, &RequestComplete, 
 				 nullptr, MHD_OPTION_END);
     }
 
+    // The pending requests are finished (and their connections
+    // resumed) before the daemon stops.
     ~SimplePostServer() {
+      workers_.reset();
       MHD_stop_daemon(daemon_);
     }
     
@@ -134,6 +351,9 @@ namespace micro_http_server {
       }
 
       if (0 == strcmp(method, "GET")) {
+        if (0 == strcmp(url, "/metrics")) {
+          return SendMetrics(connection);
+        }
 	return SendResponse(connection, const_cast<char*>(ERROR_GET_MESSAGE));
       }
 
@@ -145,13 +365,48 @@ namespace micro_http_server {
                            *upload_data_size);
           *upload_data_size = 0;
 	  return MHD_YES;
-	} else {
-	  return info->handler->HandleRequest(connection);
-	}
+	} 
+        if (!info->dispatched) {
+          info->dispatched = true;
+          return static_cast<SimplePostServer*>(cls)->Dispatch(connection,
+                                                               info);
+        }
+        return MHD_YES;
       }
       return MHD_NO;
     }
 
+    // The response is queued right away. Its body is read from the
+    // stream, which the worker fills.
+    int Dispatch(MHD_Connection *connection, PostCycleInfo<Handler> *info) {
+      std::shared_ptr<ResponseStream> stream(new ResponseStream(connection));
+      std::shared_ptr<Handler> handler = info->handler;
+      ThreadPool *workers = workers_.get();
+      stream->SetSubmitter([workers, handler](
+          const std::shared_ptr<ResponseStream> &target) {
+          return workers->TrySubmit([target, handler]() {
+              if (handler->GenerateResponse(target)) target->Close();
+            });
+        });
+      if (!ResponseStream::Resubmit(stream)) {
+        return SendResponse(connection, 
+                            const_cast<char*>(ERROR_BUSY_MESSAGE),
+                            MHD_HTTP_SERVICE_UNAVAILABLE);
+      }
+      MHD_Response *response = 
+        MHD_create_response_from_callback(
+            MHD_SIZE_UNKNOWN, STREAM_BLOCK_SIZE, &ResponseStream::Read,
+            new std::shared_ptr<ResponseStream>(stream), 
+            &ResponseStream::Free);
+      stream->SetResponse(response);
+      MHD_add_response_header(response, "Content-Type", "application/json");
+      MHD_add_response_header(response, "Connection", "Keep-Alive");
+      int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+      MHD_destroy_response(response);
+      return ret;
+    }
+
+    std::unique_ptr<ThreadPool> workers_;
     MHD_Daemon *daemon_;
   };
   
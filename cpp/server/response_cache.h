@@ -0,0 +1,174 @@
+#ifndef _MICRO_HTTP_SERVER_RESPONSE_CACHE_
+#define _MICRO_HTTP_SERVER_RESPONSE_CACHE_
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace micro_http_server {
+
+  struct ResponseCacheStats {
+    int64_t hits;
+    int64_t misses;
+    // Requests that got the body of an identical request in flight
+    // instead of computing the response again.
+    int64_t collapsed;
+    int64_t evictions;
+    // Number of cached responses.
+    size_t size;
+    // Bytes held by the cached responses.
+    size_t bytes;
+
+    ResponseCacheStats()
+      : hits(0), misses(0), collapsed(0), evictions(0), size(0),
+        bytes(0) {}
+  };
+
+  // ResponseCache keeps the most recently used response bodies within
+  // a budget of max_bytes, keyed by a 64-bit fingerprint of the
+  // request (e.g. Query::Fingerprint()).
+  //
+  // A request calls Acquire() with its key. It gets the body if it is
+  // cached. Otherwise, if no identical request is in flight, it
+  // becomes the leader of the key and must call Finish() once its
+  // response is complete. The identical requests that arrive
+  // meanwhile do not wait on a thread: their waiters are called by
+  // the leader's Finish(), with its body when it is shareable. When
+  // it is not (e.g. the response was cut short by a deadline), they
+  // have to Acquire() again, and one of them becomes the next leader.
+  class ResponseCache {
+  public:
+    const static size_t DEFAULT_MAX_BYTES = 64 << 20;
+
+    // Called once the leader is done, with whether its body is
+    // shareable, and the body if it is. Called on the thread of the
+    // leader, so that it should not block.
+    typedef std::function<void(bool, const std::string&)> Waiter;
+
+    enum Outcome {
+      // The body is cached.
+      CACHED = 0,
+      // The caller is the leader of the key.
+      LEADER,
+      // An identical request is in flight, the waiter will be called.
+      COLLAPSED
+    };
+
+    explicit ResponseCache(size_t max_bytes = DEFAULT_MAX_BYTES)
+      : max_bytes_(max_bytes), bytes_(0), entries_(), index_(),
+        in_flight_(), stats_(), mutex_() {}
+
+    // Sets *body when the outcome is CACHED, and keeps waiter only
+    // when it is COLLAPSED.
+    Outcome Acquire(uint64_t key, std::string *body, Waiter waiter) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (0 == max_bytes_) {
+        stats_.misses++;
+        return LEADER;
+      }
+      auto it = index_.find(key);
+      if (index_.end() != it) {
+        stats_.hits++;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        *body = it->second->second;
+        return CACHED;
+      }
+      auto flight = in_flight_.find(key);
+      if (in_flight_.end() != flight) {
+        flight->second.push_back(std::move(waiter));
+        return COLLAPSED;
+      }
+      stats_.misses++;
+      in_flight_[key];
+      return LEADER;
+    }
+
+    // Called by the leader of key. The body is handed to the waiters
+    // and cached only if shareable.
+    void Finish(uint64_t key, const std::string &body, bool shareable) {
+      std::vector<Waiter> waiters;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto flight = in_flight_.find(key);
+        if (in_flight_.end() == flight) return;
+        waiters.swap(flight->second);
+        in_flight_.erase(flight);
+        if (shareable) {
+          stats_.collapsed += waiters.size();
+          if (0 < max_bytes_ && body.size() <= max_bytes_ &&
+              index_.end() == index_.find(key)) {
+            entries_.emplace_front(key, body);
+            index_[key] = entries_.begin();
+            bytes_ += body.size();
+            Shrink();
+          }
+        }
+      }
+      // Outside of the lock, as a waiter that has to compute the
+      // body again calls Acquire().
+      for (const Waiter &waiter : waiters) {
+        waiter(shareable, shareable ? body : std::string());
+      }
+    }
+
+    // A budget of 0 disables the cache, and the collapsing of the
+    // identical requests with it.
+    void SetMaxBytes(size_t max_bytes) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      max_bytes_ = max_bytes;
+      Shrink();
+    }
+
+    // Bodies larger than this are never cached, so that a request can
+    // stop keeping a copy of its body once it grows past it.
+    size_t MaxBytes() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return max_bytes_;
+    }
+
+    void Clear() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      entries_.clear();
+      index_.clear();
+      bytes_ = 0;
+    }
+
+    ResponseCacheStats Stats() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ResponseCacheStats stats = stats_;
+      stats.size = entries_.size();
+      stats.bytes = bytes_;
+      return stats;
+    }
+
+  private:
+    typedef std::list<std::pair<uint64_t, std::string> > EntryList;
+
+    void Shrink() {
+      while (!entries_.empty() && bytes_ > max_bytes_) {
+        bytes_ -= entries_.back().second.size();
+        index_.erase(entries_.back().first);
+        entries_.pop_back();
+        stats_.evictions++;
+      }
+    }
+
+    size_t max_bytes_;
+    size_t bytes_;
+    // Most recently used first.
+    EntryList entries_;
+    std::unordered_map<uint64_t, EntryList::iterator> index_;
+    // The waiters of the keys whose leader is not done yet.
+    std::unordered_map<uint64_t, std::vector<Waiter> > in_flight_;
+    ResponseCacheStats stats_;
+    std::mutex mutex_;
+  };
+
+}  // namespace micro_http_server
+
+#endif  // _MICRO_HTTP_SERVER_RESPONSE_CACHE_
@@ -0,0 +1,123 @@
+#include <string>
+#include <vector>
+
+#include "server/response_cache.h"
+#include "supp/helpers.h"
+
+using namespace monster_avengers;
+using micro_http_server::ResponseCache;
+using micro_http_server::ResponseCacheStats;
+
+namespace {
+  // Records what the leader hands to a waiter.
+  struct WaiterResult {
+    bool called;
+    bool shared;
+    std::string body;
+
+    WaiterResult() : called(false), shared(false), body() {}
+  };
+
+  ResponseCache::Waiter Record(WaiterResult *result) {
+    return [result](bool shared, const std::string &body) {
+      result->called = true;
+      result->shared = shared;
+      result->body = body;
+    };
+  }
+
+  ResponseCache::Waiter Unused() {
+    return [](bool, const std::string&) {
+      CHECK(false);
+    };
+  }
+}  // namespace
+
+int main() {
+  ResponseCache cache(100);
+  std::string body;
+
+  // SingleFlightTest: the identical requests in flight get the body
+  // of the leader, which is then cached.
+  CHECK(ResponseCache::LEADER == cache.Acquire(1, &body, Unused()));
+  std::vector<WaiterResult> results(3);
+  for (WaiterResult &result : results) {
+    CHECK(ResponseCache::COLLAPSED == 
+          cache.Acquire(1, &body, Record(&result)));
+    CHECK(!result.called);
+  }
+  cache.Finish(1, "xyz", true);
+  for (const WaiterResult &result : results) {
+    CHECK(result.called && result.shared && "xyz" == result.body);
+  }
+  CHECK(ResponseCache::CACHED == cache.Acquire(1, &body, Unused()));
+  CHECK("xyz" == body);
+
+  // UnshareableTest: an unshareable body is neither handed out nor
+  // cached, and the next request becomes the leader.
+  CHECK(ResponseCache::LEADER == cache.Acquire(2, &body, Unused()));
+  WaiterResult waiter;
+  CHECK(ResponseCache::COLLAPSED == cache.Acquire(2, &body, 
+                                                  Record(&waiter)));
+  cache.Finish(2, "partial", false);
+  CHECK(waiter.called && !waiter.shared && waiter.body.empty());
+  CHECK(ResponseCache::LEADER == cache.Acquire(2, &body, Unused()));
+  cache.Finish(2, "abc", true);
+
+  // AbandonedLeaderTest: the leader's client goes away mid-body. Its
+  // partial body is not handed to the waiters, which are resubmitted
+  // (they Acquire() again from the waiter), and the first of them
+  // becomes the next leader.
+  CHECK(ResponseCache::LEADER == cache.Acquire(6, &body, Unused()));
+  std::vector<ResponseCache::Outcome> resubmitted;
+  for (int i = 0; i < 2; ++i) {
+    CHECK(ResponseCache::COLLAPSED == cache.Acquire(
+              6, &body, [&cache, &resubmitted](bool shared,
+                                               const std::string &partial) {
+                CHECK(!shared && partial.empty());
+                std::string unused;
+                resubmitted.push_back(cache.Acquire(
+                    6, &unused, [](bool shared, const std::string &body) {
+                      CHECK(shared && "[]" == body);
+                    }));
+              }));
+  }
+  cache.Finish(6, "[{\"a\": 1}, {", false);
+  CHECK(2 == resubmitted.size());
+  CHECK(ResponseCache::LEADER == resubmitted[0]);
+  CHECK(ResponseCache::COLLAPSED == resubmitted[1]);
+  cache.Finish(6, "[]", true);
+  CHECK(ResponseCache::CACHED == cache.Acquire(6, &body, Unused()));
+  CHECK("[]" == body);
+
+  ResponseCacheStats stats = cache.Stats();
+  CHECK(2 == stats.hits);
+  CHECK(4 == stats.collapsed);
+  CHECK(5 == stats.misses);
+  CHECK(3 == stats.size);
+  CHECK(8 == stats.bytes);
+
+  // EvictionTest: the least recently used bodies go first, and a
+  // body over the budget is never cached.
+  CHECK(ResponseCache::CACHED == cache.Acquire(1, &body, Unused()));
+  CHECK(ResponseCache::LEADER == cache.Acquire(3, &body, Unused()));
+  cache.Finish(3, std::string(95, 'a'), true);
+  CHECK(ResponseCache::CACHED == cache.Acquire(1, &body, Unused()));
+  CHECK(ResponseCache::LEADER == cache.Acquire(2, &body, Unused()));
+  cache.Finish(2, "abc", true);
+  stats = cache.Stats();
+  CHECK(1 <= stats.evictions);
+  CHECK(stats.bytes <= 100);
+  CHECK(ResponseCache::LEADER == cache.Acquire(4, &body, Unused()));
+  cache.Finish(4, std::string(101, 'b'), true);
+  CHECK(ResponseCache::LEADER == cache.Acquire(4, &body, Unused()));
+  cache.Finish(4, "", false);
+
+  // DisabledTest: without a budget every request is a leader.
+  cache.SetMaxBytes(0);
+  CHECK(0 == cache.Stats().size);
+  CHECK(ResponseCache::LEADER == cache.Acquire(5, &body, Unused()));
+  CHECK(ResponseCache::LEADER == cache.Acquire(5, &body, Unused()));
+
+  return 0;
+}
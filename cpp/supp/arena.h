@@ -0,0 +1,232 @@
+#ifndef _MONSTER_AVENGERS_ARENA_
+#define _MONSTER_AVENGERS_ARENA_
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace monster_avengers {
+
+  // Arena is a bump allocator for the short-lived objects of a
+  // search, e.g. OR/AND nodes, jewel key lists and iterators. Memory
+  // is never freed individually. Instead, everything allocated after
+  // a Mark is released at once by Rewind(), which runs the
+  // registered destructors and moves the bump pointer back. The
+  // blocks are kept for reuse, up to retain_bytes of them.
+  class Arena {
+  public:
+    static const size_t DEFAULT_BLOCK_SIZE = 1 << 20;  // 1 MB
+    static const size_t DEFAULT_RETAIN_BYTES = 64 << 20;  // 64 MB
+
+    struct Mark {
+      size_t block;
+      size_t offset;
+      size_t destructors;
+      size_t used;
+    };
+
+    explicit Arena(size_t block_size = DEFAULT_BLOCK_SIZE,
+                   size_t retain_bytes = DEFAULT_RETAIN_BYTES)
+      : block_size_(block_size), retain_bytes_(retain_bytes),
+        blocks_(), current_(0), offset_(0),
+        used_(0), peak_(0), destructors_() {
+      blocks_.push_back(NewBlock(block_size_));
+    }
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena() {
+      Rewind({0, 0, 0, 0});
+      for (Block &block : blocks_) {
+        free(block.data);
+      }
+    }
+
+    inline void *Allocate(size_t size,
+                          size_t alignment = alignof(std::max_align_t)) {
+      size_t offset = Align(offset_, alignment);
+      if (offset + size > blocks_[current_].size) {
+        NextBlock(size + alignment);
+        offset = 0;
+      }
+      used_ += offset + size - offset_;
+      offset_ = offset + size;
+      if (used_ > peak_) peak_ = used_;
+      return blocks_[current_].data + offset;
+    }
+
+    template <typename T>
+    inline T *AllocateArray(size_t n) {
+      return static_cast<T*>(Allocate(sizeof(T) * n, alignof(T)));
+    }
+
+    // Constructs an object in the arena. Its destructor (if not
+    // trivial) will be called when the arena is rewound past it.
+    template <typename T, typename... Args>
+    T *New(Args&&... args) {
+      T *object = new (Allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+      if (!std::is_trivially_destructible<T>::value) {
+        destructors_.push_back({object, &Destroy<T>});
+      }
+      return object;
+    }
+
+    inline Mark GetMark() const {
+      return {current_, offset_, destructors_.size(), used_};
+    }
+
+    // Releases everything allocated after the mark. Marks must be
+    // rewound in LIFO order.
+    void Rewind(const Mark &mark) {
+      while (destructors_.size() > mark.destructors) {
+        destructors_.back().destroy(destructors_.back().object);
+        destructors_.pop_back();
+      }
+      current_ = mark.block;
+      offset_ = mark.offset;
+      used_ = mark.used;
+    }
+
+    // Releases everything, and frees the blocks beyond retain_bytes.
+    void Reset() {
+      Rewind({0, 0, 0, 0});
+      size_t retained = 0;
+      size_t i = 0;
+      for (; i < blocks_.size(); ++i) {
+        retained += blocks_[i].size;
+        if (i > 0 && retained > retain_bytes_) break;
+      }
+      for (size_t j = i; j < blocks_.size(); ++j) {
+        free(blocks_[j].data);
+      }
+      blocks_.resize(i);
+    }
+
+    inline void ResetPeak() {
+      peak_ = used_;
+    }
+
+    // Bytes handed out (including alignment padding).
+    inline size_t used() const {
+      return used_;
+    }
+
+    inline size_t peak() const {
+      return peak_;
+    }
+
+    // Bytes held by the arena's blocks.
+    size_t reserved() const {
+      size_t result = 0;
+      for (const Block &block : blocks_) {
+        result += block.size;
+      }
+      return result;
+    }
+
+  private:
+    struct Block {
+      char *data;
+      size_t size;
+    };
+
+    struct Destructor {
+      void *object;
+      void (*destroy)(void *);
+    };
+
+    template <typename T>
+    static void Destroy(void *object) {
+      static_cast<T*>(object)->~T();
+    }
+
+    static inline size_t Align(size_t offset, size_t alignment) {
+      return (offset + alignment - 1) & ~(alignment - 1);
+    }
+
+    static Block NewBlock(size_t size) {
+      Block block;
+      block.data = static_cast<char*>(malloc(size));
+      if (nullptr == block.data) throw std::bad_alloc();
+      block.size = size;
+      return block;
+    }
+
+    // Moves to the next block that can hold min_size bytes, creating
+    // one if needed. The skipped bytes in the current block count as
+    // used so that Rewind() restores the bookkeeping exactly.
+    void NextBlock(size_t min_size) {
+      used_ += blocks_[current_].size - offset_;
+      current_++;
+      if (current_ >= blocks_.size() || blocks_[current_].size < min_size) {
+        blocks_.insert(blocks_.begin() + current_,
+                       NewBlock(min_size > block_size_ ?
+                                min_size : block_size_));
+      }
+      offset_ = 0;
+    }
+
+    const size_t block_size_;
+    const size_t retain_bytes_;
+    std::vector<Block> blocks_;
+    size_t current_;
+    size_t offset_;
+    size_t used_;
+    size_t peak_;
+    std::vector<Destructor> destructors_;
+  };
+
+  // STL allocator on top of an Arena. Deallocation is a no-op, the
+  // memory is reclaimed when the arena is rewound. A default
+  // constructed ArenaAllocator falls back to the global heap.
+  template <typename T>
+  class ArenaAllocator {
+  public:
+    typedef T value_type;
+
+    ArenaAllocator(Arena *arena = nullptr) : arena_(arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena_(other.arena()) {}
+
+    inline T *allocate(size_t n) {
+      if (nullptr == arena_) {
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+      }
+      return arena_->AllocateArray<T>(n);
+    }
+
+    inline void deallocate(T *pointer, size_t) {
+      if (nullptr == arena_) {
+        ::operator delete(pointer);
+      }
+    }
+
+    inline Arena *arena() const {
+      return arena_;
+    }
+
+  private:
+    Arena *arena_;
+  };
+
+  template <typename T, typename U>
+  inline bool operator==(const ArenaAllocator<T> &a,
+                         const ArenaAllocator<U> &b) {
+    return a.arena() == b.arena();
+  }
+
+  template <typename T, typename U>
+  inline bool operator!=(const ArenaAllocator<T> &a,
+                         const ArenaAllocator<U> &b) {
+    return a.arena() != b.arena();
+  }
+
+}  // namespace monster_avengers
+
+#endif  // _MONSTER_AVENGERS_ARENA_
@@ -0,0 +1,101 @@
+#include <string>
+#include <vector>
+
+#include "supp/arena.h"
+#include "supp/helpers.h"
+
+using namespace monster_avengers;
+
+namespace {
+  // Counts how many times it has been destroyed.
+  struct Tracked {
+    int *destroyed;
+
+    explicit Tracked(int *destroyed_) : destroyed(destroyed_) {}
+
+    ~Tracked() {
+      (*destroyed)++;
+    }
+  };
+}  // namespace
+
+int main() {
+  // RewindTest: Rewind() runs the destructors registered after the
+  // mark, in reverse order, and leaves the earlier objects alone.
+  {
+    int destroyed = 0;
+    Arena arena(256);
+    arena.New<Tracked>(&destroyed);
+    Arena::Mark mark = arena.GetMark();
+    size_t used = arena.used();
+    for (int i = 0; i < 3; ++i) {
+      arena.New<Tracked>(&destroyed);
+    }
+    CHECK(arena.used() > used);
+    arena.Rewind(mark);
+    CHECK(3 == destroyed);
+    CHECK(used == arena.used());
+    arena.Rewind({0, 0, 0, 0});
+    CHECK(4 == destroyed);
+    CHECK(0 == arena.used());
+  }
+
+  // NestedMarkTest: the marks rewound in LIFO order release exactly
+  // what was allocated after each of them.
+  {
+    int destroyed = 0;
+    Arena arena(256);
+    Arena::Mark outer = arena.GetMark();
+    arena.New<Tracked>(&destroyed);
+    Arena::Mark inner = arena.GetMark();
+    arena.New<Tracked>(&destroyed);
+    arena.New<Tracked>(&destroyed);
+    arena.Rewind(inner);
+    CHECK(2 == destroyed);
+    arena.Rewind(outer);
+    CHECK(3 == destroyed);
+  }
+
+  // BlockTest: the objects spilling over to new blocks are still
+  // destroyed, and the blocks are reused after the rewind.
+  {
+    int destroyed = 0;
+    Arena arena(64);
+    Arena::Mark mark = arena.GetMark();
+    std::vector<std::string*> strings;
+    for (int i = 0; i < 100; ++i) {
+      arena.New<Tracked>(&destroyed);
+      strings.push_back(arena.New<std::string>(100, 'a' + i % 26));
+    }
+    for (int i = 0; i < 100; ++i) {
+      CHECK(std::string(100, 'a' + i % 26) == *strings[i]);
+    }
+    size_t reserved = arena.reserved();
+    size_t peak = arena.peak();
+    arena.Rewind(mark);
+    CHECK(100 == destroyed);
+    CHECK(0 == arena.used());
+    CHECK(peak == arena.peak());
+    for (int i = 0; i < 100; ++i) {
+      arena.New<Tracked>(&destroyed);
+      arena.New<std::string>(100, 'z');
+    }
+    CHECK(reserved == arena.reserved());
+    arena.Reset();
+    CHECK(200 == destroyed);
+  }
+
+  // DestructorTest: the arena destroys whatever is left when it goes
+  // out of scope.
+  {
+    int destroyed = 0;
+    {
+      Arena arena(256);
+      arena.New<Tracked>(&destroyed);
+      arena.New<Tracked>(&destroyed);
+    }
+    CHECK(2 == destroyed);
+  }
+
+  return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef _MONSTER_AVENGERS_DEADLINE_
+#define _MONSTER_AVENGERS_DEADLINE_
+
+#include <atomic>
+#include <chrono>
+
+namespace monster_avengers {
+
+  // Deadline is a cancellation token with an optional time budget. A
+  // search checks it at coarse intervals (per merged armor, per tree,
+  // per batch of armor sets) and stops early once it has expired,
+  // keeping what it has found so far. Cancel() can be called from
+  // any thread.
+  class Deadline {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Only cancellation, no time budget.
+    Deadline()
+      : has_budget_(false), end_(), cancelled_(false), hit_(false) {}
+
+    // Expires budget_ms milliseconds from now.
+    explicit Deadline(int budget_ms)
+      : has_budget_(true),
+        end_(Clock::now() + std::chrono::milliseconds(budget_ms)),
+        cancelled_(false), hit_(false) {}
+
+    inline void Cancel() {
+      cancelled_.store(true, std::memory_order_relaxed);
+    }
+
+    // Once it returns true, it keeps returning true.
+    inline bool Expired() const {
+      if (hit_.load(std::memory_order_relaxed)) return true;
+      if (cancelled_.load(std::memory_order_relaxed) ||
+          (has_budget_ && Clock::now() >= end_)) {
+        hit_.store(true, std::memory_order_relaxed);
+        return true;
+      }
+      return false;
+    }
+
+    // Whether a check has seen the deadline expire, i.e. whether the
+    // search was cut short.
+    inline bool Hit() const {
+      return hit_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    const bool has_budget_;
+    const Clock::time_point end_;
+    std::atomic<bool> cancelled_;
+    mutable std::atomic<bool> hit_;
+  };
+
+}  // namespace monster_avengers
+
+#endif  // _MONSTER_AVENGERS_DEADLINE_
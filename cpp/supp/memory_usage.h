@@ -0,0 +1,48 @@
+#ifndef _MONSTER_AVENGERS_MEMORY_USAGE_
+#define _MONSTER_AVENGERS_MEMORY_USAGE_
+
+#include <cstdio>
+#if !_WIN32
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+namespace monster_avengers {
+
+  // Current resident set size of the process in KB, 0 if unknown.
+  inline long CurrentRssKb() {
+#if _WIN32
+    return 0;
+#else
+    long pages = 0;
+    long resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (nullptr == statm) return 0;
+    if (2 != fscanf(statm, "%ld %ld", &pages, &resident)) {
+      resident = 0;
+    }
+    fclose(statm);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+#endif
+  }
+
+  // Peak resident set size of the process in KB since it started, 0
+  // if unknown. It never drops, so that it says nothing of a single
+  // search once a larger one has run.
+  inline long PeakRssKb() {
+#if _WIN32
+    return 0;
+#else
+    rusage usage;
+    if (0 != getrusage(RUSAGE_SELF, &usage)) return 0;
+#if __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+  }
+
+}  // namespace monster_avengers
+
+#endif  // _MONSTER_AVENGERS_MEMORY_USAGE_
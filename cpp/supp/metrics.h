@@ -0,0 +1,225 @@
+#ifndef _MONSTER_AVENGERS_METRICS_
+#define _MONSTER_AVENGERS_METRICS_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace monster_avengers {
+
+  // A monotonic count, updated without locking.
+  class Counter {
+  public:
+    Counter() : value_(0) {}
+
+    inline void Add(int64_t delta = 1) {
+      value_.fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    inline int64_t Value() const {
+      return value_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<int64_t> value_;
+  };
+
+  // A distribution over fixed buckets, updated without locking. A
+  // value falls in the first bucket whose upper bound is at least the
+  // value, or in the overflow bucket past the last bound.
+  class Histogram {
+  public:
+    explicit Histogram(const std::vector<double> &bounds)
+      : bounds_(bounds), buckets_(new std::atomic<int64_t>[bounds.size() + 1]),
+        count_(0), sum_bits_(0) {
+      for (size_t i = 0; i <= bounds_.size(); ++i) {
+        buckets_[i].store(0, std::memory_order_relaxed);
+      }
+      double zero = 0.0;
+      uint64_t bits;
+      memcpy(&bits, &zero, sizeof(bits));
+      sum_bits_.store(bits, std::memory_order_relaxed);
+    }
+
+    void Observe(double value) {
+      size_t i = 0;
+      while (i < bounds_.size() && value > bounds_[i]) ++i;
+      buckets_[i].fetch_add(1, std::memory_order_relaxed);
+      count_.fetch_add(1, std::memory_order_relaxed);
+      // The sum is a double kept in the bits of an integer.
+      uint64_t old_bits = sum_bits_.load(std::memory_order_relaxed);
+      uint64_t new_bits;
+      do {
+        double sum;
+        memcpy(&sum, &old_bits, sizeof(sum));
+        sum += value;
+        memcpy(&new_bits, &sum, sizeof(new_bits));
+      } while (!sum_bits_.compare_exchange_weak(old_bits, new_bits,
+                                                std::memory_order_relaxed));
+    }
+
+    inline const std::vector<double> &bounds() const {
+      return bounds_;
+    }
+
+    // The count of bucket i, i == bounds().size() for the overflow.
+    inline int64_t Bucket(size_t i) const {
+      return buckets_[i].load(std::memory_order_relaxed);
+    }
+
+    inline int64_t Count() const {
+      return count_.load(std::memory_order_relaxed);
+    }
+
+    inline double Sum() const {
+      uint64_t bits = sum_bits_.load(std::memory_order_relaxed);
+      double sum;
+      memcpy(&sum, &bits, sizeof(sum));
+      return sum;
+    }
+
+    // From 1 ms to 30 sec.
+    static const std::vector<double> &SecondBuckets() {
+      static const std::vector<double> bounds =
+        {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5,
+         1.0, 2.5, 5.0, 10.0, 30.0};
+      return bounds;
+    }
+
+    // Powers of 10 up to 10^8.
+    static const std::vector<double> &SizeBuckets() {
+      static const std::vector<double> bounds =
+        {1.0, 10.0, 100.0, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8};
+      return bounds;
+    }
+
+  private:
+    const std::vector<double> bounds_;
+    std::unique_ptr<std::atomic<int64_t>[]> buckets_;
+    std::atomic<int64_t> count_;
+    std::atomic<uint64_t> sum_bits_;
+  };
+
+  // MetricsRegistry owns the counters and the histograms of the
+  // process, and renders them in the Prometheus text format. A metric
+  // is identified by its name and its labels (e.g. "stage=\"x\""),
+  // and lives as long as the registry.
+  //
+  // Looking a metric up takes a lock, updating it does not, so that
+  // the hot paths should keep the pointers they look up.
+  class MetricsRegistry {
+  public:
+    MetricsRegistry() : families_(), mutex_() {}
+
+    // The registry shared by the whole process.
+    static MetricsRegistry &Global() {
+      static MetricsRegistry registry;
+      return registry;
+    }
+
+    Counter *GetCounter(const std::string &name, const std::string &help,
+                        const std::string &labels = "") {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Family &family = GetFamily(name, help, COUNTER);
+      std::unique_ptr<Counter> &counter = family.counters[labels];
+      if (!counter) counter.reset(new Counter());
+      return counter.get();
+    }
+
+    // The bounds only matter when the metric is created.
+    Histogram *GetHistogram(const std::string &name, const std::string &help,
+                            const std::vector<double> &bounds,
+                            const std::string &labels = "") {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Family &family = GetFamily(name, help, HISTOGRAM);
+      std::unique_ptr<Histogram> &histogram = family.histograms[labels];
+      if (!histogram) histogram.reset(new Histogram(bounds));
+      return histogram.get();
+    }
+
+    // Prometheus text exposition format (version 0.0.4).
+    std::string Render() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::string output;
+      for (const auto &item : families_) {
+        const std::string &name = item.first;
+        const Family &family = item.second;
+        output += "# HELP " + name + " " + family.help + "\n";
+        output += "# TYPE " + name +
+          (COUNTER == family.type ? " counter\n" : " histogram\n");
+        for (const auto &series : family.counters) {
+          output += name + Braces(series.first) + " " +
+            std::to_string(series.second->Value()) + "\n";
+        }
+        for (const auto &series : family.histograms) {
+          const Histogram &histogram = *series.second;
+          std::string prefix = series.first.empty() ?
+            "" : series.first + ",";
+          int64_t cumulative = 0;
+          for (size_t i = 0; i < histogram.bounds().size(); ++i) {
+            cumulative += histogram.Bucket(i);
+            output += name + "_bucket{" + prefix + "le=\"" +
+              Number(histogram.bounds()[i]) + "\"} " +
+              std::to_string(cumulative) + "\n";
+          }
+          cumulative += histogram.Bucket(histogram.bounds().size());
+          output += name + "_bucket{" + prefix + "le=\"+Inf\"} " +
+            std::to_string(cumulative) + "\n";
+          output += name + "_sum" + Braces(series.first) + " " +
+            Number(histogram.Sum()) + "\n";
+          output += name + "_count" + Braces(series.first) + " " +
+            std::to_string(histogram.Count()) + "\n";
+        }
+      }
+      return output;
+    }
+
+  private:
+    enum MetricType {
+      COUNTER = 0,
+      HISTOGRAM
+    };
+
+    struct Family {
+      std::string help;
+      MetricType type;
+      // By labels.
+      std::map<std::string, std::unique_ptr<Counter> > counters;
+      std::map<std::string, std::unique_ptr<Histogram> > histograms;
+    };
+
+    Family &GetFamily(const std::string &name, const std::string &help,
+                      MetricType type) {
+      auto it = families_.find(name);
+      if (families_.end() == it) {
+        it = families_.emplace(name, Family()).first;
+        it->second.help = help;
+        it->second.type = type;
+      }
+      return it->second;
+    }
+
+    static std::string Braces(const std::string &labels) {
+      return labels.empty() ? "" : "{" + labels + "}";
+    }
+
+    static std::string Number(double value) {
+      char buffer[32];
+      snprintf(buffer, sizeof(buffer), "%.9g", value);
+      return buffer;
+    }
+
+    // Sorted by name, so that the output is stable.
+    std::map<std::string, Family> families_;
+    std::mutex mutex_;
+  };
+
+}  // namespace monster_avengers
+
+#endif  // _MONSTER_AVENGERS_METRICS_
@@ -0,0 +1,92 @@
+#ifndef _MONSTER_AVENGERS_THREAD_POOL_
+#define _MONSTER_AVENGERS_THREAD_POOL_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace monster_avengers {
+
+  // A fixed number of worker threads consuming tasks from a bounded
+  // FIFO queue. Tasks that do not fit in the queue are rejected
+  // instead of piling up.
+  class ThreadPool {
+  public:
+    typedef std::function<void()> Task;
+
+    ThreadPool(int num_workers, size_t max_queue_size)
+      : max_queue_size_(max_queue_size), stopped_(false) {
+      if (num_workers < 1) num_workers = 1;
+      for (int i = 0; i < num_workers; ++i) {
+        workers_.emplace_back(&ThreadPool::Work, this);
+      }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Runs the remaining queued tasks and joins the workers.
+    ~ThreadPool() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+      }
+      ready_.notify_all();
+      for (std::thread &worker : workers_) {
+        worker.join();
+      }
+    }
+
+    // Returns false if the queue is full.
+    bool TrySubmit(Task task) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopped_ || queue_.size() >= max_queue_size_) {
+          return false;
+        }
+        queue_.push_back(std::move(task));
+      }
+      ready_.notify_one();
+      return true;
+    }
+
+    inline int size() const {
+      return static_cast<int>(workers_.size());
+    }
+
+    size_t QueueSize() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return queue_.size();
+    }
+
+  private:
+    void Work() {
+      while (true) {
+        Task task;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          ready_.wait(lock, [this]() {
+              return stopped_ || !queue_.empty();
+            });
+          if (queue_.empty()) return;
+          task = std::move(queue_.front());
+          queue_.pop_front();
+        }
+        task();
+      }
+    }
+
+    const size_t max_queue_size_;
+    bool stopped_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<Task> queue_;
+    std::vector<std::thread> workers_;
+  };
+
+}  // namespace monster_avengers
+
+#endif  // _MONSTER_AVENGERS_THREAD_POOL_
@@ -22,5 +22,23 @@ private:
   std::chrono::time_point<std::chrono::system_clock> start_;
 };
 
+// Adds the seconds between its construction and its destruction to
+// *seconds.
+class ScopedTimer {
+public:
+  explicit ScopedTimer(double *seconds)
+    : seconds_(seconds), start_(std::chrono::steady_clock::now()) {}
+
+  ~ScopedTimer() {
+    std::chrono::duration<double> elapsed = 
+      std::chrono::steady_clock::now() - start_;
+    *seconds_ += elapsed.count();
+  }
+
+private:
+  double *seconds_;
+  std::chrono::time_point<std::chrono::steady_clock> start_;
+};
+
 #endif  // _MONSTER_AVENGERS_TIMER_
 
@@ -0,0 +1,117 @@
+#ifndef _MONSTER_AVENGERS_WORK_STEALING_
+#define _MONSTER_AVENGERS_WORK_STEALING_
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace monster_avengers {
+
+  // WorkStealingScheduler runs a range of independent tasks on a
+  // number of threads. The range is split evenly into one queue per
+  // worker. A worker takes tasks from the front of its own queue, and
+  // once it runs dry, steals from the back of the others' queues, so
+  // that a few expensive tasks do not leave the other workers idle.
+  class WorkStealingScheduler {
+  public:
+    // num_workers <= 0 means one worker per hardware thread.
+    explicit WorkStealingScheduler(int num_workers = 0)
+      : num_workers_(num_workers) {
+      if (num_workers_ <= 0) {
+        num_workers_ = std::thread::hardware_concurrency();
+      }
+      if (num_workers_ < 1) num_workers_ = 1;
+    }
+
+    inline int size() const {
+      return num_workers_;
+    }
+
+    // Calls task(worker_id, i) for every i in [begin, end), where
+    // worker_id is in [0, size()). Tasks of the same worker are
+    // called sequentially from the same thread. Returns when all the
+    // tasks are done.
+    template <typename Task>
+    void Run(int begin, int end, Task task) {
+      std::vector<std::unique_ptr<WorkQueue> > queues;
+      for (int worker = 0; worker < num_workers_; ++worker) {
+        queues.emplace_back(new WorkQueue());
+      }
+      int total = end - begin;
+      for (int worker = 0; worker < num_workers_; ++worker) {
+        int first = begin +
+          static_cast<int>(static_cast<int64_t>(total) * worker / num_workers_);
+        int last = begin +
+          static_cast<int>(static_cast<int64_t>(total) * (worker + 1) /
+                           num_workers_);
+        for (int i = first; i < last; ++i) {
+          queues[worker]->tasks.push_back(i);
+        }
+      }
+
+      std::vector<std::thread> threads;
+      for (int worker = 1; worker < num_workers_; ++worker) {
+        threads.emplace_back([this, worker, &queues, &task]() {
+            Work(worker, &queues, task);
+          });
+      }
+      // The calling thread is worker 0.
+      Work(0, &queues, task);
+      for (std::thread &thread : threads) {
+        thread.join();
+      }
+    }
+
+  private:
+    struct WorkQueue {
+      std::mutex mutex;
+      std::deque<int> tasks;
+    };
+
+    template <typename Task>
+    void Work(int worker,
+              std::vector<std::unique_ptr<WorkQueue> > *queues,
+              Task &task) {
+      int i = 0;
+      while (Pop(worker, queues, &i)) {
+        task(worker, i);
+      }
+    }
+
+    // Takes the next task from the worker's own queue, or steals one
+    // from another worker. Returns false when all the queues are
+    // empty. No task is added during a run, so that an empty sweep
+    // means the worker is done.
+    bool Pop(int worker,
+             std::vector<std::unique_ptr<WorkQueue> > *queues,
+             int *i) {
+      {
+        WorkQueue &own = *(*queues)[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+          *i = own.tasks.front();
+          own.tasks.pop_front();
+          return true;
+        }
+      }
+      for (int offset = 1; offset < num_workers_; ++offset) {
+        WorkQueue &victim = *(*queues)[(worker + offset) % num_workers_];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+          *i = victim.tasks.back();
+          victim.tasks.pop_back();
+          return true;
+        }
+      }
+      return false;
+    }
+
+    int num_workers_;
+  };
+
+}  // namespace monster_avengers
+
+#endif  // _MONSTER_AVENGERS_WORK_STEALING_
@@ -204,6 +204,16 @@ namespace monster_avengers {
       return output_.str();
     }
 
+    // The JSON of a single armor set, as an element of the list of
+    // ToString(). Does not add it to the list.
+    std::wstring ToJson(const ArmorSet &armor_set) const {
+      std::wostringstream output_;
+      output_.imbue(LOCALE_UTF8);
+      JsonArmorResult(*data_, solver_, armor_set).Format().OutputJson(
+          &output_);
+      return output_.str();
+    }
+
   private:
 
     const JewelSolver solver_;
@@ -225,17 +235,27 @@ namespace monster_avengers {
       }
     }
 
+    // saved is the time saved by the witness search, negative if it
+    // was not measured.
     void Push(int skill_id, bool pass, const LanguageText &name, 
-              double duration) {
+              double duration, double saved = -1.0) {
       if (to_screen_) {
-        wprintf(L"%.4lf sec, (%03d) %ls %s\n",
+        wprintf(L"%.4lf sec, (%03d) %ls %s",
                 duration,
                 skill_id,
                 name.c_str(),
                 pass ? "[PASS]" : "[fail]");
+        if (saved >= 0.0) {
+          wprintf(L" (saved %.4lf sec)", saved);
+        }
+        wprintf(L"\n");
       } else {
         (*output_stream_) << "(" << skill_id << " "
-                          << (pass ? ":PASS" : ":FAIL") << ")\n";
+                          << (pass ? ":PASS" : ":FAIL");
+        if (saved >= 0.0) {
+          (*output_stream_) << " :SAVED " << saved;
+        }
+        (*output_stream_) << ")\n";
         output_stream_->flush();
       }
     }
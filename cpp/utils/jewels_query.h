@@ -1,33 +1,282 @@
 #ifndef _MONSTER_AVENGERS_JEWELS_QUERY_
 #define _MONSTER_AVENGERS_JEWELS_QUERY_
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 #include <utility>
 #include <unordered_set>
 #include <unordered_map>
 #include "utils/signature.h"
+#include "utils/signature_set.h"
 
 namespace monster_avengers {
 
+  // Spreads a packed hole alignment over the slots of a table.
+  inline size_t HashHoles(uint64_t code) {
+    return static_cast<size_t>((code * 0x9e3779b97f4a7c15ULL) >> 32);
+  }
+
+  // A sparse memo from packed hole alignments to Values. The values
+  // live in a deque, so that references to them stay valid as the
+  // memo grows, and the codes are indexed by a small open addressing
+  // table, probed linearly.
+  template <typename Value>
+  class HoleMemo {
+  public:
+    HoleMemo() : slots_(), mask_(0), values_() {}
+
+    // Returns nullptr if code is not memoized.
+    inline const Value *Find(uint64_t code) const {
+      if (slots_.empty()) return nullptr;
+      for (size_t slot = HashHoles(code) & mask_; ;
+           slot = (slot + 1) & mask_) {
+        const Slot &entry = slots_[slot];
+        if (0 == entry.position) return nullptr;
+        if (code == entry.code) return &values_[entry.position - 1];
+      }
+    }
+
+    // Adds a default value for code, which must not be memoized yet.
+    inline Value *Insert(uint64_t code) {
+      if ((values_.size() + 1) * 2 > slots_.size()) {
+        Rehash(slots_.empty() ? 64 : slots_.size() * 2);
+      }
+      size_t slot = HashHoles(code) & mask_;
+      while (0 != slots_[slot].position) slot = (slot + 1) & mask_;
+      values_.emplace_back();
+      slots_[slot].code = code;
+      slots_[slot].position = static_cast<uint32_t>(values_.size());
+      return &values_.back();
+    }
+
+    inline size_t size() const {
+      return values_.size();
+    }
+
+  private:
+    struct Slot {
+      uint64_t code;
+      // Position in values_ + 1, or 0 for an empty slot.
+      uint32_t position;
+    };
+
+    void Rehash(size_t capacity) {
+      std::vector<Slot> old_slots(capacity, Slot{0, 0});
+      old_slots.swap(slots_);
+      mask_ = capacity - 1;
+      for (const Slot &entry : old_slots) {
+        if (0 == entry.position) continue;
+        size_t slot = HashHoles(entry.code) & mask_;
+        while (0 != slots_[slot].position) slot = (slot + 1) & mask_;
+        slots_[slot] = entry;
+      }
+    }
+
+    std::vector<Slot> slots_;
+    size_t mask_;
+    std::deque<Value> values_;
+  };
+
+  // An insert-only index from codes to the finished values of a
+  // HoleMemo, which can be read without the memo's lock. There is one
+  // writer at a time. A slot is published by its value pointer,
+  // stored after its code, and a full table is replaced by a copy
+  // twice as large. The replaced tables are kept until the index is
+  // destroyed, as readers may still be probing them.
+  template <typename Value>
+  class PublishedHoles {
+  public:
+    PublishedHoles() : table_(nullptr), tables_(), size_(0) {
+      Grow(64);
+    }
+
+    PublishedHoles(const PublishedHoles &) = delete;
+    PublishedHoles &operator=(const PublishedHoles &) = delete;
+
+    // Returns nullptr if code is not published (yet).
+    inline const Value *Find(uint64_t code) const {
+      const Table *table = table_.load(std::memory_order_acquire);
+      for (size_t slot = HashHoles(code) & table->mask; ;
+           slot = (slot + 1) & table->mask) {
+        const Value *value =
+          table->slots[slot].value.load(std::memory_order_acquire);
+        if (nullptr == value) return nullptr;
+        if (code == table->slots[slot].code) return value;
+      }
+    }
+
+    // Only called by the writer, with a code that is not published.
+    void Publish(uint64_t code, const Value *value) {
+      if ((size_ + 1) * 2 > tables_.back()->mask + 1) {
+        Grow((tables_.back()->mask + 1) * 2);
+      }
+      Insert(tables_.back().get(), code, value);
+      size_++;
+    }
+
+  private:
+    struct Slot {
+      uint64_t code;
+      std::atomic<const Value*> value;
+    };
+
+    struct Table {
+      std::unique_ptr<Slot[]> slots;
+      size_t mask;
+    };
+
+    static void Insert(Table *table, uint64_t code, const Value *value) {
+      size_t slot = HashHoles(code) & table->mask;
+      while (nullptr != table->slots[slot].value.load(
+                 std::memory_order_relaxed)) {
+        slot = (slot + 1) & table->mask;
+      }
+      table->slots[slot].code = code;
+      table->slots[slot].value.store(value, std::memory_order_release);
+    }
+
+    void Grow(size_t capacity) {
+      std::unique_ptr<Table> table(new Table);
+      table->slots.reset(new Slot[capacity]);
+      table->mask = capacity - 1;
+      for (size_t slot = 0; slot < capacity; ++slot) {
+        table->slots[slot].code = 0;
+        table->slots[slot].value.store(nullptr, std::memory_order_relaxed);
+      }
+      if (!tables_.empty()) {
+        const Table &old = *tables_.back();
+        for (size_t slot = 0; slot <= old.mask; ++slot) {
+          const Value *value =
+            old.slots[slot].value.load(std::memory_order_relaxed);
+          if (nullptr != value) {
+            Insert(table.get(), old.slots[slot].code, value);
+          }
+        }
+      }
+      table_.store(table.get(), std::memory_order_release);
+      tables_.push_back(std::move(table));
+    }
+
+    std::atomic<const Table*> table_;
+    // The current table is the last one.
+    std::vector<std::unique_ptr<Table> > tables_;
+    size_t size_;
+  };
+
+  // The keys of the hole memos. Numbers of holes stay far below 256.
+  inline uint64_t PackHoles(int i, int j, int k, 
+                            int extra, int multiplier) {
+    return (static_cast<uint64_t>(multiplier) << 32) |
+      (static_cast<uint64_t>(extra) << 24) | (k << 16) | (j << 8) | i;
+  }
   
-  class HoleClient {
+  // Removes the keys that are dominated (see sig::Dominates) by
+  // another key of the list, as well as the duplicates. The remaining
+  // keys keep their order.
+  template <typename KeyList>
+  void RemoveDominated(KeyList *keys) {
+    typedef typename KeyList::value_type Key;
+    if (keys->size() < 2) return;
+
+    // Sorted by holes, and then by descending total points, so that a
+    // key can only be dominated by the ones before it.
+    struct Entry {
+      int holes;
+      int points;
+      int position;
+    };
+    std::vector<Entry> entries(keys->size());
+    for (int position = 0; position < keys->size(); ++position) {
+      const Key &key = (*keys)[position];
+      Entry &entry = entries[position];
+      entry.holes = (static_cast<uint8_t>(key.bytes[0]) << 16) |
+        (static_cast<uint8_t>(key.bytes[1]) << 8) |
+        static_cast<uint8_t>(key.bytes[2]);
+      entry.points = 0;
+      for (int byte = Key::EFFECTS_BEGIN; byte < Key::BYTES; ++byte) {
+        entry.points += key.bytes[byte];
+      }
+      entry.position = position;
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry &a, const Entry &b) {
+                if (a.holes != b.holes) return a.holes < b.holes;
+                if (a.points != b.points) return a.points > b.points;
+                return a.position < b.position;
+              });
+
+    std::vector<bool> removed(keys->size(), false);
+    std::vector<int> frontier;
+    for (size_t n = 0; n < entries.size(); ++n) {
+      if (0 == n || entries[n].holes != entries[n - 1].holes) {
+        frontier.clear();
+      }
+      const Key &key = (*keys)[entries[n].position];
+      for (int position : frontier) {
+        if (sig::Dominates((*keys)[position], key)) {
+          removed[entries[n].position] = true;
+          break;
+        }
+      }
+      if (!removed[entries[n].position]) {
+        frontier.push_back(entries[n].position);
+      }
+    }
+
+    size_t size = 0;
+    for (size_t position = 0; position < keys->size(); ++position) {
+      if (!removed[position]) {
+        (*keys)[size++] = (*keys)[position];
+      }
+    }
+    keys->resize(size);
+  }
+  
+  // The part of a HoleTable that does not depend on the width of its
+  // Signatures, so that HoleTableCache can hold the tables of all the
+  // widths.
+  class HoleTableBase {
   public:
-    const static int MAX_ONES = 24;
-    const static int MAX_TWOS = 8;
-    const static int MAX_THREES = 8;
+    virtual ~HoleTableBase() {}
 
-    HoleClient(const DataSet &data, 
-               const std::vector<int> &skill_ids,
-               const std::vector<Effect> &effects, 
-	       const JewelFilter &filter)
-      : jewel_keys_() {
+    // Approximate bytes held by the memoized answers.
+    virtual size_t MemoryUsage() const = 0;
+  };
+
+  // HoleTable computes which jewel combinations (summed up as
+  // Signatures) fit in a given hole alignment. The answers are
+  // memoized lazily in a sparse map keyed by the packed alignment, as
+  // only a few of the possible alignments are ever asked for. Each
+  // answer is stored as a sorted contiguous array, and is never
+  // changed or dropped once computed, so that a table can be shared
+  // by concurrent searches: Get() is thread safe, and the returned
+  // references stay valid as long as the table. Only the alignments
+  // that are not computed yet take the lock, the others are found in
+  // published_.
+  template <typename Key>
+  class HoleTable : public HoleTableBase {
+  public:
+    HoleTable(const DataSet &data, 
+              const std::vector<int> &skill_ids,
+              const std::vector<Effect> &effects, 
+              const JewelFilter &filter)
+      : jewels_(data.shared_jewels()), jewel_keys_(), 
+        fixed_memo_(), memo_(), published_(), scratch_(), bytes_(0), 
+        mutex_() {
       bool valid = false;
 
       for (int i = 0; i < data.jewels().size(); ++i) {
 	const Jewel &jewel = data.jewel(i);
 	if (filter.Validate(data, i)) {
-	  Signature key = Signature(jewel, skill_ids, 
+	  Key key = Key(jewel, skill_ids, 
 				    effects, &valid);
 	  if (valid) {
 	    jewel_keys_[jewel.holes].insert(key);
@@ -35,219 +284,216 @@ namespace monster_avengers {
 	}
       }
 
-      buffer_[0].insert(Signature());
-      fixed_buffer_[1][0].insert(Signature());
-      fixed_buffer_[2][0].insert(Signature());
-      fixed_buffer_[3][0].insert(Signature());
-    }
-    
-    HoleClient(const DataSet &data, 
-               const std::vector<Effect> &effects, 
-	       const JewelFilter &filter) 
-      : HoleClient(data, SkillIdsFromEffects(effects), effects, filter) {}
-    
-    HoleClient(const DataSet &data, int skill_id, 
-               const std::vector<Effect> &effects, 
-	       const JewelFilter &filter) 
-      : HoleClient(data, std::vector<int>({skill_id}), 
-                   effects, filter) {}
-    
-    inline const std::unordered_set<Signature> &Query(Signature input) {
-      int i(0), j(0), k(0);
-      sig::KeyHoles(input, &i, &j, &k);
-      return Calculate(i, j, k, input.BodyHoleSum(), input.multiplier());
-    }
-
-    inline const std::unordered_set<Signature> &Query(int i, 
-                                                      int j, 
-                                                      int k,
-                                                      int extra,
-                                                      int multiplier) {
-      return Calculate(i, j, k, extra, multiplier);
+      SignatureSet<Key> empty_key;
+      empty_key.insert(Key());
+      *memo_.Insert(PackHoles(0, 0, 0, 0, 0)) = 
+        SortedSignatureSet<Key>(empty_key);
+      for (int holes = 1; holes <= 3; ++holes) {
+        *fixed_memo_.Insert(PackFixed(holes, 0)) = 
+          SortedSignatureSet<Key>(empty_key);
+      }
     }
 
-    // Use the hole aligment from stuffed to stuff the original hole
-    // aligment, and get the residual hole alignment.
-    static void GetResidual(const Signature &original, 
-                            const Signature &stuffed,
-                            int *i, int *j, int *k, int *extra) {
-      sig::KeyHoles(original, i, j, k);
-      int one(0), two(0), three(0);
-      sig::KeyHoles(stuffed, &one, &two, &three);
-
-      // Handle 3 holes
-      *k -= three;
-
-      // Handle 2 holes
-      if (two <= *j) {
-        *j -= two;
-      } else {
-        two -= *j;
-        *j = 0;
-        *k -= two;
-        *i += two;
+    HoleTable(const HoleTable &) = delete;
+    HoleTable &operator=(const HoleTable &) = delete;
+
+    // With frontier, only the combinations that are not dominated
+    // (see sig::Dominates) by another one of the same alignment are
+    // returned. They keep the best points of every skill, so that a
+    // search that only needs some combination to fit gets the same
+    // armor sets from the frontier, with fewer alternatives to test.
+    inline const SortedSignatureSet<Key> &Get(int i, int j, int k,
+                                         int extra, int multiplier,
+                                         bool frontier = false) {
+      uint64_t code = PackHoles(i, j, k, extra, multiplier) | 
+        (frontier ? FRONTIER : 0);
+      const SortedSignatureSet<Key> *done = published_.Find(code);
+      if (nullptr != done) return *done;
+      std::lock_guard<std::mutex> lock(mutex_);
+      const SortedSignatureSet<Key> &result = frontier ?
+        CalculateFrontier(i, j, k, extra, multiplier) :
+        Calculate(i, j, k, extra, multiplier);
+      // Another thread may have published it while this one waited.
+      if (nullptr == published_.Find(code)) {
+        published_.Publish(code, &result);
       }
+      return result;
+    }
 
-      if (one <= *i) {
-        *i -= one;
-      } else {
-        one -= *i;
-        *i = 0;
-        if (one <= ((*j) << 1)) {
-          *j -= ((one + 1) >> 1);
-          if (1 & one) {
-            *i = 1;
-          }
-        } else {
-          one -= (*j << 1);
-          *j = 0;
-          *k -= ((one + 2) / 3);
-          int remain = one % 3;
-          if (1 == remain) {
-            (*j)++;
-          } else if (2 == remain) {
-            (*i)++;
-          }
-        }
-      }
+    // Number of memoized hole alignments.
+    size_t MemoSize() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return memo_.size() + fixed_memo_.size();
+    }
 
-      // Handle Extra:
-      *extra = original.BodyHoleSum() - stuffed.BodyHoleSum();
+    // Approximate bytes held by the memoized answers. It does not
+    // take the lock.
+    inline size_t MemoryUsage() const override {
+      return bytes_.load(std::memory_order_relaxed);
     }
 
     // This is only for unit test purpose.
-    std::unordered_set<Signature> DFS(int i, int j, int k) {
-      std::array<std::vector<Signature>, 4> jewels;
+    SignatureSet<Key> DFS(int i, int j, int k) const {
+      std::array<std::vector<Key>, 4> jewels;
       for (int holes = 1; holes <= 3; ++holes) {
-        for (const Signature &key : jewel_keys_[holes]) {
+        for (const Key &key : jewel_keys_[holes]) {
           jewels[holes].push_back(key);
         }
       }
-      std::unordered_set<Signature> result;
-      DFS(i, j, k, 3, 0, Signature(), jewels, &result);
+      SignatureSet<Key> result;
+      DFS(i, j, k, 3, 0, Key(), jewels, &result);
       return result;
     }
 
   private:
-    std::vector<int> SkillIdsFromEffects(const std::vector<Effect> &effects) {
-      std::vector<int> skill_ids;
-      for (const Effect &effect : effects) {
-        skill_ids.push_back(effect.skill_id);
-      }
-      return skill_ids;
+    // Marks the codes of the frontiers in memo_.
+    const static uint64_t FRONTIER = 1ULL << 40;
+
+    static inline uint64_t PackFixed(int holes, int i) {
+      return (holes << 8) | i;
     }
 
-    inline void SetProduct(const std::unordered_set<Signature> &a,
-                    const std::unordered_set<Signature> &b,
-                    std::unordered_set<Signature> *c) {
-      for (const Signature &key_a : a) {
-        for (const Signature &key_b : b) {
-          c->insert(key_a + key_b);
+    // Adds all the sums of a key from a and a key from b to scratch_.
+    template <typename SetA, typename SetB>
+    inline void SetProduct(const SetA &a, const SetB &b) {
+      for (const Key &key_a : a) {
+        for (const Key &key_b : b) {
+          scratch_.insert(key_a + key_b);
         }
       }
     }
 
-    inline void SetUnion(const std::unordered_set<Signature> &input,
-                  std::unordered_set<Signature> *base) {
-      for (const Signature &key : input) {
-        base->insert(key);
+    inline void SetUnion(const SortedSignatureSet<Key> &input) {
+      for (const Key &key : input) {
+        scratch_.insert(key);
       }
     }
 
-    const std::unordered_set<Signature> &CalculateFixed(int holes, int i) {
-      if (!fixed_buffer_[holes][i].empty()) {
-        return fixed_buffer_[holes][i];
-      }
-      SetProduct(CalculateFixed(holes, i - 1),
-                 jewel_keys_[holes],
-                 &fixed_buffer_[holes][i]);
-      return fixed_buffer_[holes][i];
+    // Moves the content of scratch_ into the memo entry.
+    inline const SortedSignatureSet<Key> &Store(SortedSignatureSet<Key> *entry) {
+      *entry = SortedSignatureSet<Key>(scratch_);
+      bytes_.fetch_add(sizeof(SortedSignatureSet<Key>) + entry->MemoryUsage(),
+                       std::memory_order_relaxed);
+      scratch_.clear();
+      return *entry;
     }
 
-    const std::unordered_set<Signature> &Calculate(int i) {
-      if (!buffer_[i].empty()) {
-        return buffer_[i];
-      }
+    // The inputs of an entry are always looked up (and computed)
+    // before scratch_ is filled, as computing them reuses scratch_.
 
-      buffer_[i] = CalculateFixed(1, i);
-      SetUnion(Calculate(i - 1),
-               &buffer_[i]);
-      return buffer_[i];
+    const SortedSignatureSet<Key> &CalculateFixed(int holes, int i) {
+      uint64_t code = PackFixed(holes, i);
+      const SortedSignatureSet<Key> *found = fixed_memo_.Find(code);
+      if (nullptr != found) {
+        return *found;
+      }
+      const SortedSignatureSet<Key> &previous = CalculateFixed(holes, i - 1);
+      SetProduct(previous, jewel_keys_[holes]);
+      return Store(fixed_memo_.Insert(code));
     }
 
-    const std::unordered_set<Signature> &Calculate(int i, int j) {
-      int index = j * MAX_ONES + i;
-      
-      if (!buffer_[index].empty()) {
-        return buffer_[index];
+    const SortedSignatureSet<Key> &Calculate(int i) {
+      uint64_t code = PackHoles(i, 0, 0, 0, 0);
+      const SortedSignatureSet<Key> *found = memo_.Find(code);
+      if (nullptr != found) {
+        return *found;
       }
-      
+      const SortedSignatureSet<Key> &fixed = CalculateFixed(1, i);
+      const SortedSignatureSet<Key> &previous = Calculate(i - 1);
+      SetUnion(fixed);
+      SetUnion(previous);
+      return Store(memo_.Insert(code));
+    }
+
+    const SortedSignatureSet<Key> &Calculate(int i, int j) {
       if (0 == j) {
         return Calculate(i);
       }
 
-      SetProduct(Calculate(i),
-                 CalculateFixed(2, j),
-                 &buffer_[index]);
-      SetUnion(Calculate(i + 2, j - 1),
-               &buffer_[index]);
-      
-      return buffer_[index];
-    }
-
-    const std::unordered_set<Signature> &Calculate(int i, int j, int k) {
-      int index = (k * MAX_TWOS + j) * MAX_ONES + i;
-      if (!buffer_[index].empty()) {
-        return buffer_[index];
-      }
-        
-      if (0 == j && 0 == k) {
-        return Calculate(i);
+      uint64_t code = PackHoles(i, j, 0, 0, 0);
+      const SortedSignatureSet<Key> *found = memo_.Find(code);
+      if (nullptr != found) {
+        return *found;
       }
 
+      const SortedSignatureSet<Key> &ones = Calculate(i);
+      const SortedSignatureSet<Key> &twos = CalculateFixed(2, j);
+      const SortedSignatureSet<Key> &split = Calculate(i + 2, j - 1);
+      SetProduct(ones, twos);
+      SetUnion(split);
+      return Store(memo_.Insert(code));
+    }
+
+    const SortedSignatureSet<Key> &Calculate(int i, int j, int k) {
       if (0 == k) {
         return Calculate(i, j);
       }
 
-      SetProduct(Calculate(i, j), CalculateFixed(3, k),
-                 &buffer_[index]);
-      SetUnion(Calculate(i + 1, j + 1, k - 1),
-               &buffer_[index]);
-      return buffer_[index];
+      uint64_t code = PackHoles(i, j, k, 0, 0);
+      const SortedSignatureSet<Key> *found = memo_.Find(code);
+      if (nullptr != found) {
+        return *found;
+      }
+
+      const SortedSignatureSet<Key> &lower = Calculate(i, j);
+      const SortedSignatureSet<Key> &threes = CalculateFixed(3, k);
+      const SortedSignatureSet<Key> &split = Calculate(i + 1, j + 1, k - 1);
+      SetProduct(lower, threes);
+      SetUnion(split);
+      return Store(memo_.Insert(code));
     }
 
-    const std::unordered_set<Signature> &Calculate(int i, int j, int k, 
-                                                   int extra, int multiplier) {
-      const std::unordered_set<Signature> &base_answer = Calculate(i, j, k);
+    const SortedSignatureSet<Key> &Calculate(int i, int j, int k, 
+                                        int extra, int multiplier) {
       if (2 > multiplier || 0 == extra) {
-        return base_answer;
+        return Calculate(i, j, k);
       }
 
-      int index = ((((multiplier -1) * 3 + (extra - 1)) * MAX_THREES + k) * MAX_TWOS 
-                   + j) * MAX_ONES + i;
-
-      if (!buffer_[index].empty()) {
-        return buffer_[index];
+      uint64_t code = PackHoles(i, j, k, extra, multiplier);
+      const SortedSignatureSet<Key> *found = memo_.Find(code);
+      if (nullptr != found) {
+        return *found;
       }
       
-      const std::unordered_set<Signature> &extension = 
+      const SortedSignatureSet<Key> &base_answer = Calculate(i, j, k);
+      const SortedSignatureSet<Key> &extension = 
         1 == extra ? Calculate(1, 0, 0) :
         (2 == extra ? Calculate(0, 1, 0) : Calculate(0, 0, 1));
       
-      std::unordered_set<Signature> transformed;
-      
-      for (Signature key : extension) {
+      std::vector<Key> transformed;
+      transformed.reserve(extension.size());
+      for (Key key : extension) {
         key.BodyRefactor(multiplier);
-        transformed.insert(key);
+        transformed.push_back(key);
       }
       
-      SetProduct(base_answer, transformed, &buffer_[index]);
-      return buffer_[index];
+      SetProduct(base_answer, transformed);
+      return Store(memo_.Insert(code));
+    }
+
+    const SortedSignatureSet<Key> &CalculateFrontier(int i, int j, int k,
+                                                int extra, 
+                                                int multiplier) {
+      uint64_t code = PackHoles(i, j, k, extra, multiplier) | FRONTIER;
+      const SortedSignatureSet<Key> *found = memo_.Find(code);
+      if (nullptr != found) {
+        return *found;
+      }
+
+      const SortedSignatureSet<Key> &all = Calculate(i, j, k, extra, multiplier);
+
+      std::vector<Key> kept(all.begin(), all.end());
+      RemoveDominated(&kept);
+      for (const Key &key : kept) {
+        scratch_.insert(key);
+      }
+      return Store(memo_.Insert(code));
     }
 
-    void DFS(int i, int j, int k, int holes, int id, Signature key,
-             const std::array<std::vector<Signature>, 4> &jewels,
-             std::unordered_set<Signature> *result) {
+    static void DFS(int i, int j, int k, int holes, int id, 
+                    Key key,
+                    const std::array<std::vector<Key>, 4> &jewels,
+                    SignatureSet<Key> *result) {
       result->insert(key);
       if (0 == i + j + k) {
         return;
@@ -295,15 +541,305 @@ namespace monster_avengers {
       } while (p > 0);
     }
 
+    // Keeps the jewel list alive (and its address unique) for the
+    // keys of HoleTableCache.
+    std::shared_ptr<const std::vector<Jewel> > jewels_;
+    std::array<SignatureSet<Key>, 4> jewel_keys_;
+    HoleMemo<SortedSignatureSet<Key>> fixed_memo_;
+    HoleMemo<SortedSignatureSet<Key>> memo_;
+    // The answers of Get() so far, by the codes of its arguments.
+    PublishedHoles<SortedSignatureSet<Key>> published_;
+    // Collects the keys of the entry being computed.
+    SignatureSet<Key> scratch_;
+    std::atomic<size_t> bytes_;
+    std::mutex mutex_;
+  };
+
+  struct HoleCacheStats {
+    int64_t hits;
+    int64_t misses;
+    int64_t evictions;
+    // Number of cached tables.
+    size_t size;
+    // Approximate bytes held by the cached tables.
+    size_t bytes;
+
+    HoleCacheStats() 
+      : hits(0), misses(0), evictions(0), size(0), bytes(0) {}
+  };
+
+  // HoleTableCache keeps the HoleTables of the recent searches, so that
+  // the popular skill combinations do not recompute the same jewel
+  // combinations on every query. A table only depends on the jewel
+  // list, the ordered skills of the query and the Signature width
+  // (which lay out the Signatures), the skills whose jewels are
+  // considered, and the blacklist of the JewelFilter, which make up
+  // the key. 
+  //
+  // The tables keep growing after they are cached, so the budget of
+  // max_bytes is checked whenever a table is requested, by evicting
+  // the least recently used tables until the rest fits. Evicted
+  // tables live on until their last user is done with them.
+  class HoleTableCache {
+  public:
+    const static size_t DEFAULT_MAX_BYTES = 128 << 20;
+
+    explicit HoleTableCache(size_t max_bytes = DEFAULT_MAX_BYTES)
+      : max_bytes_(max_bytes), entries_(), index_(), stats_(), mutex_() {}
+
+    // The cache shared by the whole process.
+    static HoleTableCache &Global() {
+      static HoleTableCache cache;
+      return cache;
+    }
+
+    template <typename Key>
+    std::shared_ptr<HoleTable<Key> > Get(const DataSet &data, 
+                                         const std::vector<int> &skill_ids,
+                                         const std::vector<Effect> &effects, 
+                                         const JewelFilter &filter) {
+      std::string key = CacheKey(data, skill_ids, effects, filter, 
+                                 Key::BYTES);
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::shared_ptr<HoleTable<Key> > table;
+      auto it = index_.find(key);
+      if (index_.end() != it) {
+        stats_.hits++;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        table = std::static_pointer_cast<HoleTable<Key> >(
+            it->second->second);
+      } else {
+        stats_.misses++;
+        table = std::make_shared<HoleTable<Key> >(data, skill_ids, 
+                                                  effects, filter);
+        if (0 == max_bytes_) return table;
+        entries_.emplace_front(key, table);
+        index_[key] = entries_.begin();
+      }
+      Shrink();
+      return table;
+    }
+
+    // A budget of 0 disables the cache.
+    void SetMaxBytes(size_t max_bytes) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      max_bytes_ = max_bytes;
+      Shrink();
+    }
+
+    void Clear() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      entries_.clear();
+      index_.clear();
+    }
+
+    HoleCacheStats Stats() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      HoleCacheStats stats = stats_;
+      stats.size = entries_.size();
+      stats.bytes = Bytes();
+      return stats;
+    }
+
+  private:
+    typedef std::list<std::pair<std::string, 
+                                std::shared_ptr<HoleTableBase> > > EntryList;
+
+    static std::string CacheKey(const DataSet &data, 
+                                const std::vector<int> &skill_ids,
+                                const std::vector<Effect> &effects, 
+                                const JewelFilter &filter,
+                                int bytes) {
+      std::vector<int> considered(skill_ids);
+      std::sort(considered.begin(), considered.end());
+      considered.erase(std::unique(considered.begin(), considered.end()),
+                       considered.end());
+      std::vector<int> blacklist(filter.blacklist.begin(), 
+                                 filter.blacklist.end());
+      std::sort(blacklist.begin(), blacklist.end());
+
+      std::vector<int> fields;
+      fields.reserve(effects.size() + considered.size() + 
+                     blacklist.size() + 4);
+      fields.push_back(bytes);
+      for (const Effect &effect : effects) {
+        fields.push_back(effect.skill_id);
+      }
+      fields.push_back(-1);
+      fields.insert(fields.end(), considered.begin(), considered.end());
+      fields.push_back(-1);
+      fields.insert(fields.end(), blacklist.begin(), blacklist.end());
+
+      const std::vector<Jewel> *jewels = &data.jewels();
+      std::string key(reinterpret_cast<const char*>(&jewels), 
+                      sizeof(jewels));
+      key.append(reinterpret_cast<const char*>(fields.data()),
+                 fields.size() * sizeof(int));
+      return key;
+    }
+
+    size_t Bytes() const {
+      size_t bytes = 0;
+      for (const auto &entry : entries_) {
+        bytes += entry.second->MemoryUsage();
+      }
+      return bytes;
+    }
+
+    void Shrink() {
+      size_t bytes = Bytes();
+      while (!entries_.empty() && bytes > max_bytes_) {
+        bytes -= entries_.back().second->MemoryUsage();
+        index_.erase(entries_.back().first);
+        entries_.pop_back();
+        stats_.evictions++;
+      }
+    }
+
+    size_t max_bytes_;
+    // Most recently used first.
+    EntryList entries_;
+    std::unordered_map<std::string, EntryList::iterator> index_;
+    HoleCacheStats stats_;
+    std::mutex mutex_;
+  };
+
+  // HoleClient answers the hole alignment queries of a single search
+  // from a HoleTable of HoleTableCache::Global(), either with all the
+  // jewel combinations, or with their frontiers. It remembers the
+  // answers it has seen in a local memo, so that the shared table
+  // (and its lock) is only visited once per alignment.
+  template <typename Key>
+  class HoleClient {
+  public:
+    HoleClient(const DataSet &data, 
+               const std::vector<int> &skill_ids,
+               const std::vector<Effect> &effects, 
+	       const JewelFilter &filter,
+               bool frontier = false)
+      : table_(HoleTableCache::Global().template Get<Key>(data, skill_ids, 
+                                            effects, filter)),
+        frontier_(frontier), local_() {}
+    
+    HoleClient(const DataSet &data, 
+               const std::vector<Effect> &effects, 
+	       const JewelFilter &filter,
+               bool frontier = false) 
+      : HoleClient(data, SkillIdsFromEffects(effects), effects, filter,
+                   frontier) {}
+    
+    HoleClient(const DataSet &data, int skill_id, 
+               const std::vector<Effect> &effects, 
+	       const JewelFilter &filter,
+               bool frontier = false) 
+      : HoleClient(data, std::vector<int>({skill_id}), 
+                   effects, filter, frontier) {}
     
-    std::array<std::unordered_set<Signature>, 4> jewel_keys_;
-    std::array<std::array<std::unordered_set<Signature>, 
-                          MAX_ONES>, 4> fixed_buffer_;
-    std::array<std::unordered_set<Signature>, 
-               MAX_ONES * MAX_TWOS * MAX_THREES * 3 * 5> buffer_;
+    inline const SortedSignatureSet<Key> &Query(Key input) {
+      int i(0), j(0), k(0);
+      sig::KeyHoles(input, &i, &j, &k);
+      return Query(i, j, k, input.BodyHoleSum(), input.multiplier());
+    }
+
+    inline const SortedSignatureSet<Key> &Query(int i, 
+                                           int j, 
+                                           int k,
+                                           int extra,
+                                           int multiplier) {
+      if (2 > multiplier) extra = 0;
+      if (0 == extra) multiplier = 0;
+      uint64_t code = PackHoles(i, j, k, extra, multiplier);
+      const SortedSignatureSet<Key> *const *found = local_.Find(code);
+      if (nullptr != found) {
+        return **found;
+      }
+      const SortedSignatureSet<Key> &answer = 
+        table_->Get(i, j, k, extra, multiplier, frontier_);
+      *local_.Insert(code) = &answer;
+      return answer;
+    }
+
+    inline bool frontier() const {
+      return frontier_;
+    }
+
+    inline HoleTable<Key> &table() {
+      return *table_;
+    }
+
+    // Use the hole aligment from stuffed to stuff the original hole
+    // aligment, and get the residual hole alignment.
+    static void GetResidual(const Key &original, 
+                            const Key &stuffed,
+                            int *i, int *j, int *k, int *extra) {
+      sig::KeyHoles(original, i, j, k);
+      int one(0), two(0), three(0);
+      sig::KeyHoles(stuffed, &one, &two, &three);
+
+      // Handle 3 holes
+      *k -= three;
+
+      // Handle 2 holes
+      if (two <= *j) {
+        *j -= two;
+      } else {
+        two -= *j;
+        *j = 0;
+        *k -= two;
+        *i += two;
+      }
+
+      if (one <= *i) {
+        *i -= one;
+      } else {
+        one -= *i;
+        *i = 0;
+        if (one <= ((*j) << 1)) {
+          *j -= ((one + 1) >> 1);
+          if (1 & one) {
+            *i = 1;
+          }
+        } else {
+          one -= (*j << 1);
+          *j = 0;
+          *k -= ((one + 2) / 3);
+          int remain = one % 3;
+          if (1 == remain) {
+            (*j)++;
+          } else if (2 == remain) {
+            (*i)++;
+          }
+        }
+      }
+
+      // Handle Extra:
+      *extra = original.BodyHoleSum() - stuffed.BodyHoleSum();
+    }
+
+    // This is only for unit test purpose.
+    SignatureSet<Key> DFS(int i, int j, int k) const {
+      return table_->DFS(i, j, k);
+    }
+
+  private:
+    static std::vector<int> SkillIdsFromEffects(
+        const std::vector<Effect> &effects) {
+      std::vector<int> skill_ids;
+      for (const Effect &effect : effects) {
+        skill_ids.push_back(effect.skill_id);
+      }
+      return skill_ids;
+    }
+
+    std::shared_ptr<HoleTable<Key> > table_;
+    // Whether the queries are answered by the frontiers.
+    bool frontier_;
+    HoleMemo<const SortedSignatureSet<Key>*> local_;
   };
 
 
+  // JewelSolver works on the keys of the output (see ArmorSet), which
+  // are always WideSignatures.
   class JewelSolver {
   public:
     typedef std::pair<std::unordered_map<int, int>, 
@@ -323,7 +859,7 @@ namespace monster_avengers {
       for (int i = 0; i < data.jewels().size(); ++i) {
 	if (filter.Validate(data, i)) {
 	  const Jewel &jewel = data.jewel(i);
-	  Signature key = Signature(jewel, skill_ids, effects, &valid);
+	  WideSignature key = WideSignature(jewel, skill_ids, effects, &valid);
 	  if (valid) {
 	    jewel_keys_[jewel.holes].push_back(key);
 	    jewel_ids_[jewel.holes].push_back(i);
@@ -332,8 +868,8 @@ namespace monster_avengers {
       }
     }
 
-    JewelPlan Solve(Signature key, int multiplier) const {
-      Signature target = sig::InverseKey(key);
+    JewelPlan Solve(WideSignature key, int multiplier) const {
+      WideSignature target = sig::InverseKey(key);
       int i(0), j(0), k(0);
       sig::KeyHoles(key, &i, &j, &k);
       std::vector<int> ids;
@@ -391,7 +927,7 @@ namespace monster_avengers {
     
     bool Search(const std::vector<SearchCriteria> &targets,
                 int top, int criteria_id, int jewel_id, 
-                Signature key, 
+                WideSignature key, 
                 std::vector<int> *ids, 
                 std::vector<int> *body_ids) const {
       if (-1 == top) return key.IsZero();
@@ -403,7 +939,7 @@ namespace monster_avengers {
       const int &holes = targets[top].holes;
       const int &multiplier = targets[top].multiplier;
       for (int seq = jewel_id; seq < jewel_ids_[holes].size(); ++seq) {
-        Signature jewel_key = jewel_keys_[holes][seq];
+        WideSignature jewel_key = jewel_keys_[holes][seq];
         if (multiplier > 1) {
           body_ids->push_back(jewel_ids_[holes][seq]);
           jewel_key *= multiplier;
@@ -423,7 +959,7 @@ namespace monster_avengers {
       return false;
     }
     
-    std::array<std::vector<Signature>, 4> jewel_keys_;
+    std::array<std::vector<WideSignature>, 4> jewel_keys_;
     std::array<std::vector<int>, 4> jewel_ids_;
   };
 
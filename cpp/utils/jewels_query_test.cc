@@ -0,0 +1,94 @@
+#include <random>
+#include <vector>
+
+#include "utils/jewels_query.h"
+#include "supp/helpers.h"
+
+using namespace monster_avengers;
+
+namespace {
+  // The quadratic definition: a key stays if no other key dominates
+  // it, and it is the first of its duplicates.
+  template <typename Key>
+  std::vector<Key> BruteForceRemoveDominated(const std::vector<Key> &keys) {
+    std::vector<Key> result;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      bool removed = false;
+      for (size_t j = 0; j < keys.size() && !removed; ++j) {
+        if (i == j || !sig::Dominates(keys[j], keys[i])) continue;
+        removed = !(keys[j] == keys[i]) || j < i;
+      }
+      if (!removed) result.push_back(keys[i]);
+    }
+    return result;
+  }
+
+  template <typename Key>
+  Key MakeKey(int one, int two, int three, std::vector<int> points) {
+    Key key = sig::HolesToKey<Key>(one, two, three);
+    for (size_t effect = 0; effect < points.size(); ++effect) {
+      key = sig::AddPoints(key, static_cast<int>(effect), points[effect]);
+    }
+    return key;
+  }
+
+  // RandomTest: agrees with the brute force on lists with a few hole
+  // alignments, small (possibly negative) points and many duplicates.
+  template <typename Key>
+  void RandomTest(std::mt19937 *generator) {
+    std::uniform_int_distribution<int> holes(0, 1);
+    std::uniform_int_distribution<int> points(-2, 2);
+    std::uniform_int_distribution<int> length(0, 60);
+    for (int round = 0; round < 500; ++round) {
+      std::vector<Key> keys;
+      int size = length(*generator);
+      for (int i = 0; i < size; ++i) {
+        std::vector<int> effects;
+        for (int effect = 0; effect < 3; ++effect) {
+          effects.push_back(points(*generator));
+        }
+        keys.push_back(MakeKey<Key>(holes(*generator), holes(*generator),
+                                    0, effects));
+      }
+      std::vector<Key> expected = BruteForceRemoveDominated(keys);
+      RemoveDominated(&keys);
+      CHECK(expected.size() == keys.size());
+      for (size_t i = 0; i < keys.size(); ++i) {
+        CHECK(expected[i] == keys[i]);
+      }
+    }
+  }
+}  // namespace
+
+int main() {
+  // RemoveDominatedTest: only the dominated keys and the later
+  // duplicates go, the rest keep their order. Keys with different
+  // holes never dominate each other.
+  {
+    std::vector<Signature> keys = {
+      MakeKey<Signature>(1, 0, 0, {1, 0, 2}),
+      MakeKey<Signature>(1, 0, 0, {2, 1, 2}),
+      MakeKey<Signature>(0, 1, 0, {0, 0, 0}),
+      MakeKey<Signature>(1, 0, 0, {3, -1, 0}),
+      MakeKey<Signature>(1, 0, 0, {2, 1, 2}),
+      MakeKey<Signature>(0, 1, 0, {-1, 0, 0}),
+      MakeKey<Signature>(0, 0, 0, {5, 5, 5}),
+    };
+    std::vector<Signature> expected = {keys[1], keys[2], keys[3], keys[6]};
+    RemoveDominated(&keys);
+    CHECK(expected.size() == keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      CHECK(expected[i] == keys[i]);
+    }
+
+    std::vector<Signature> single = {keys[0]};
+    RemoveDominated(&single);
+    CHECK(1 == single.size());
+  }
+
+  std::mt19937 generator(1);
+  RandomTest<SmallSignature>(&generator);
+  RandomTest<Signature>(&generator);
+  RandomTest<WideSignature>(&generator);
+  return 0;
+}
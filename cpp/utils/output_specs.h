@@ -26,7 +26,8 @@ namespace monster_avengers {
   
   struct ArmorSet {
     std::array<int, PART_NUM> ids;
-    std::vector<Signature> jewel_keys;
+    // Widened from the Signatures of the search.
+    std::vector<WideSignature> jewel_keys;
   };
 
   struct AmuletEffect : public lisp::Formattable {
@@ -248,7 +249,7 @@ namespace monster_avengers {
       }
 
       // Combine Jewel Effects
-      for (const Signature &jewel_key : armor_set.jewel_keys) {
+      for (const WideSignature &jewel_key : armor_set.jewel_keys) {
         if (plans.size() >= MAX_JEWEL_PLANS) break;
         plans.emplace_back(data, solver.Solve(jewel_key, multiplier), 
                            multiplier,
@@ -347,7 +348,7 @@ namespace monster_avengers {
                         });
       
       plans.clear();
-      for (const Signature &jewel_key : armor_set.jewel_keys) {
+      for (const WideSignature &jewel_key : armor_set.jewel_keys) {
         if (plans.size() >= MAX_JEWEL_PLANS) break;
         plans.emplace_back();
         const JewelSolver::JewelPlan jewel_plan = 
@@ -1,6 +1,8 @@
 #ifndef _MONSTER_AVENGERS_QUERY_
 #define _MONSTER_AVENGERS_QUERY_
 
+#include <algorithm>
+#include <cstdint>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
@@ -26,10 +28,19 @@ struct Query {
     MAX_RESULTS,
     BLACKLIST,
     JEWEL_BLACKLIST,
-    GENDER
+    GENDER,
+    JEWEL_FRONTIER,
+    COUNT,
+    SAMPLE,
+    ANYTIME,
+    EXPLAIN
   };
 
   static const std::unordered_map<std::wstring, Command> COMMAND_TRANSLATOR;
+
+  // The most skills a query can have, as many as a WideSignature
+  // holds.
+  static const int MAX_EFFECTS = 29;
     
   std::vector<Effect> effects;
   std::vector<Armor> amulets;
@@ -37,8 +48,29 @@ struct Query {
   int max_results;
   ArmorFilter armor_filter;
   JewelFilter jewel_filter;
+  // Whether the search drops a jewel combination when another one
+  // takes the same holes with at least as many points on every
+  // skill. The armor sets are the same, with fewer alternative jewel
+  // plans.
+  bool jewel_frontier;
+  // Whether the query asks for the number of armor sets instead of
+  // the armor sets.
+  bool count;
+  // Whether the max_results armor sets are drawn uniformly at random
+  // (with the given seed) instead of taken by defense.
+  bool sample;
+  int seed;
+  // Whether the armor sets are streamed as soon as their trees are
+  // found, ranked by defense within each tree only, instead of
+  // waiting for the whole forest to rank them all.
+  bool anytime;
+  // Whether the query asks for the plan of its search (the order of
+  // its skills and the work of each stage) instead of the armor sets.
+  bool explain;
     
-  Query() : effects(), defense(0), armor_filter() {}
+  Query() : effects(), defense(0), armor_filter(), jewel_frontier(false),
+            count(false), sample(false), seed(0), anytime(false),
+            explain(false) {}
 
   // Implies conversion from string as well.
   static Status Parse(const std::wstring &query_text, Query *query) {
@@ -46,6 +78,12 @@ struct Query {
     query->effects.clear();
     query->amulets.clear();
     query->max_results = 10; // by default we are expecting 10 results.
+    query->jewel_frontier = false;
+    query->count = false;
+    query->sample = false;
+    query->seed = 0;
+    query->anytime = false;
+    query->explain = false;
 
     // Armor Filter
     query->armor_filter.weapon_type = MELEE;
@@ -68,6 +106,7 @@ struct Query {
     std::vector<Effect> effects;
     std::vector<int> nums;
     int holes;
+    int flag = 0;
 
     while (tokenizer.Next(&token)) {
       if (lisp::OPEN_PARENTHESIS != token.name) {
@@ -84,6 +123,9 @@ struct Query {
           status = ReadInt(&tokenizer, &skill_points);
           if (!status.Success()) return status;
           query->effects.emplace_back(skill_id, skill_points);
+          if (query->effects.size() > MAX_EFFECTS) {
+            return Status(FAIL, "Query: Too many skills.");
+          }
           break;
         case DEFENSE:
           status = ReadInt(&tokenizer, &query->defense);
@@ -138,6 +180,29 @@ struct Query {
             query->jewel_filter.blacklist.insert(i);
           }
           break;
+        case JEWEL_FRONTIER:
+          status = ReadInt(&tokenizer, &flag);
+          if (!status.Success()) return status;
+          query->jewel_frontier = (0 != flag);
+          break;
+        case COUNT:
+          status = ReadInt(&tokenizer, &flag);
+          if (!status.Success()) return status;
+          query->count = (0 != flag);
+          break;
+        case SAMPLE:
+          status = ReadInt(&tokenizer, &query->seed);
+          if (!status.Success()) return status;
+          query->sample = true;
+          break;
+        case ANYTIME:
+          status = ReadInt(&tokenizer, &flag);
+          if (!status.Success()) return status;
+          query->anytime = (0 != flag);
+          break;
+        case EXPLAIN:
+          query->explain = true;
+          break;
         default:
           return Status(FAIL, "Query: Invalid command.");
       }
@@ -166,9 +231,77 @@ struct Query {
     max_results = other.max_results;
     amulets = other.amulets;
     armor_filter = other.armor_filter;
+    jewel_filter = other.jewel_filter;
+    jewel_frontier = other.jewel_frontier;
+    count = other.count;
+    sample = other.sample;
+    seed = other.seed;
+    anytime = other.anytime;
+    explain = other.explain;
     return *this;
   }
 
+  // The normalized text of the query, the same for the queries that
+  // only differ in the order of their skills, amulets, skill points
+  // of an amulet and blacklists, or in the commands left at their
+  // default. It is a query itself and parses back to an equal query.
+  std::wstring Canonical() const {
+    std::vector<Effect> sorted_effects(effects);
+    std::sort(sorted_effects.begin(), sorted_effects.end(), EffectLess);
+    std::wstring result;
+    for (const Effect &effect : sorted_effects) {
+      result += L"(:skill " + std::to_wstring(effect.skill_id) + L" " +
+        std::to_wstring(effect.points) + L")";
+    }
+    result += L"(:defense " + std::to_wstring(defense) + L")";
+    result += L"(:weapon-type \"";
+    result += (MELEE == armor_filter.weapon_type) ? L"melee" : L"range";
+    result += L"\")(:weapon-holes " + 
+      std::to_wstring(armor_filter.weapon_holes) + L")";
+    result += L"(:rare " + std::to_wstring(armor_filter.min_rare) + L")";
+    result += L"(:max-rare " + std::to_wstring(armor_filter.max_rare) + L")";
+    result += L"(:gender \"";
+    result += (FEMALE == armor_filter.gender) ? L"female" : L"male";
+    result += L"\")(:max-results " + std::to_wstring(max_results) + L")";
+    std::vector<std::wstring> amulet_texts;
+    for (const Armor &amulet : amulets) {
+      std::vector<Effect> amulet_effects(amulet.effects);
+      std::sort(amulet_effects.begin(), amulet_effects.end(), EffectLess);
+      std::wstring text = L"(:amulet " + std::to_wstring(amulet.holes) + 
+        L" (";
+      for (size_t i = 0; i < amulet_effects.size(); ++i) {
+        if (0 < i) text += L" ";
+        text += std::to_wstring(amulet_effects[i].skill_id) + L" " +
+          std::to_wstring(amulet_effects[i].points);
+      }
+      amulet_texts.push_back(text + L"))");
+    }
+    std::sort(amulet_texts.begin(), amulet_texts.end());
+    for (const std::wstring &text : amulet_texts) result += text;
+    if (!armor_filter.blacklist.empty()) {
+      result += L"(:blacklist " + SortedList(armor_filter.blacklist) + L")";
+    }
+    if (!jewel_filter.blacklist.empty()) {
+      result += L"(:ban-jewels " + SortedList(jewel_filter.blacklist) + L")";
+    }
+    if (jewel_frontier) result += L"(:jewel-frontier 1)";
+    if (count) result += L"(:count 1)";
+    if (sample) result += L"(:sample " + std::to_wstring(seed) + L")";
+    if (anytime) result += L"(:anytime 1)";
+    if (explain) result += L"(:explain)";
+    return result;
+  }
+
+  // A 64-bit FNV-1a hash of Canonical(), for keying the queries.
+  uint64_t Fingerprint() const {
+    uint64_t hash = 14695981039346656037ULL;
+    for (wchar_t c : Canonical()) {
+      hash ^= static_cast<uint64_t>(c);
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+
   bool HasSkill(int skill_id) const {
     for (const Effect &effect : effects) {
       if (skill_id == effect.skill_id) return true;
@@ -198,6 +331,22 @@ struct Query {
   }
 
  private:
+  static bool EffectLess(const Effect &a, const Effect &b) {
+    return a.skill_id < b.skill_id || 
+      (a.skill_id == b.skill_id && a.points < b.points);
+  }
+
+  static std::wstring SortedList(const std::unordered_set<int> &ids) {
+    std::vector<int> sorted(ids.begin(), ids.end());
+    std::sort(sorted.begin(), sorted.end());
+    std::wstring result = L"(";
+    for (size_t i = 0; i < sorted.size(); ++i) {
+      if (0 < i) result += L" ";
+      result += std::to_wstring(sorted[i]);
+    }
+    return result + L")";
+  }
+
   static Status ReadInt(lisp::Tokenizer *tokenizer, int *number) {
     lisp::Token token;
     if (!tokenizer->Next(&token)) {
@@ -295,6 +444,11 @@ Query::COMMAND_TRANSLATOR =
  {L"blacklist", BLACKLIST},
  {L"gender", GENDER},
  {L"ban-jewels", JEWEL_BLACKLIST},
+ {L"jewel-frontier", JEWEL_FRONTIER},
+ {L"count", COUNT},
+ {L"sample", SAMPLE},
+ {L"anytime", ANYTIME},
+ {L"explain", EXPLAIN},
 };
 }
 
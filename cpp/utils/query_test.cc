@@ -0,0 +1,52 @@
+#include <string>
+#include <vector>
+
+#include "utils/query.h"
+#include "supp/helpers.h"
+
+using namespace monster_avengers;
+
+namespace {
+  Query ParseOrDie(const std::wstring &text) {
+    Query query;
+    CHECK_SUCCESS(Query::Parse(text, &query));
+    return query;
+  }
+}  // namespace
+
+int main() {
+  // PermutationTest: the order of the skills, the amulets (and their
+  // effects), the blacklist and the banned jewels does not matter.
+  Query a = ParseOrDie(L"(:skill 3 10) (:skill 1 15) "
+                       L"(:amulet 2 (5 3 1 4)) (:amulet 1 (2 2)) "
+                       L"(:blacklist (9 3 7)) (:ban-jewels (4 1)) "
+                       L"(:defense 100)");
+  Query b = ParseOrDie(L"(:blacklist (7 9 3)) (:amulet 1 (2 2)) "
+                       L"(:skill 1 15) (:ban-jewels (1 4)) (:defense 100) "
+                       L"(:amulet 2 (1 4 5 3)) (:skill 3 10)");
+  CHECK(a.Canonical() == b.Canonical());
+  CHECK(a.Fingerprint() == b.Fingerprint());
+
+  // DifferenceTest: any other difference changes the fingerprint.
+  Query c = ParseOrDie(L"(:skill 3 10) (:skill 1 15) "
+                       L"(:amulet 2 (5 3 1 4)) (:amulet 1 (2 2)) "
+                       L"(:blacklist (9 3 7)) (:ban-jewels (4 1)) "
+                       L"(:defense 101)");
+  CHECK(a.Fingerprint() != c.Fingerprint());
+  Query d = ParseOrDie(L"(:skill 3 10) (:skill 1 10)");
+  Query e = ParseOrDie(L"(:skill 3 10) (:skill 1 10) (:count 1)");
+  CHECK(d.Fingerprint() != e.Fingerprint());
+  
+  // RoundTripTest: the canonical form parses back to the same query.
+  Query f = ParseOrDie(L"(:skill 3 10) (:skill 1 15) (:sample 5) "
+                       L"(:count 1) (:anytime 1) (:jewel-frontier 1) "
+                       L"(:gender \"female\") (:weapon-type \"range\") "
+                       L"(:weapon-holes 2) (:max-results 7)");
+  for (const Query &query : {a, c, d, e, f}) {
+    Query parsed = ParseOrDie(query.Canonical());
+    CHECK(parsed.Canonical() == query.Canonical());
+    CHECK(parsed.Fingerprint() == query.Fingerprint());
+  }
+
+  return 0;
+}
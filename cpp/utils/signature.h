@@ -1,15 +1,25 @@
 #ifndef _MONSTER_AVENGERS_SIGNATURE_
 #define _MONSTER_AVENGERS_SIGNATURE_
 
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
 #include <functional>
 #include "data/data_set.h"
 #include "utils/query.h"
 
+// The Signature arithmetic uses SSE2 when available. Define
+// MONSTER_AVENGERS_NO_SIMD to force the byte by byte implementation.
+#if (defined(__SSE2__) || defined(_M_X64)) && \
+  !defined(MONSTER_AVENGERS_NO_SIMD)
+#define MONSTER_AVENGERS_SSE2 1
+#include <emmintrin.h>
+#endif
+
 namespace monster_avengers {
 
-  // Signature is a 16 bytes (128 bit) unsigned integer, internally
-  // represented as a length-16 char array. Where the encoding
+  // A Signature is a Bytes bytes unsigned integer, internally
+  // represented as a length-Bytes char array. Where the encoding
   // follows:
   // 
   // byte 0: number of 1-slots [8]
@@ -22,16 +32,27 @@ namespace monster_avengers {
   // byte 3+: number of points for corresponding skill system [8]
   //
   // Notes: [x] stands for x bits in the byte.
-  struct Signature {
+  //
+  // The width only bounds the number of skills: a query is searched
+  // with the narrowest Signature that holds all of its skills (see
+  // sig::BytesFor()).
+  template <int Bytes>
+  struct BasicSignature {
+    static_assert(8 == Bytes || 16 == Bytes || 32 == Bytes,
+                  "Signatures are 8, 16 or 32 bytes wide.");
+    static const int BYTES = Bytes;
     static const int EFFECTS_BEGIN = 3;
-    char bytes[16];
+    // Number of skills that the Signature holds.
+    static const int MAX_EFFECTS = Bytes - EFFECTS_BEGIN;
+    char bytes[Bytes];
 
-    inline Signature() {
-      memset(bytes, 0, sizeof(Signature));
+    inline BasicSignature() {
+      memset(bytes, 0, Bytes);
     }
 
-    inline Signature(const Armor &armor, const std::vector<Effect> &effects) 
-      : Signature() {
+    inline BasicSignature(const Armor &armor, 
+                          const std::vector<Effect> &effects) 
+      : BasicSignature() {
       if (armor.TorsoUp()) {
         // Torso up armors are not allowedto have holes and effects.
         bytes[2] = 1;
@@ -61,11 +82,11 @@ namespace monster_avengers {
       }
     }
 
-    inline Signature(const Jewel &jewel, 
-              const std::vector<int> &skill_ids,
-              const std::vector<Effect> &effects,
-              bool *valid)
-      : Signature() {
+    inline BasicSignature(const Jewel &jewel, 
+                          const std::vector<int> &skill_ids,
+                          const std::vector<Effect> &effects,
+                          bool *valid)
+      : BasicSignature() {
       *valid = false;
 
       for (int skill_id : skill_ids) {
@@ -99,6 +120,14 @@ namespace monster_avengers {
       }
     }
 
+    // Converts a Signature of another width. The effects beyond the
+    // narrower of the two are dropped (or zero).
+    template <int OtherBytes>
+    inline explicit BasicSignature(const BasicSignature<OtherBytes> &other)
+      : BasicSignature() {
+      memcpy(bytes, other.bytes, (std::min)(Bytes, OtherBytes));
+    }
+
     // ---------- Signature Methods ----------
 
     void ShowMetaInfo() const {
@@ -127,9 +156,7 @@ namespace monster_avengers {
         bytes[0] = 0;
         bytes[1] = 0;
         
-        for (int i = EFFECTS_BEGIN; i < sizeof(Signature); ++i) {
-          bytes[i] *= multiplier;
-        }
+        *this *= multiplier;
       }
     }
 
@@ -155,51 +182,291 @@ namespace monster_avengers {
       return static_cast<int>(bytes[2] & 0x07);
     }
 
-    bool IsZero() const {
-      for (int i = 0; i < sizeof(Signature); ++i) {
-        if (bytes[i] != 0) return false;
-      }
-      return true;
-    }
+    inline bool IsZero() const;
 
     inline int PointsAt(int id) const {
       return bytes[3 + id];
     }
 
-    bool operator==(const Signature &other) const {
-      for (int i = 0; i < sizeof(Signature); ++i) {
-        if (bytes[i] != other.bytes[i]) return false;
+    inline bool operator==(const BasicSignature &other) const;
+
+    // Multiplies the points (not the holes).
+    inline void operator*=(int multiplier);
+
+    inline void operator+=(const BasicSignature &other);
+  };
+
+  template <int Bytes> const int BasicSignature<Bytes>::BYTES;
+  template <int Bytes> const int BasicSignature<Bytes>::EFFECTS_BEGIN;
+  template <int Bytes> const int BasicSignature<Bytes>::MAX_EFFECTS;
+
+  typedef BasicSignature<8> SmallSignature;
+  typedef BasicSignature<16> Signature;
+  typedef BasicSignature<32> WideSignature;
+
+  static_assert(WideSignature::MAX_EFFECTS == Query::MAX_EFFECTS,
+                "The widest Signature must hold the skills of any query.");
+
+  namespace sig {
+    // Byte by byte implementation of the Signature arithmetic. It is
+    // the fallback when SSE2 is not available, and the reference for
+    // the tests and the benchmark.
+    namespace scalar {
+      template <int Bytes>
+      inline BasicSignature<Bytes> Add(const BasicSignature<Bytes> &a, 
+                                       const BasicSignature<Bytes> &b) {
+        BasicSignature<Bytes> key;
+        for (int i = 0; i < Bytes; ++i) {
+          key.bytes[i] =  a.bytes[i] + b.bytes[i];
+        }
+        return key;
       }
-      return true;
-    }
 
-    inline void operator*=(int multiplier) {
-      for (int i = EFFECTS_BEGIN; i < sizeof(Signature); ++i) {
-        bytes[i] *= multiplier;
+      // Adds the points, and leaves the holes empty.
+      template <int Bytes>
+      inline BasicSignature<Bytes> AddPoints(const BasicSignature<Bytes> &a, 
+                                             const BasicSignature<Bytes> &b) {
+        BasicSignature<Bytes> key;
+        for (int i = BasicSignature<Bytes>::EFFECTS_BEGIN; i < Bytes; ++i) {
+          key.bytes[i] = a.bytes[i] + b.bytes[i];
+        }
+        return key;
       }
-    }
 
-    inline void operator+=(const Signature &other) {
-      for (int i = 0; i < sizeof(Signature); ++i) {
-        bytes[i] += other.bytes[i];
+      template <int Bytes>
+      inline BasicSignature<Bytes> Multiply(const BasicSignature<Bytes> &a, 
+                                            int multiplier) {
+        BasicSignature<Bytes> key = a;
+        for (int i = BasicSignature<Bytes>::EFFECTS_BEGIN; i < Bytes; ++i) {
+          key.bytes[i] *= multiplier;
+        }
+        return key;
       }
-    }
-  };
 
-  inline Signature operator+(const Signature &a, const Signature &b) {
-    Signature key;
-    for (int i = 0; i < sizeof(Signature); ++i) {
-      key.bytes[i] =  a.bytes[i] + b.bytes[i];
-    }
-    return key;
+      template <int Bytes>
+      inline bool Equal(const BasicSignature<Bytes> &a, 
+                        const BasicSignature<Bytes> &b) {
+        for (int i = 0; i < Bytes; ++i) {
+          if (a.bytes[i] != b.bytes[i]) return false;
+        }
+        return true;
+      }
+
+      template <int Bytes>
+      inline bool IsZero(const BasicSignature<Bytes> &a) {
+        for (int i = 0; i < Bytes; ++i) {
+          if (a.bytes[i] != 0) return false;
+        }
+        return true;
+      }
+
+      template <int Bytes>
+      inline bool Satisfy(const BasicSignature<Bytes> &test, 
+                          const BasicSignature<Bytes> &inverse_target) {
+        for (int i = BasicSignature<Bytes>::EFFECTS_BEGIN; i < Bytes; ++i) {
+          if (test.bytes[i] + inverse_target.bytes[i] < 0) return false;
+        }
+        return true;
+      }
+
+      // Whether a takes the same holes as b, with at least as many
+      // points on every effect.
+      template <int Bytes>
+      inline bool Dominates(const BasicSignature<Bytes> &a, 
+                            const BasicSignature<Bytes> &b) {
+        for (int i = 0; i < BasicSignature<Bytes>::EFFECTS_BEGIN; ++i) {
+          if (a.bytes[i] != b.bytes[i]) return false;
+        }
+        for (int i = BasicSignature<Bytes>::EFFECTS_BEGIN; i < Bytes; ++i) {
+          if (a.bytes[i] < b.bytes[i]) return false;
+        }
+        return true;
+      }
+    }  // namespace scalar
+
+#if MONSTER_AVENGERS_SSE2
+    // The same operations with SSE2, on 16 bytes lanes. A
+    // SmallSignature is loaded into the lower half of a lane, whose
+    // upper half reads as zeros, which none of the operations can
+    // tell from zero points.
+    namespace sse2 {
+      // The bits of the effect bytes of the first lane in a
+      // _mm_movemask_epi8 result. The other lanes only hold effects.
+      const int EFFECTS_MOVEMASK = 
+        0xFFFF & ~((1 << Signature::EFFECTS_BEGIN) - 1);
+
+      template <int Bytes>
+      struct Lanes {
+        static const int COUNT = (Bytes + 15) / 16;
+      };
+
+      template <int Bytes>
+      inline __m128i Load(const BasicSignature<Bytes> &a, int lane) {
+        if (Bytes < 16) {
+          return _mm_loadl_epi64(reinterpret_cast<const __m128i*>(a.bytes));
+        }
+        return _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(a.bytes + 16 * lane));
+      }
+
+      template <int Bytes>
+      inline void Store(__m128i value, int lane, BasicSignature<Bytes> *key) {
+        if (Bytes < 16) {
+          _mm_storel_epi64(reinterpret_cast<__m128i*>(key->bytes), value);
+        } else {
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(key->bytes + 16 * lane),
+                           value);
+        }
+      }
+
+      inline int EffectsMovemask(int lane) {
+        return 0 == lane ? EFFECTS_MOVEMASK : 0xFFFF;
+      }
+
+      // 0xFF on the effect bytes, 0 on the hole bytes.
+      inline __m128i EffectsMask(int lane) {
+        if (0 == lane) {
+          return _mm_set_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 
+                              -1, -1, -1, -1, -1, 0, 0, 0);
+        }
+        return _mm_set1_epi8(-1);
+      }
+
+      template <int Bytes>
+      inline BasicSignature<Bytes> Add(const BasicSignature<Bytes> &a, 
+                                       const BasicSignature<Bytes> &b) {
+        BasicSignature<Bytes> key;
+        for (int lane = 0; lane < Lanes<Bytes>::COUNT; ++lane) {
+          Store(_mm_add_epi8(Load(a, lane), Load(b, lane)), lane, &key);
+        }
+        return key;
+      }
+
+      template <int Bytes>
+      inline BasicSignature<Bytes> AddPoints(const BasicSignature<Bytes> &a, 
+                                             const BasicSignature<Bytes> &b) {
+        BasicSignature<Bytes> key;
+        for (int lane = 0; lane < Lanes<Bytes>::COUNT; ++lane) {
+          Store(_mm_and_si128(_mm_add_epi8(Load(a, lane), Load(b, lane)),
+                              EffectsMask(lane)), lane, &key);
+        }
+        return key;
+      }
+
+      // SSE2 has no 8-bit multiplication, so the even and the odd
+      // bytes are multiplied as 16-bit lanes and recombined.
+      template <int Bytes>
+      inline BasicSignature<Bytes> Multiply(const BasicSignature<Bytes> &a, 
+                                            int multiplier) {
+        BasicSignature<Bytes> key;
+        __m128i factor = _mm_set1_epi16(static_cast<short>(multiplier));
+        for (int lane = 0; lane < Lanes<Bytes>::COUNT; ++lane) {
+          __m128i value = Load(a, lane);
+          __m128i even = _mm_mullo_epi16(value, factor);
+          __m128i odd = _mm_mullo_epi16(_mm_srli_epi16(value, 8), factor);
+          __m128i product = _mm_or_si128(
+              _mm_and_si128(even, _mm_set1_epi16(0x00FF)),
+              _mm_slli_epi16(odd, 8));
+          __m128i mask = EffectsMask(lane);
+          Store(_mm_or_si128(_mm_and_si128(mask, product),
+                             _mm_andnot_si128(mask, value)), lane, &key);
+        }
+        return key;
+      }
+
+      template <int Bytes>
+      inline bool Equal(const BasicSignature<Bytes> &a, 
+                        const BasicSignature<Bytes> &b) {
+        for (int lane = 0; lane < Lanes<Bytes>::COUNT; ++lane) {
+          if (0xFFFF != _mm_movemask_epi8(_mm_cmpeq_epi8(Load(a, lane), 
+                                                         Load(b, lane)))) {
+            return false;
+          }
+        }
+        return true;
+      }
+
+      template <int Bytes>
+      inline bool IsZero(const BasicSignature<Bytes> &a) {
+        for (int lane = 0; lane < Lanes<Bytes>::COUNT; ++lane) {
+          if (0xFFFF != _mm_movemask_epi8(
+                  _mm_cmpeq_epi8(Load(a, lane), _mm_setzero_si128()))) {
+            return false;
+          }
+        }
+        return true;
+      }
+
+      // The sum is saturated so that it keeps the sign of the exact
+      // (int) sum of the scalar version.
+      template <int Bytes>
+      inline bool Satisfy(const BasicSignature<Bytes> &test, 
+                          const BasicSignature<Bytes> &inverse_target) {
+        for (int lane = 0; lane < Lanes<Bytes>::COUNT; ++lane) {
+          __m128i sum = _mm_adds_epi8(Load(test, lane), 
+                                      Load(inverse_target, lane));
+          int negative = _mm_movemask_epi8(
+              _mm_cmplt_epi8(sum, _mm_setzero_si128()));
+          if (0 != (negative & EffectsMovemask(lane))) return false;
+        }
+        return true;
+      }
+
+      template <int Bytes>
+      inline bool Dominates(const BasicSignature<Bytes> &a, 
+                            const BasicSignature<Bytes> &b) {
+        for (int lane = 0; lane < Lanes<Bytes>::COUNT; ++lane) {
+          __m128i value_a = Load(a, lane);
+          __m128i value_b = Load(b, lane);
+          int effects = EffectsMovemask(lane);
+          int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(value_a, value_b));
+          int less = _mm_movemask_epi8(_mm_cmplt_epi8(value_a, value_b));
+          if ((~effects & 0xFFFF) != (equal & ~effects) ||
+              0 != (less & effects)) {
+            return false;
+          }
+        }
+        return true;
+      }
+    }  // namespace sse2
+
+    namespace impl = sse2;
+#else
+    namespace impl = scalar;
+#endif  // MONSTER_AVENGERS_SSE2
+  }  // namespace sig
+
+  template <int Bytes>
+  inline bool BasicSignature<Bytes>::IsZero() const {
+    return sig::impl::IsZero(*this);
   }
 
-  inline Signature operator|(const Signature &a, const Signature &b) {
-    Signature key;
-    for (int i = Signature::EFFECTS_BEGIN; i < sizeof(Signature); ++i) {
-      key.bytes[i] = a.bytes[i] + b.bytes[i];
-    }
-    return key;
+  template <int Bytes>
+  inline bool BasicSignature<Bytes>::operator==(
+      const BasicSignature &other) const {
+    return sig::impl::Equal(*this, other);
+  }
+
+  template <int Bytes>
+  inline void BasicSignature<Bytes>::operator*=(int multiplier) {
+    *this = sig::impl::Multiply(*this, multiplier);
+  }
+
+  template <int Bytes>
+  inline void BasicSignature<Bytes>::operator+=(const BasicSignature &other) {
+    *this = sig::impl::Add(*this, other);
+  }
+
+  template <int Bytes>
+  inline BasicSignature<Bytes> operator+(const BasicSignature<Bytes> &a, 
+                                         const BasicSignature<Bytes> &b) {
+    return sig::impl::Add(a, b);
+  }
+
+  template <int Bytes>
+  inline BasicSignature<Bytes> operator|(const BasicSignature<Bytes> &a, 
+                                         const BasicSignature<Bytes> &b) {
+    return sig::impl::AddPoints(a, b);
   }
 
 
@@ -207,10 +474,24 @@ namespace monster_avengers {
   namespace sig {
     const int EFFECTS_BEGIN = Signature::EFFECTS_BEGIN;
 
-    inline Signature InverseKey(std::vector<Effect>::const_iterator begin,
-                                std::vector<Effect>::const_iterator end) {
+    // Width (in bytes) of the narrowest Signature that holds
+    // num_effects skills, or 0 if none does.
+    inline int BytesFor(int num_effects) {
+      if (num_effects <= SmallSignature::MAX_EFFECTS) {
+        return SmallSignature::BYTES;
+      } else if (num_effects <= Signature::MAX_EFFECTS) {
+        return Signature::BYTES;
+      } else if (num_effects <= WideSignature::MAX_EFFECTS) {
+        return WideSignature::BYTES;
+      }
+      return 0;
+    }
+
+    template <typename Key = Signature>
+    inline Key InverseKey(std::vector<Effect>::const_iterator begin,
+                          std::vector<Effect>::const_iterator end) {
       
-      Signature key;
+      Key key;
       char *bytes = reinterpret_cast<char*>(&key);
       
       int byte_id = EFFECTS_BEGIN;
@@ -220,58 +501,62 @@ namespace monster_avengers {
       return key;
     }
 
-    inline Signature InverseKey(Signature input_key) {
-      Signature key = input_key;
+    template <int Bytes>
+    inline BasicSignature<Bytes> InverseKey(BasicSignature<Bytes> input_key) {
+      BasicSignature<Bytes> key = input_key;
       key.bytes[0] = 0;
       key.bytes[1] = 0;
       char *bytes = reinterpret_cast<char*>(&key);
-      for (int i = EFFECTS_BEGIN; i < sizeof(Signature); ++i) {
+      for (int i = EFFECTS_BEGIN; i < Bytes; ++i) {
         bytes[i] = -bytes[i];
       }
       return key;
     }
 
-    inline Signature AddPoints(Signature input_key, 
-                               int effect_id, int points) {
-      Signature key = input_key;
+    template <int Bytes>
+    inline BasicSignature<Bytes> AddPoints(BasicSignature<Bytes> input_key, 
+                                           int effect_id, int points) {
+      BasicSignature<Bytes> key = input_key;
       char *bytes = reinterpret_cast<char*>(&key);
       bytes[EFFECTS_BEGIN + effect_id] += points;
       return key;
     }
     
-    inline int GetPoints(Signature key, int effect_id) {
-      char *bytes = reinterpret_cast<char*>(&key);
-      return bytes[EFFECTS_BEGIN + effect_id];
+    template <int Bytes>
+    inline int GetPoints(const BasicSignature<Bytes> &key, int effect_id) {
+      return key.bytes[EFFECTS_BEGIN + effect_id];
     }
 
-    inline std::vector<Effect> KeyEffects(Signature key, 
+    template <int Bytes>
+    inline std::vector<Effect> KeyEffects(const BasicSignature<Bytes> &key, 
                                           const std::vector<Effect> &required) {
-      char *bytes = reinterpret_cast<char*>(&key);
       int byte_id = EFFECTS_BEGIN;
       std::vector<Effect> result;
       result.reserve(required.size());
       for (int i = 0; i < required.size(); ++i) {
         result.emplace_back(required[i].skill_id,
-                            bytes[byte_id++]);
+                            key.bytes[byte_id++]);
       }
       return result;
     }
 
-    inline std::vector<Effect> KeyEffects(Signature input_key, 
+    template <int Bytes>
+    inline std::vector<Effect> KeyEffects(const BasicSignature<Bytes> &key, 
                                           const Query &query) {
-      return KeyEffects(input_key, query.effects);
+      return KeyEffects(key, query.effects);
     }
 
-    inline void KeyHoles(Signature key, 
+    template <int Bytes>
+    inline void KeyHoles(const BasicSignature<Bytes> &key, 
                          int *one, int *two, int *three) {
-      char *bytes = reinterpret_cast<char*>(&key);
-      *one = bytes[0];
-      *two = bytes[1] & 15;
-      *three = bytes[1] >> 4;
+      *one = key.bytes[0];
+      *two = key.bytes[1] & 15;
+      *three = key.bytes[1] >> 4;
     }
 
-    inline Signature HolesToKey(int one, int two, int three) {
-      Signature key;
+    template <typename Key = Signature>
+    inline Key HolesToKey(int one, int two, int three) {
+      Key key;
       char *bytes = reinterpret_cast<char*>(&key);
       bytes[0] = one;
       bytes[1] = two;
@@ -279,20 +564,21 @@ namespace monster_avengers {
       return key;
     }
 
-    inline std::vector<int> KeyPointsVec(Signature key, 
+    template <int Bytes>
+    inline std::vector<int> KeyPointsVec(const BasicSignature<Bytes> &key, 
                                          int size) {
-      char *bytes = reinterpret_cast<char*>(&key);
       std::vector<int> result;
       result.reserve(size);
       for (int byte_id = EFFECTS_BEGIN; 
            byte_id < EFFECTS_BEGIN + size; 
            ++byte_id) {
-        result.push_back(bytes[byte_id]);
+        result.push_back(key.bytes[byte_id]);
       }
       return result;
     }
 
-    void ExplainSignature(Signature key,
+    template <int Bytes>
+    void ExplainSignature(const BasicSignature<Bytes> &key,
                           const std::vector<Effect> &required) {
       int i(0), j(0), k(0);
       KeyHoles(key, &i ,&j, &k);
@@ -307,12 +593,36 @@ namespace monster_avengers {
       wprintf(L"}\n");
     }
 
-    inline bool Satisfy(const Signature &test, 
-                        const Signature &inverse_target) {
-      for (int i = EFFECTS_BEGIN; i < sizeof(Signature); ++i) {
-        if (test.bytes[i] + inverse_target.bytes[i] < 0) return false;
+    template <int Bytes>
+    inline bool Satisfy(const BasicSignature<Bytes> &test, 
+                        const BasicSignature<Bytes> &inverse_target) {
+      return impl::Satisfy(test, inverse_target);
+    }
+
+    // Whether a is at least as good as b wherever b fits: they take
+    // the same holes (and body holes), and a has at least as many
+    // points on every effect.
+    template <int Bytes>
+    inline bool Dominates(const BasicSignature<Bytes> &a, 
+                          const BasicSignature<Bytes> &b) {
+      return impl::Dominates(a, b);
+    }
+
+    // Hashes all the bits of the key: the 64-bit words are mixed in
+    // with multiply-xorshift rounds.
+    template <int Bytes>
+    inline uint64_t Hash(const BasicSignature<Bytes> &key) {
+      uint64_t words[Bytes / 8];
+      memcpy(words, key.bytes, Bytes);
+      uint64_t hash = words[0] * 0x9E3779B97F4A7C15ULL;
+      hash ^= hash >> 32;
+      for (int i = 1; i < Bytes / 8; ++i) {
+        hash += words[i] * 0xC2B2AE3D27D4EB4FULL;
+        hash ^= hash >> 29;
       }
-      return true;
+      hash *= 0xBF58476D1CE4E5B9ULL;
+      hash ^= hash >> 32;
+      return hash;
     }
 
   }  // namespace sig
@@ -320,22 +630,11 @@ namespace monster_avengers {
 }  // namespace monster_avengers
 
 namespace std {
-  template <>
-  struct hash<monster_avengers::Signature> {
-    uint32_t operator()(const monster_avengers::Signature &input) const {
-      // // Jenkins Hash Function
-      // // The code is a slightly modified version from the wikipedia page.
-      // uint32_t hash = 0;
-      // for (int i = 0; i < sizeof(monster_avengers::Signature); ++i) {
-      //   hash += input.bytes[i];
-      //   hash += (hash << 10);
-      //   hash ^= (hash >> 6);
-      // }
-      // hash += (hash << 3);
-      // hash ^= (hash >> 11);
-      // hash += (hash << 15);
-      // return hash;
-      return *(const uint32_t*)(&input.bytes[0]);
+  template <int Bytes>
+  struct hash<monster_avengers::BasicSignature<Bytes> > {
+    size_t operator()(
+        const monster_avengers::BasicSignature<Bytes> &input) const {
+      return static_cast<size_t>(monster_avengers::sig::Hash(input));
     }
   };
 }  // namespace std
@@ -0,0 +1,132 @@
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "utils/signature.h"
+#include "supp/helpers.h"
+#include "supp/timer.h"
+
+using namespace monster_avengers;
+
+namespace {
+
+  const int NUM_KEYS = 4096;
+  const int NUM_ROUNDS = 2000;
+
+  std::vector<Signature> RandomKeys(int size, std::mt19937 *generator) {
+    std::uniform_int_distribution<int> holes(0, 15);
+    std::uniform_int_distribution<int> points(-20, 20);
+    std::vector<Signature> keys(size);
+    for (Signature &key : keys) {
+      key.bytes[0] = holes(*generator);
+      key.bytes[1] = holes(*generator);
+      for (size_t i = Signature::EFFECTS_BEGIN; i < sizeof(Signature); ++i) {
+        key.bytes[i] = points(*generator);
+      }
+    }
+    return keys;
+  }
+
+  // Runs op on every pair (keys[i], others[i]) NUM_ROUNDS times, and
+  // returns the nanoseconds per call. The results are folded into
+  // *sink so that the calls are not optimized away.
+  template <typename Op>
+  double Measure(const std::vector<Signature> &keys, 
+                 const std::vector<Signature> &others,
+                 Op op, int64_t *sink) {
+    Timer timer;
+    timer.Tic();
+    int64_t result = 0;
+    for (int round = 0; round < NUM_ROUNDS; ++round) {
+      for (size_t i = 0; i < keys.size(); ++i) {
+        result += op(keys[i], others[i]);
+      }
+    }
+    double duration = timer.Toc();
+    *sink += result;
+    return duration * 1e9 / (static_cast<double>(NUM_ROUNDS) * keys.size());
+  }
+
+  template <typename ScalarOp, typename FastOp>
+  void Compare(const char *name, 
+               const std::vector<Signature> &keys, 
+               const std::vector<Signature> &others,
+               ScalarOp scalar_op, FastOp fast_op,
+               int64_t *sink) {
+    double scalar = Measure(keys, others, scalar_op, sink);
+    double fast = Measure(keys, others, fast_op, sink);
+    wprintf(L"%-12s scalar %6.2lf ns   current %6.2lf ns   speedup %.2lfx\n",
+            name, scalar, fast, scalar / fast);
+  }
+
+}  // namespace
+
+int main() {
+#if MONSTER_AVENGERS_SSE2
+  wprintf(L"Signature arithmetic: SSE2\n");
+#else
+  wprintf(L"Signature arithmetic: scalar\n");
+#endif
+  std::mt19937 generator(2015);
+  std::vector<Signature> keys = RandomKeys(NUM_KEYS, &generator);
+  std::vector<Signature> others = RandomKeys(NUM_KEYS, &generator);
+  // Equal to keys except for the last point of every other key.
+  std::vector<Signature> copies = keys;
+  for (size_t i = 0; i < copies.size(); i += 2) {
+    copies[i].bytes[sizeof(Signature) - 1]++;
+  }
+  int64_t sink = 0;
+
+  Compare("operator+", keys, others,
+          [](const Signature &a, const Signature &b) {
+            return sig::scalar::Add(a, b).bytes[5];
+          },
+          [](const Signature &a, const Signature &b) {
+            return (a + b).bytes[5];
+          }, &sink);
+
+  Compare("operator|", keys, others,
+          [](const Signature &a, const Signature &b) {
+            return sig::scalar::AddPoints(a, b).bytes[5];
+          },
+          [](const Signature &a, const Signature &b) {
+            return (a | b).bytes[5];
+          }, &sink);
+
+  Compare("operator*=", keys, others,
+          [](const Signature &a, const Signature &) {
+            return sig::scalar::Multiply(a, 3).bytes[5];
+          },
+          [](const Signature &a, const Signature &) {
+            Signature key = a;
+            key *= 3;
+            return key.bytes[5];
+          }, &sink);
+
+  Compare("operator==", keys, copies,
+          [](const Signature &a, const Signature &b) {
+            return sig::scalar::Equal(a, b) ? 1 : 0;
+          },
+          [](const Signature &a, const Signature &b) {
+            return (a == b) ? 1 : 0;
+          }, &sink);
+
+  Compare("IsZero", keys, others,
+          [](const Signature &a, const Signature &) {
+            return sig::scalar::IsZero(a) ? 1 : 0;
+          },
+          [](const Signature &a, const Signature &) {
+            return a.IsZero() ? 1 : 0;
+          }, &sink);
+
+  Compare("Satisfy", keys, others,
+          [](const Signature &a, const Signature &b) {
+            return sig::scalar::Satisfy(a, b) ? 1 : 0;
+          },
+          [](const Signature &a, const Signature &b) {
+            return sig::Satisfy(a, b) ? 1 : 0;
+          }, &sink);
+
+  wprintf(L"(checksum %lld)\n", static_cast<long long>(sink));
+  return 0;
+}
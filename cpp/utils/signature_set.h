@@ -0,0 +1,266 @@
+#ifndef _MONSTER_AVENGERS_SIGNATURE_SET_
+#define _MONSTER_AVENGERS_SIGNATURE_SET_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "utils/signature.h"
+
+namespace monster_avengers {
+
+  // Open addressing index from Signature to a position in a dense
+  // array. The slots hold positions + 1 (0 is empty) and are probed
+  // linearly. The table is kept at most half full.
+  //
+  // The containers below are templated on the Signature type (Key),
+  // see BasicSignature.
+  template <typename Key>
+  class SignatureIndex {
+  public:
+    SignatureIndex() : slots_(), mask_(0) {}
+
+    // Returns the position of key in keys, or -1.
+    inline int Find(const Key &key, const std::vector<Key> &keys) const {
+      if (slots_.empty()) return -1;
+      for (size_t slot = sig::Hash(key) & mask_; ;
+           slot = (slot + 1) & mask_) {
+        uint32_t position = slots_[slot];
+        if (0 == position) return -1;
+        if (keys[position - 1] == key) return position - 1;
+      }
+    }
+
+    // Returns the position of key in keys. If key is not there, it is
+    // appended to keys, and *added is set.
+    inline int Insert(const Key &key, std::vector<Key> *keys, bool *added) {
+      if ((keys->size() + 1) * 2 > slots_.size()) {
+        Rehash(slots_.empty() ? 16 : slots_.size() * 2, *keys);
+      }
+      size_t slot = sig::Hash(key) & mask_;
+      for (; 0 != slots_[slot]; slot = (slot + 1) & mask_) {
+        if ((*keys)[slots_[slot] - 1] == key) {
+          *added = false;
+          return slots_[slot] - 1;
+        }
+      }
+      keys->push_back(key);
+      slots_[slot] = static_cast<uint32_t>(keys->size());
+      *added = true;
+      return static_cast<int>(keys->size()) - 1;
+    }
+
+    // Prepares the table for size keys.
+    void Reserve(size_t size, const std::vector<Key> &keys) {
+      size_t capacity = 16;
+      while (capacity < size * 2) capacity *= 2;
+      if (capacity > slots_.size()) Rehash(capacity, keys);
+    }
+
+    inline void Clear() {
+      slots_.clear();
+      mask_ = 0;
+    }
+
+  private:
+    void Rehash(size_t capacity, const std::vector<Key> &keys) {
+      slots_.assign(capacity, 0);
+      mask_ = capacity - 1;
+      for (size_t position = 0; position < keys.size(); ++position) {
+        size_t slot = sig::Hash(keys[position]) & mask_;
+        while (0 != slots_[slot]) slot = (slot + 1) & mask_;
+        slots_[slot] = static_cast<uint32_t>(position + 1);
+      }
+    }
+
+    std::vector<uint32_t> slots_;
+    size_t mask_;
+  };
+
+  // A set of Signatures stored contiguously in insertion order, with
+  // a flat open addressing index. Replaces std::unordered_set on the
+  // hot paths: no allocation per element, and iterating is a scan of
+  // an array.
+  template <typename Key>
+  class SignatureSet {
+  public:
+    typedef typename std::vector<Key>::const_iterator const_iterator;
+
+    SignatureSet() : keys_(), index_() {}
+
+    // Returns true if key was not in the set.
+    inline bool insert(const Key &key) {
+      bool added = false;
+      index_.Insert(key, &keys_, &added);
+      return added;
+    }
+
+    inline size_t count(const Key &key) const {
+      return (-1 == index_.Find(key, keys_)) ? 0 : 1;
+    }
+
+    inline void reserve(size_t size) {
+      keys_.reserve(size);
+      index_.Reserve(size, keys_);
+    }
+
+    inline void clear() {
+      keys_.clear();
+      index_.Clear();
+    }
+
+    inline size_t size() const {
+      return keys_.size();
+    }
+
+    inline bool empty() const {
+      return keys_.empty();
+    }
+
+    inline const_iterator begin() const {
+      return keys_.begin();
+    }
+
+    inline const_iterator end() const {
+      return keys_.end();
+    }
+
+  private:
+    std::vector<Key> keys_;
+    SignatureIndex<Key> index_;
+  };
+
+  // Orders Signatures as tuples of 64 bit words, the last word
+  // first, for sorted arrays. It is not the byte order, but any
+  // strict order would do.
+  struct SignatureLess {
+    template <int Bytes>
+    inline bool operator()(const BasicSignature<Bytes> &a, 
+                           const BasicSignature<Bytes> &b) const {
+      uint64_t a_words[Bytes / 8], b_words[Bytes / 8];
+      memcpy(a_words, a.bytes, Bytes);
+      memcpy(b_words, b.bytes, Bytes);
+      for (int i = Bytes / 8 - 1; i > 0; --i) {
+        if (a_words[i] != b_words[i]) return a_words[i] < b_words[i];
+      }
+      return a_words[0] < b_words[0];
+    }
+  };
+
+  // An immutable set of Signatures stored as a sorted array without
+  // any index. It is built once from a SignatureSet, and then only
+  // scanned or searched, so it takes no more memory than the keys.
+  template <typename Key>
+  class SortedSignatureSet {
+  public:
+    typedef typename std::vector<Key>::const_iterator const_iterator;
+
+    SortedSignatureSet() : keys_() {}
+
+    explicit SortedSignatureSet(const SignatureSet<Key> &set)
+      : keys_(set.begin(), set.end()) {
+      std::sort(keys_.begin(), keys_.end(), SignatureLess());
+    }
+
+    inline size_t count(const Key &key) const {
+      return std::binary_search(keys_.begin(), keys_.end(), key,
+                                SignatureLess()) ? 1 : 0;
+    }
+
+    inline size_t size() const {
+      return keys_.size();
+    }
+
+    inline bool empty() const {
+      return keys_.empty();
+    }
+
+    inline const_iterator begin() const {
+      return keys_.begin();
+    }
+
+    inline const_iterator end() const {
+      return keys_.end();
+    }
+
+    // Bytes held by the array.
+    inline size_t MemoryUsage() const {
+      return keys_.capacity() * sizeof(Key);
+    }
+
+  private:
+    std::vector<Key> keys_;
+  };
+
+  // A map from Signature to Value, with the same layout as
+  // SignatureSet. The entries are iterated in insertion order, as
+  // pairs of (key, value). References to the values are invalidated
+  // by insertions.
+  template <typename Key, typename Value>
+  class SignatureMap {
+  public:
+    typedef std::pair<Key, Value> Entry;
+    typedef typename std::vector<Entry>::iterator iterator;
+    typedef typename std::vector<Entry>::const_iterator const_iterator;
+
+    SignatureMap() : keys_(), entries_(), index_() {}
+
+    inline Value &operator[](const Key &key) {
+      return entries_[Position(key)].second;
+    }
+
+    // Returns the position of the key's entry, inserting a default
+    // value if needed. Positions are stable.
+    inline int Position(const Key &key) {
+      bool added = false;
+      int position = index_.Insert(key, &keys_, &added);
+      if (added) entries_.emplace_back(key, Value());
+      return position;
+    }
+
+    inline Entry &at(int position) {
+      return entries_[position];
+    }
+
+    // Returns nullptr if key is not in the map.
+    inline Value *find(const Key &key) {
+      int position = index_.Find(key, keys_);
+      return (-1 == position) ? nullptr : &entries_[position].second;
+    }
+
+    inline size_t size() const {
+      return entries_.size();
+    }
+
+    inline bool empty() const {
+      return entries_.empty();
+    }
+
+    inline iterator begin() {
+      return entries_.begin();
+    }
+
+    inline iterator end() {
+      return entries_.end();
+    }
+
+    inline const_iterator begin() const {
+      return entries_.begin();
+    }
+
+    inline const_iterator end() const {
+      return entries_.end();
+    }
+
+  private:
+    // The keys again, contiguous for the probes of the index.
+    std::vector<Key> keys_;
+    std::vector<Entry> entries_;
+    SignatureIndex<Key> index_;
+  };
+
+}  // namespace monster_avengers
+
+#endif  // _MONSTER_AVENGERS_SIGNATURE_SET_
@@ -0,0 +1,110 @@
+#include <algorithm>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "utils/signature_set.h"
+#include "supp/helpers.h"
+
+using namespace monster_avengers;
+
+namespace {
+  // Draws keys from a small pool so that they collide often.
+  template <typename Key>
+  std::vector<Key> RandomKeys(std::mt19937 *generator, int distinct,
+                              int total) {
+    std::uniform_int_distribution<int> byte_distribution(-128, 127);
+    std::vector<Key> pool(distinct);
+    for (Key &key : pool) {
+      for (int i = 0; i < Key::BYTES; ++i) {
+        key.bytes[i] = static_cast<char>(byte_distribution(*generator));
+      }
+    }
+    std::uniform_int_distribution<int> pick(0, distinct - 1);
+    std::vector<Key> keys;
+    for (int i = 0; i < total; ++i) {
+      keys.push_back(pool[pick(*generator)]);
+    }
+    return keys;
+  }
+
+  // SetTest: insert and count agree with std::map through several
+  // rounds of growth, and the keys come back in insertion order.
+  template <typename Key>
+  void SetTest(std::mt19937 *generator, bool reserve) {
+    std::vector<Key> keys = RandomKeys<Key>(generator, 3000, 10000);
+    SignatureSet<Key> set;
+    if (reserve) set.reserve(100);
+    std::map<Key, int, SignatureLess> expected;
+    std::vector<Key> order;
+    for (const Key &key : keys) {
+      bool added = 0 == expected.count(key);
+      if (added) {
+        expected[key] = static_cast<int>(order.size());
+        order.push_back(key);
+      }
+      CHECK(added == set.insert(key));
+      CHECK(1 == set.count(key));
+    }
+    CHECK(expected.size() == set.size());
+    CHECK(std::equal(order.begin(), order.end(), set.begin()));
+    for (const Key &key : RandomKeys<Key>(generator, 100, 100)) {
+      CHECK(expected.count(key) == set.count(key));
+    }
+
+    SortedSignatureSet<Key> sorted(set);
+    CHECK(set.size() == sorted.size());
+    for (const Key &key : keys) {
+      CHECK(1 == sorted.count(key));
+    }
+
+    set.clear();
+    CHECK(set.empty());
+    CHECK(0 == set.count(keys[0]));
+    CHECK(set.insert(keys[0]));
+    CHECK(1 == set.size());
+  }
+
+  // MapTest: values follow their keys through growth, and positions
+  // stay put.
+  template <typename Key>
+  void MapTest(std::mt19937 *generator) {
+    std::vector<Key> keys = RandomKeys<Key>(generator, 3000, 10000);
+    SignatureMap<Key, int> map;
+    std::map<Key, int, SignatureLess> expected;
+    std::map<Key, int, SignatureLess> positions;
+    for (const Key &key : keys) {
+      CHECK((0 == expected.count(key)) == (nullptr == map.find(key)));
+      int position = map.Position(key);
+      if (0 == positions.count(key)) {
+        CHECK(static_cast<int>(positions.size()) == position);
+        positions[key] = position;
+      }
+      CHECK(positions[key] == position);
+      map[key]++;
+      expected[key]++;
+    }
+    CHECK(expected.size() == map.size());
+    for (const auto &entry : expected) {
+      CHECK(nullptr != map.find(entry.first));
+      CHECK(entry.second == *map.find(entry.first));
+      CHECK(map.at(positions[entry.first]).first == entry.first);
+    }
+    int total = 0;
+    for (const auto &entry : map) {
+      total += entry.second;
+    }
+    CHECK(static_cast<int>(keys.size()) == total);
+  }
+}  // namespace
+
+int main() {
+  std::mt19937 generator(1);
+  SetTest<SmallSignature>(&generator, false);
+  SetTest<Signature>(&generator, false);
+  SetTest<Signature>(&generator, true);
+  SetTest<WideSignature>(&generator, false);
+  MapTest<Signature>(&generator);
+  MapTest<WideSignature>(&generator);
+  return 0;
+}
@@ -1,8 +1,43 @@
+#include <random>
+
 #include "utils/signature.h"
 #include "supp/helpers.h"
 
 using namespace monster_avengers;
 
+// ArithmeticTest: the operators should agree with the byte by byte
+// implementation, including overflowing points.
+template <typename Key>
+void ArithmeticTest(std::mt19937 *generator) {
+  std::uniform_int_distribution<int> byte_distribution(-128, 127);
+  for (int round = 0; round < 10000; ++round) {
+    Key a, b;
+    for (int i = 0; i < Key::BYTES; ++i) {
+      a.bytes[i] = static_cast<char>(byte_distribution(*generator));
+      b.bytes[i] = (round % 4 == 0) ? a.bytes[i] :
+        static_cast<char>(byte_distribution(*generator));
+    }
+    int multiplier = round % 7;
+    CHECK(sig::scalar::Equal(a + b, sig::scalar::Add(a, b)));
+    CHECK(sig::scalar::Equal(a | b, sig::scalar::AddPoints(a, b)));
+    Key c = a;
+    c *= multiplier;
+    CHECK(sig::scalar::Equal(c, sig::scalar::Multiply(a, multiplier)));
+    CHECK((a == b) == sig::scalar::Equal(a, b));
+    CHECK(sig::Satisfy(a, b) == sig::scalar::Satisfy(a, b));
+    CHECK(sig::Dominates(a, b) == sig::scalar::Dominates(a, b));
+    Key d = a;
+    int effect_byte = Key::EFFECTS_BEGIN + round % Key::MAX_EFFECTS;
+    if (-128 < d.bytes[effect_byte]) d.bytes[effect_byte]--;
+    CHECK(sig::Dominates(a, d) && sig::scalar::Dominates(a, d));
+    CHECK((d == a) == sig::Dominates(d, a));
+    CHECK(Key().IsZero());
+    CHECK(a.IsZero() == sig::scalar::IsZero(a));
+    // Widening keeps the key, and narrowing it back restores it.
+    CHECK(Key(WideSignature(a)) == a);
+  }
+}
+
 int main() {
   // InverseKeyTest
   Signature key_a = sig::HolesToKey(4, 1, 0);
@@ -26,6 +61,18 @@ int main() {
                         {{46, 10}, {43, 10}, {91, 15}});
 
   CHECK(!sig::Satisfy(key_a | key_b, inverse_key));
+
+  std::mt19937 generator(2015);
+  ArithmeticTest<SmallSignature>(&generator);
+  ArithmeticTest<Signature>(&generator);
+  ArithmeticTest<WideSignature>(&generator);
+
+  // BytesForTest
+  CHECK(8 == sig::BytesFor(5));
+  CHECK(16 == sig::BytesFor(6));
+  CHECK(16 == sig::BytesFor(13));
+  CHECK(32 == sig::BytesFor(Query::MAX_EFFECTS));
+  CHECK(0 == sig::BytesFor(Query::MAX_EFFECTS + 1));
   
   return 0;
 }